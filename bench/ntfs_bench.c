@@ -0,0 +1,647 @@
+// NTFS extraction benchmark.
+//
+// Writes synthetic raw NTFS volumes to a temporary file and extracts them
+// with ntfs_extract_all into a sink that discards the data, so the timings
+// show the cost of reading the image, not of writing the files.
+//
+// The scan volume is an MFT of small resident files in the root directory.
+// It is extracted once reading the MFT one record at a time (how the scanner
+// used to work) and once for each batch size.
+//
+// The fragmented volume holds files of one to four clusters, each split in
+// up to two runs, with all the pieces shuffled over the data area. Some files
+// are a single sparse run, which the sink is told to skip instead of being
+// read. It is extracted in MFT record order and in data offset order. The image is read
+// through a source that counts the reads which do not continue where the
+// previous one ended, and how far they jump.
+//
+// Results go to stdout as JSON, everything else to stderr.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "ntfs.h"
+#include "sink.h"
+#include "stats.h"
+#include "thread.h"
+#include "log.h"
+
+#ifdef _WIN32
+  #include <process.h>
+  #define GETPID _getpid
+#else
+  #include <unistd.h>
+  #define GETPID getpid
+#endif
+
+#define BENCH_CLUSTER_SIZE 4096
+#define BENCH_RECORD_SIZE 1024
+#define BENCH_MFT_CLUSTER 4
+#define BENCH_FIRST_FILE 16
+#define BENCH_ROOT_RECORD 5
+#define BENCH_FILE_SIZE 48
+#define BENCH_MAX_LIST 16
+#define BENCH_MAX_CLUSTERS 4
+#define BENCH_SPLIT_EVERY 8
+#define BENCH_SPARSE_EVERY 16
+
+typedef struct {
+    DataRun runs[2];
+    int run_count;
+    uint64_t size;
+} BenchFile;
+
+typedef struct {
+    uint64_t records;
+    uint64_t files;
+    uint64_t batches_kib[BENCH_MAX_LIST];
+    int batch_count;
+    int repeat;
+    const char* dir;
+} BenchOptions;
+
+static size_t put_resident_attr(uint8_t* at, uint32_t type, const void* value, uint32_t value_length) {
+    AttributeHeader* header = (AttributeHeader*)at;
+    uint32_t value_offset = 24;
+    uint32_t length = (value_offset + value_length + 7) & ~7u;
+    memset(at, 0, length);
+    header->type = type;
+    header->length = length;
+    header->data.resident.value_length = value_length;
+    header->data.resident.value_offset = (uint16_t)value_offset;
+    memcpy(at + value_offset, value, value_length);
+    return length;
+}
+
+// A non-resident attribute whose mapping pairs describe runs.
+static size_t put_nonresident_attr(uint8_t* at, uint32_t type, const DataRun* runs, int run_count, uint64_t size) {
+    uint8_t pairs[64];
+    size_t pairs_length = 0;
+    uint64_t clusters = 0;
+    int64_t previous = 0;
+    for (int i = 0; i < run_count; i++) {
+        int64_t delta = (int64_t)runs[i].offset - previous;
+        int length_bytes = 1;
+        while (length_bytes < 8 && (runs[i].length >> (length_bytes * 8)) != 0) {
+            length_bytes++;
+        }
+        // A sparse run has no offset and leaves the base where it was.
+        int offset_bytes = runs[i].sparse ? 0 : 1;
+        while (offset_bytes > 0 && offset_bytes < 8 &&
+            (delta < -((int64_t)1 << (offset_bytes * 8 - 1)) || delta >= ((int64_t)1 << (offset_bytes * 8 - 1)))) {
+            offset_bytes++;
+        }
+        pairs[pairs_length++] = (uint8_t)(length_bytes | (offset_bytes << 4));
+        for (int b = 0; b < length_bytes; b++) {
+            pairs[pairs_length++] = (uint8_t)(runs[i].length >> (b * 8));
+        }
+        for (int b = 0; b < offset_bytes; b++) {
+            pairs[pairs_length++] = (uint8_t)((uint64_t)delta >> (b * 8));
+        }
+        if (!runs[i].sparse) {
+            previous = (int64_t)runs[i].offset;
+        }
+        clusters += runs[i].length;
+    }
+    pairs[pairs_length++] = 0;
+
+    AttributeHeader* header = (AttributeHeader*)at;
+    uint32_t length = (uint32_t)((64 + pairs_length + 7) & ~(size_t)7);
+    memset(at, 0, length);
+    header->type = type;
+    header->length = length;
+    header->non_resident = 1;
+    header->data.non_resident.highest_vcn = clusters - 1;
+    header->data.non_resident.mapping_pairs_offset = 64;
+    header->data.non_resident.allocated_size = clusters * BENCH_CLUSTER_SIZE;
+    header->data.non_resident.data_size = size;
+    header->data.non_resident.initialized_size = size;
+    memcpy(at + 64, pairs, pairs_length);
+    return length;
+}
+
+// A record with the update sequence array at 0x30 and its attributes from
+// 0x38. The last two bytes of each sector are swapped into the array the
+// way NTFS writes them, so the scanner has real fixups to apply.
+// Record 0 is the $MFT, the others are files with data in file's runs, or
+// with resident data when file is NULL.
+static void build_record(uint8_t* record, uint64_t number, uint64_t mft_size, const BenchFile* file) {
+    memset(record, 0, BENCH_RECORD_SIZE);
+    MFTRecordHeader* header = (MFTRecordHeader*)record;
+    memcpy(header->magic, "FILE", 4);
+    header->usa_offset = 0x30;
+    header->usa_count = BENCH_RECORD_SIZE / 512 + 1;
+    header->sequence_number = 1;
+    header->link_count = 1;
+    header->attrs_offset = 0x38;
+    header->flags = MFT_RECORD_IN_USE;
+    header->bytes_allocated = BENCH_RECORD_SIZE;
+    header->record_number = (uint32_t)number;
+
+    uint8_t* attr = record + header->attrs_offset;
+    if (number == 0) {
+        // $MFT: a non-resident $DATA with one run covering the whole MFT.
+        DataRun run = { .offset = BENCH_MFT_CLUSTER, .length = mft_size / BENCH_CLUSTER_SIZE, .sparse = false };
+        attr += put_nonresident_attr(attr, DATA_ATTR, &run, 1, mft_size);
+    }
+    else {
+        FileNameAttribute name;
+        memset(&name, 0, sizeof(name));
+        name.parent_directory = BENCH_ROOT_RECORD | (1ULL << 48);
+        name.modification_time = 0x01D0000000000000ULL + number;
+        name.real_size = file ? file->size : BENCH_FILE_SIZE;
+        name.namespace = 1;
+        char text[32];
+        int length = snprintf(text, sizeof(text), "file_%08llu.bin", (unsigned long long)number);
+        for (int i = 0; i < length; i++) {
+            name.name[i] = (uint16_t)text[i];
+        }
+        name.name_length = (uint8_t)length;
+        attr += put_resident_attr(attr, FILE_NAME_ATTR, &name,
+            (uint32_t)(offsetof(FileNameAttribute, name) + length * sizeof(uint16_t)));
+
+        if (file) {
+            attr += put_nonresident_attr(attr, DATA_ATTR, file->runs, file->run_count, file->size);
+        }
+        else {
+            uint8_t contents[BENCH_FILE_SIZE];
+            memset(contents, (int)(number & 0xFF), sizeof(contents));
+            attr += put_resident_attr(attr, DATA_ATTR, contents, sizeof(contents));
+        }
+    }
+    memset(attr, 0xFF, 4);
+    header->bytes_used = (uint32_t)(attr + 8 - record);
+
+    uint16_t* usa = (uint16_t*)(record + header->usa_offset);
+    usa[0] = 1;
+    for (int i = 1; i < header->usa_count; i++) {
+        uint16_t* tail = (uint16_t*)(record + i * 512 - 2);
+        usa[i] = *tail;
+        *tail = usa[0];
+    }
+}
+
+static uint64_t mft_size_for(uint64_t records) {
+    return (records * BENCH_RECORD_SIZE + BENCH_CLUSTER_SIZE - 1) / BENCH_CLUSTER_SIZE * BENCH_CLUSTER_SIZE;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Gives count files their sizes and runs, laid out from first_cluster on
+// in an order unrelated to their records, as on a volume where files were
+// rewritten over time. Every BENCH_SPLIT_EVERY-th file of two clusters or
+// more has its tail placed after all the others, and every
+// BENCH_SPARSE_EVERY-th file is a hole that takes no clusters.
+static BenchFile* plan_fragmented_files(uint64_t count, uint64_t first_cluster, uint64_t* data_clusters) {
+    BenchFile* files = calloc((size_t)count, sizeof(BenchFile));
+    uint64_t* order = malloc((size_t)count * sizeof(uint64_t));
+    if (!files || !order) {
+        free(files);
+        free(order);
+        return NULL;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t clusters = 1 + next_random(&state) % BENCH_MAX_CLUSTERS;
+        files[i].size = (clusters - 1) * BENCH_CLUSTER_SIZE + 1 + next_random(&state) % BENCH_CLUSTER_SIZE;
+        order[i] = i;
+    }
+    for (uint64_t i = count; i > 1; i--) {
+        uint64_t j = next_random(&state) % i;
+        uint64_t swap = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = swap;
+    }
+
+    uint64_t cluster = first_cluster;
+    for (uint64_t i = 0; i < count; i++) {
+        BenchFile* file = &files[order[i]];
+        uint64_t clusters = (file->size + BENCH_CLUSTER_SIZE - 1) / BENCH_CLUSTER_SIZE;
+        file->run_count = 1;
+        if (i % BENCH_SPARSE_EVERY == 1) {
+            file->runs[0].length = clusters;
+            file->runs[0].sparse = true;
+            continue;
+        }
+        uint64_t head = (clusters > 1 && i % BENCH_SPLIT_EVERY == 0) ? clusters / 2 : clusters;
+        file->runs[0].offset = cluster;
+        file->runs[0].length = head;
+        cluster += head;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        BenchFile* file = &files[order[i]];
+        uint64_t clusters = (file->size + BENCH_CLUSTER_SIZE - 1) / BENCH_CLUSTER_SIZE;
+        if (file->runs[0].length < clusters) {
+            file->runs[1].offset = cluster;
+            file->runs[1].length = clusters - file->runs[0].length;
+            file->run_count = 2;
+            cluster += file->runs[1].length;
+        }
+    }
+
+    free(order);
+    *data_clusters = cluster - first_cluster;
+    return files;
+}
+
+// records MFT records, files from record BENCH_FIRST_FILE on. With files,
+// those use its runs and data_clusters of data follow the MFT; without, the
+// files are resident.
+static bool create_volume(const char* path, uint64_t records, const BenchFile* files, uint64_t data_clusters) {
+    uint64_t mft_size = mft_size_for(records);
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    uint8_t boot[BENCH_MFT_CLUSTER * BENCH_CLUSTER_SIZE];
+    memset(boot, 0, sizeof(boot));
+    NTFSBootSector* sector = (NTFSBootSector*)boot;
+    sector->jump[0] = 0xEB;
+    sector->jump[1] = 0x52;
+    sector->jump[2] = 0x90;
+    memcpy(sector->signature, NTFS_SIGNATURE, 8);
+    sector->bytes_per_sector = 512;
+    sector->sectors_per_cluster = BENCH_CLUSTER_SIZE / 512;
+    sector->total_sectors = (sizeof(boot) + mft_size + data_clusters * BENCH_CLUSTER_SIZE) / 512;
+    sector->mft_cluster_number = BENCH_MFT_CLUSTER;
+    sector->clusters_per_mft_record = -10;     // 2^10 = 1 KiB records
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+    bool ok = fwrite(boot, 1, sizeof(boot), file) == sizeof(boot);
+
+    uint8_t record[BENCH_RECORD_SIZE];
+    for (uint64_t i = 0; ok && i < mft_size / BENCH_RECORD_SIZE; i++) {
+        if (i == 0 || (i >= BENCH_FIRST_FILE && i < records)) {
+            build_record(record, i, mft_size, (files && i > 0) ? &files[i - BENCH_FIRST_FILE] : NULL);
+        }
+        else {
+            memset(record, 0, sizeof(record));
+        }
+        ok = fwrite(record, 1, sizeof(record), file) == sizeof(record);
+    }
+
+    uint8_t cluster[BENCH_CLUSTER_SIZE];
+    for (uint64_t i = 0; ok && i < data_clusters; i++) {
+        memset(cluster, (int)(i & 0xFF), sizeof(cluster));
+        ok = fwrite(cluster, 1, sizeof(cluster), file) == sizeof(cluster);
+    }
+
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+typedef struct {
+    ImageSource file;
+    uint64_t next_offset;
+    uint64_t reads;
+    uint64_t seeks;         // reads that did not start within a cluster of where the previous one ended
+    uint64_t seek_bytes;    // total distance of those jumps
+} TrackedSource;
+
+static bool tracked_read(void* opaque, void* buffer, uint64_t offset, size_t size) {
+    TrackedSource* tracked = (TrackedSource*)opaque;
+    // A file's last cluster is read only up to its size, so skipping the
+    // rest of it is not a seek.
+    uint64_t distance = (offset > tracked->next_offset) ?
+        offset - tracked->next_offset : tracked->next_offset - offset;
+    if (distance >= BENCH_CLUSTER_SIZE) {
+        tracked->seeks++;
+        tracked->seek_bytes += distance;
+    }
+    tracked->reads++;
+    tracked->next_offset = offset + size;
+    return image_source_read(&tracked->file, buffer, offset, size);
+}
+
+static void tracked_close(void* opaque) {
+    image_source_close(&((TrackedSource*)opaque)->file);
+}
+
+static bool null_add_directory(void* opaque, const char* path) {
+    (void)opaque;
+    (void)path;
+    return true;
+}
+
+// What the null sink was given, which is all it keeps.
+typedef struct {
+    uint64_t written;
+    uint64_t skipped;       // sparse bytes, which are never read
+} NullSinkCounts;
+
+static void* null_open_file(void* opaque, const char* path, uint64_t size) {
+    (void)path;
+    (void)size;
+    return opaque;
+}
+
+static bool null_write_file(void* opaque, void* file, const void* data, size_t size) {
+    (void)file;
+    (void)data;
+    ((NullSinkCounts*)opaque)->written += size;
+    return true;
+}
+
+static bool null_skip_file(void* opaque, void* file, uint64_t size) {
+    (void)file;
+    ((NullSinkCounts*)opaque)->skipped += size;
+    return true;
+}
+
+static bool null_close_file(void* opaque, void* file, bool complete) {
+    (void)opaque;
+    (void)file;
+    return complete;
+}
+
+static void init_null_sink(ExtractSink* sink, NullSinkCounts* counts) {
+    memset(sink, 0, sizeof(ExtractSink));
+    memset(counts, 0, sizeof(NullSinkCounts));
+    sink->add_directory = null_add_directory;
+    sink->open_file = null_open_file;
+    sink->write_file = null_write_file;
+    sink->skip_file = null_skip_file;
+    sink->close_file = null_close_file;
+    sink->opaque = counts;
+    sink->separator = PATH_SEPARATOR[0];
+}
+
+// batch_bytes 0 reads one record at a time.
+static bool run_scan(const char* path, uint32_t batch_bytes, uint64_t* elapsed_ns, uint64_t* files) {
+    NullSinkCounts counts;
+    ExtractSink sink;
+    init_null_sink(&sink, &counts);
+
+    ImageStats stats;
+    memset(&stats, 0, sizeof(stats));
+    ImageStats* previous = stats_attach(&stats);
+
+    NTFSContext ctx;
+    bool ok = ntfs_init(&ctx, path, 0);
+    if (ok) {
+        ctx.mft_batch_size = batch_bytes ? batch_bytes : ctx.mft_record_size;
+        uint64_t start = monotonic_ns();
+        ok = ntfs_extract_all(&ctx, &sink);
+        *elapsed_ns = monotonic_ns() - start;
+        ntfs_close(&ctx);
+    }
+
+    stats_attach(previous);
+    *files = stats.counters[STAT_FILES_EXTRACTED];
+    return ok;
+}
+
+static bool run_extract(const char* path, bool mft_order, uint64_t* elapsed_ns, NullSinkCounts* counts,
+    TrackedSource* tracked) {
+    ExtractSink sink;
+    init_null_sink(&sink, counts);
+
+    memset(tracked, 0, sizeof(TrackedSource));
+    if (!image_source_open_file(&tracked->file, path)) {
+        return false;
+    }
+    ImageSource source;
+    memset(&source, 0, sizeof(source));
+    source.read = tracked_read;
+    source.close = tracked_close;
+    source.opaque = tracked;
+    source.size = tracked->file.size;
+
+    NTFSContext ctx;
+    if (!ntfs_init_source(&ctx, &source)) {
+        return false;
+    }
+    ctx.extract_in_mft_order = mft_order;
+    tracked->reads = 0;
+    tracked->seeks = 0;
+    tracked->seek_bytes = 0;
+
+    uint64_t start = monotonic_ns();
+    bool ok = ntfs_extract_all(&ctx, &sink);
+    *elapsed_ns = monotonic_ns() - start;
+    ntfs_close(&ctx);
+    return ok;
+}
+
+static void print_result(bool* first, const char* mode, uint32_t batch_bytes, uint64_t records, uint64_t elapsed_ns) {
+    double seconds = elapsed_ns / 1e9;
+    double rate = (seconds > 0) ? records / seconds : 0;
+    printf("%s\n    {\"mode\": \"%s\", \"batch_bytes\": %u, \"records\": %llu, \"seconds\": %.6f, "
+        "\"records_per_s\": %.0f}",
+        *first ? "" : ",", mode, batch_bytes, (unsigned long long)records, seconds, rate);
+    fflush(stdout);
+    *first = false;
+}
+
+static void print_extract_result(bool* first, const char* mode, uint64_t files, uint64_t elapsed_ns,
+    const TrackedSource* tracked) {
+    double seconds = elapsed_ns / 1e9;
+    double rate = (seconds > 0) ? files / seconds : 0;
+    printf("%s\n    {\"mode\": \"%s\", \"files\": %llu, \"seconds\": %.6f, \"files_per_s\": %.0f, "
+        "\"reads\": %llu, \"seeks\": %llu, \"seek_mib\": %.1f}",
+        *first ? "" : ",", mode, (unsigned long long)files, seconds, rate,
+        (unsigned long long)tracked->reads, (unsigned long long)tracked->seeks,
+        tracked->seek_bytes / (1024.0 * 1024.0));
+    fflush(stdout);
+    *first = false;
+}
+
+static int parse_list(const char* text, uint64_t* values, int max_values) {
+    int count = 0;
+    while (*text && count < max_values) {
+        char* end;
+        unsigned long long value = strtoull(text, &end, 10);
+        if (end == text || value == 0) {
+            return 0;
+        }
+        values[count++] = value;
+        text = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return 0;
+        }
+    }
+    return count;
+}
+
+static void print_usage(void) {
+    fprintf(stderr, "usage: ntfs_bench [--records N] [--batch-kib KIB,...] [--files N] [--repeat N] [--dir DIR]\n");
+    fprintf(stderr, "  --records    MFT records in the scan volume (default: 262144)\n");
+    fprintf(stderr, "  --batch-kib  MFT batch sizes to compare with per-record reads (default: 64,1024,%d)\n",
+        NTFS_MFT_BATCH_SIZE / 1024);
+    fprintf(stderr, "  --files      Files in the fragmented volume, 0 skips it (default: 16384)\n");
+    fprintf(stderr, "  --repeat     Runs per measurement, the fastest one is reported (default: 3)\n");
+    fprintf(stderr, "  --dir        Where to create the volume (default: TMPDIR or the system temp dir)\n");
+}
+
+static bool parse_options(int argc, char* argv[], BenchOptions* opts) {
+    memset(opts, 0, sizeof(BenchOptions));
+    opts->records = 262144;
+    opts->files = 16384;
+    opts->batches_kib[0] = 64;
+    opts->batches_kib[1] = 1024;
+    opts->batches_kib[2] = NTFS_MFT_BATCH_SIZE / 1024;
+    opts->batch_count = 3;
+    opts->repeat = 3;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--records") == 0 && has_value) {
+            opts->records = strtoull(argv[++i], NULL, 10);
+            if (opts->records <= BENCH_FIRST_FILE) {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--files") == 0 && has_value) {
+            opts->files = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(arg, "--batch-kib") == 0 && has_value) {
+            opts->batch_count = parse_list(argv[++i], opts->batches_kib, BENCH_MAX_LIST);
+            if (opts->batch_count == 0) {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--repeat") == 0 && has_value) {
+            opts->repeat = atoi(argv[++i]);
+            if (opts->repeat < 1) {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--dir") == 0 && has_value) {
+            opts->dir = argv[++i];
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions opts;
+    if (!parse_options(argc, argv, &opts)) {
+        print_usage();
+        return 1;
+    }
+
+    const char* dir = opts.dir;
+    if (!dir) {
+        dir = getenv("TMPDIR");
+        if (!dir || !*dir) {
+#ifdef _WIN32
+            dir = getenv("TEMP");
+            if (!dir || !*dir) {
+                dir = ".";
+            }
+#else
+            dir = "/tmp";
+#endif
+        }
+    }
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s%sntfs_bench_%lu.ntfs", dir, PATH_SEPARATOR, (unsigned long)GETPID());
+
+    fprintf(stderr, "Generating a volume with %llu MFT records...\n", (unsigned long long)opts.records);
+    if (!create_volume(path, opts.records, NULL, 0)) {
+        fprintf(stderr, "Could not create %s\n", path);
+        remove(path);
+        return 1;
+    }
+
+    // Library messages would corrupt the JSON on stdout; collect them and
+    // forward them to stderr instead.
+    LogBuffer log;
+    log_buffer_init(&log);
+    log_capture(&log);
+
+    uint64_t expected_files = opts.records - BENCH_FIRST_FILE;
+    bool ok = true;
+    bool first = true;
+    printf("{\n  \"record_size\": %d,\n  \"repeat\": %d,\n  \"results\": [", BENCH_RECORD_SIZE, opts.repeat);
+
+    for (int b = -1; ok && b < opts.batch_count; b++) {
+        uint32_t batch_bytes = (b < 0) ? 0 : (uint32_t)(opts.batches_kib[b] * 1024);
+        uint64_t best = UINT64_MAX;
+        for (int r = 0; ok && r < opts.repeat; r++) {
+            uint64_t elapsed = 0;
+            uint64_t files = 0;
+            ok = run_scan(path, batch_bytes, &elapsed, &files);
+            if (ok && files != expected_files) {
+                fprintf(stderr, "Scan found %llu files, expected %llu\n",
+                    (unsigned long long)files, (unsigned long long)expected_files);
+                ok = false;
+            }
+            best = (elapsed < best) ? elapsed : best;
+        }
+        if (ok) {
+            print_result(&first, (b < 0) ? "per-record" : "batched",
+                batch_bytes ? batch_bytes : BENCH_RECORD_SIZE, opts.records, best);
+        }
+        log_buffer_flush(&log, stderr);
+    }
+
+    if (ok && opts.files > 0) {
+        uint64_t records = BENCH_FIRST_FILE + opts.files;
+        uint64_t data_clusters = 0;
+        BenchFile* files = plan_fragmented_files(opts.files,
+            BENCH_MFT_CLUSTER + mft_size_for(records) / BENCH_CLUSTER_SIZE, &data_clusters);
+        uint64_t expected_bytes = 0;
+        uint64_t expected_sparse = 0;
+        for (uint64_t i = 0; files && i < opts.files; i++) {
+            expected_bytes += files[i].size;
+            if (files[i].runs[0].sparse) {
+                expected_sparse += files[i].size;
+            }
+        }
+
+        fprintf(stderr, "Generating a fragmented volume with %llu files...\n", (unsigned long long)opts.files);
+        if (!files || !create_volume(path, records, files, data_clusters)) {
+            fprintf(stderr, "Could not create %s\n", path);
+            ok = false;
+        }
+        free(files);
+
+        for (int m = 0; ok && m < 2; m++) {
+            bool mft_order = (m == 0);
+            uint64_t best = UINT64_MAX;
+            TrackedSource tracked;
+            for (int r = 0; ok && r < opts.repeat; r++) {
+                uint64_t elapsed = 0;
+                NullSinkCounts counts;
+                ok = run_extract(path, mft_order, &elapsed, &counts, &tracked);
+                if (ok && (counts.written + counts.skipped != expected_bytes || counts.skipped != expected_sparse)) {
+                    fprintf(stderr, "Extracted %llu bytes with %llu sparse, expected %llu with %llu sparse\n",
+                        (unsigned long long)(counts.written + counts.skipped), (unsigned long long)counts.skipped,
+                        (unsigned long long)expected_bytes, (unsigned long long)expected_sparse);
+                    ok = false;
+                }
+                best = (elapsed < best) ? elapsed : best;
+            }
+            if (ok) {
+                print_extract_result(&first, mft_order ? "extract-mft-order" : "extract-offset-order",
+                    opts.files, best, &tracked);
+            }
+            log_buffer_flush(&log, stderr);
+        }
+    }
+
+    printf("\n  ],\n  \"ok\": %s\n}\n", ok ? "true" : "false");
+
+    log_capture(NULL);
+    log_buffer_flush(&log, stderr);
+    log_buffer_close(&log);
+
+    remove(path);
+    return ok ? 0 : 1;
+}
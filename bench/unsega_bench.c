@@ -0,0 +1,466 @@
+// Decrypt throughput benchmark.
+//
+// Builds synthetic containers in a temporary directory: a random NTFS-looking
+// payload encrypted page by page with a test key, behind a valid encrypted
+// BootId. The key is handed over through the regular <GAMEID>.bin custom key
+// file, so container_open goes through the same BootId, key and file IV steps
+// as a real image. Each container is then decrypted the way process_file does
+// it (pipeline: file -> decrypt_stream -> file) and, to separate the CPU from
+// the disk, purely in memory with page_decryptor_run. Results go to stdout as
+// JSON, everything else to stderr.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <openssl/evp.h>
+#include "bootid.h"
+#include "crypto.h"
+#include "container.h"
+#include "decrypt.h"
+#include "aes_kernel.h"
+#include "thread.h"
+#include "log.h"
+
+#ifdef _WIN32
+  #include <direct.h>
+  #define CHDIR _chdir
+  #define GETCWD _getcwd
+  #define RMDIR _rmdir
+#else
+  #include <unistd.h>
+  #define CHDIR chdir
+  #define GETCWD getcwd
+  #define RMDIR rmdir
+#endif
+
+#define BENCH_GAME_ID "BNCH"
+#define BENCH_BLOCK_SIZE 0x10000
+#define BENCH_GEN_CHUNK (1024 * 1024)
+#define BENCH_MEMORY_LIMIT ((uint64_t)256 * 1024 * 1024)
+#define BENCH_MAX_LIST 16
+
+typedef struct {
+    uint64_t sizes_mib[BENCH_MAX_LIST];
+    int size_count;
+    int threads[BENCH_MAX_LIST];
+    int thread_count;
+    int repeat;
+    int depth;
+    bool use_aes_kernel;
+    const char* dir;
+} BenchOptions;
+
+static const uint8_t BENCH_KEY[16] = {
+    0x01, 0x08, 0x0f, 0x16, 0x1d, 0x24, 0x2b, 0x32,
+    0x39, 0x40, 0x47, 0x4e, 0x55, 0x5c, 0x63, 0x6a
+};
+
+static const uint8_t BENCH_FILE_IV[16] = {
+    0xa5, 0xa8, 0xbf, 0xb2, 0x91, 0x9c, 0xeb, 0xe6,
+    0xcd, 0xc0, 0x37, 0x3a, 0x19, 0x14, 0x63, 0x6e
+};
+
+// Deterministic payload so the decrypted output can be checked without
+// keeping a plaintext copy around.
+static void fill_payload(uint8_t* buffer, size_t size, uint64_t offset) {
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t x = (offset + i) * 0x9E3779B97F4A7C15ULL + 1;
+        x ^= x >> 31;
+        x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 29;
+        size_t n = (size - i < 8) ? size - i : 8;
+        memcpy(buffer + i, &x, n);
+    }
+    if (offset == 0 && size >= 16) {
+        // calculate_file_iv recovers the file IV from the known NTFS boot sector start.
+        memcpy(buffer, NTFS_HEADER, 16);
+    }
+}
+
+static bool write_key_file(void) {
+    FILE* file = fopen(BENCH_GAME_ID ".bin", "wb");
+    if (!file) {
+        perror(BENCH_GAME_ID ".bin");
+        return false;
+    }
+    bool ok = fwrite(BENCH_KEY, 1, 16, file) == 16;
+    return (fclose(file) == 0) && ok;
+}
+
+static bool write_bootid(FILE* file, uint64_t payload_size) {
+    BootId bootid;
+    memset(&bootid, 0, sizeof(BootId));
+    bootid.length = sizeof(BootId);
+    memcpy(bootid.signature, "BTID", 4);
+    bootid.container_type = CONTAINER_TYPE_APP;
+    bootid.use_custom_iv = true;
+    memcpy(bootid.game_id, BENCH_GAME_ID, 4);
+    bootid.target_timestamp.year = 2024;
+    bootid.target_timestamp.month = 1;
+    bootid.target_timestamp.day = 1;
+    bootid.target_version.version.major = 1;
+    bootid.block_size = BENCH_BLOCK_SIZE;
+    bootid.header_block_count = 1;
+    bootid.block_count = 1 + payload_size / BENCH_BLOCK_SIZE;
+
+    uint8_t header[BENCH_BLOCK_SIZE];
+    memset(header, 0, sizeof(header));
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    int out_len = 0;
+    bool ok = ctx &&
+        EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, BOOTID_KEY, BOOTID_IV) &&
+        EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+        EVP_EncryptUpdate(ctx, header, &out_len, (const uint8_t*)&bootid, sizeof(BootId));
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ok && fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
+
+static bool create_container(const char* path, uint64_t payload_size) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    uint8_t* plain = malloc(BENCH_GEN_CHUNK);
+    uint8_t* cipher_text = malloc(BENCH_GEN_CHUNK);
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    bool ok = plain && cipher_text && ctx && write_bootid(file, payload_size);
+
+    for (uint64_t offset = 0; ok && offset < payload_size; offset += BENCH_GEN_CHUNK) {
+        size_t chunk = (payload_size - offset > BENCH_GEN_CHUNK) ? BENCH_GEN_CHUNK : (size_t)(payload_size - offset);
+        fill_payload(plain, chunk, offset);
+
+        for (size_t page = 0; ok && page < chunk; page += DECRYPT_PAGE_SIZE) {
+            uint8_t page_iv[16];
+            int out_len = 0;
+            calculate_page_iv(offset + page, BENCH_FILE_IV, page_iv);
+            ok = EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, BENCH_KEY, page_iv) &&
+                EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+                EVP_EncryptUpdate(ctx, cipher_text + page, &out_len, plain + page, DECRYPT_PAGE_SIZE);
+        }
+        ok = ok && fwrite(cipher_text, 1, chunk, file) == chunk;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    free(plain);
+    free(cipher_text);
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+static bool verify_output(const char* path, uint64_t payload_size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    uint8_t* expected = malloc(BENCH_GEN_CHUNK);
+    uint8_t* actual = malloc(BENCH_GEN_CHUNK);
+    bool ok = expected && actual;
+
+    for (uint64_t offset = 0; ok && offset < payload_size; offset += BENCH_GEN_CHUNK) {
+        size_t chunk = (payload_size - offset > BENCH_GEN_CHUNK) ? BENCH_GEN_CHUNK : (size_t)(payload_size - offset);
+        fill_payload(expected, chunk, offset);
+        ok = fread(actual, 1, chunk, file) == chunk && memcmp(expected, actual, chunk) == 0;
+    }
+
+    free(expected);
+    free(actual);
+    fclose(file);
+    return ok;
+}
+
+// One pass over the container the way process_file decrypts it.
+static bool run_pipeline(const char* container_path, const char* output_path, int threads, int depth,
+    uint64_t* elapsed_ns) {
+    Container container;
+    if (!container_open(&container, container_path)) {
+        return false;
+    }
+
+    PageDecryptor decryptor;
+    if (!page_decryptor_init(&decryptor, container.key, container.iv, threads)) {
+        container_close(&container);
+        return false;
+    }
+
+    FILE* output = fopen(output_path, "wb");
+    bool ok = output && FSEEKO(container.fp, container.data_offset, SEEK_SET) == 0;
+
+    StreamStats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (ok) {
+        StreamConfig config;
+        memset(&config, 0, sizeof(config));
+        config.input = container.fp;
+        config.output = output;
+        config.size = container.payload_size;
+        config.depth = depth;
+        config.show_progress = false;
+        ok = decrypt_stream(&decryptor, &config, &stats);
+    }
+    if (output && fclose(output) != 0) {
+        ok = false;
+    }
+
+    page_decryptor_close(&decryptor);
+    container_close(&container);
+    *elapsed_ns = stats.elapsed_ns;
+    return ok;
+}
+
+// Decrypts an in-memory copy of the payload; no file I/O in the timing.
+static bool run_memory(const char* container_path, uint64_t size, int threads, uint64_t* elapsed_ns) {
+    Container container;
+    if (!container_open(&container, container_path)) {
+        return false;
+    }
+
+    uint8_t* in = malloc((size_t)size);
+    uint8_t* out = malloc((size_t)size);
+    PageDecryptor decryptor;
+    bool ok = in && out &&
+        FSEEKO(container.fp, container.data_offset, SEEK_SET) == 0 &&
+        fread(in, 1, (size_t)size, container.fp) == size &&
+        page_decryptor_init(&decryptor, container.key, container.iv, threads);
+
+    if (ok) {
+        uint64_t start = monotonic_ns();
+        for (uint64_t offset = 0; ok && offset < size; offset += DECRYPT_CHUNK_SIZE) {
+            size_t chunk = (size - offset > DECRYPT_CHUNK_SIZE) ? DECRYPT_CHUNK_SIZE : (size_t)(size - offset);
+            ok = page_decryptor_run(&decryptor, in + offset, out + offset, chunk, offset);
+        }
+        *elapsed_ns = monotonic_ns() - start;
+        page_decryptor_close(&decryptor);
+
+        uint8_t expected[DECRYPT_PAGE_SIZE];
+        fill_payload(expected, sizeof(expected), 0);
+        ok = ok && memcmp(out, expected, sizeof(expected)) == 0;
+    }
+
+    free(in);
+    free(out);
+    container_close(&container);
+    return ok;
+}
+
+static void print_result(bool* first, const char* mode, uint64_t size, int threads, uint64_t elapsed_ns) {
+    double seconds = elapsed_ns / 1e9;
+    double gbps = (seconds > 0) ? size / seconds / 1e9 : 0;
+    double pages = (seconds > 0) ? (size / DECRYPT_PAGE_SIZE) / seconds : 0;
+    printf("%s\n    {\"mode\": \"%s\", \"size_bytes\": %llu, \"threads\": %d, \"seconds\": %.6f, "
+        "\"gb_per_s\": %.3f, \"pages_per_s\": %.0f}",
+        *first ? "" : ",", mode, (unsigned long long)size, threads, seconds, gbps, pages);
+    fflush(stdout);
+    *first = false;
+}
+
+static int parse_list(const char* text, uint64_t* values, int max_values) {
+    int count = 0;
+    while (*text && count < max_values) {
+        char* end;
+        unsigned long long value = strtoull(text, &end, 10);
+        if (end == text || value == 0) {
+            return 0;
+        }
+        values[count++] = value;
+        text = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return 0;
+        }
+    }
+    return count;
+}
+
+static void print_usage(void) {
+    fprintf(stderr, "usage: unsega_bench [--sizes MIB,...] [--threads N,...] [--repeat N] [--depth N] [--dir DIR] [--evp]\n");
+    fprintf(stderr, "  --sizes     Payload sizes in MiB (default: 16,64,256)\n");
+    fprintf(stderr, "  --threads   Decryption thread counts (default: 1, 2, 4, ... up to the number of cores)\n");
+    fprintf(stderr, "  --repeat    Runs per measurement, the fastest one is reported (default: 3)\n");
+    fprintf(stderr, "  --depth     Pipeline depth (default: %d)\n", DECRYPT_DEFAULT_DEPTH);
+    fprintf(stderr, "  --dir       Where to create the scratch directory (default: TMPDIR or the system temp dir)\n");
+    fprintf(stderr, "  --evp       Benchmark OpenSSL EVP instead of the built-in AES kernel\n");
+}
+
+static bool parse_options(int argc, char* argv[], BenchOptions* opts) {
+    memset(opts, 0, sizeof(BenchOptions));
+    opts->sizes_mib[0] = 16;
+    opts->sizes_mib[1] = 64;
+    opts->sizes_mib[2] = 256;
+    opts->size_count = 3;
+    opts->repeat = 3;
+    opts->depth = DECRYPT_DEFAULT_DEPTH;
+    opts->use_aes_kernel = true;
+
+    int cores = cpu_count();
+    for (int t = 1; opts->thread_count < BENCH_MAX_LIST; t *= 2) {
+        opts->threads[opts->thread_count++] = (t < cores) ? t : cores;
+        if (t >= cores) {
+            break;
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--sizes") == 0 && has_value) {
+            opts->size_count = parse_list(argv[++i], opts->sizes_mib, BENCH_MAX_LIST);
+            if (opts->size_count == 0) {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--threads") == 0 && has_value) {
+            uint64_t values[BENCH_MAX_LIST];
+            opts->thread_count = parse_list(argv[++i], values, BENCH_MAX_LIST);
+            if (opts->thread_count == 0) {
+                return false;
+            }
+            for (int t = 0; t < opts->thread_count; t++) {
+                opts->threads[t] = (int)values[t];
+            }
+        }
+        else if (strcmp(arg, "--repeat") == 0 && has_value) {
+            opts->repeat = atoi(argv[++i]);
+            if (opts->repeat < 1) {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--depth") == 0 && has_value) {
+            opts->depth = atoi(argv[++i]);
+            if (opts->depth < 1) {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--dir") == 0 && has_value) {
+            opts->dir = argv[++i];
+        }
+        else if (strcmp(arg, "--evp") == 0) {
+            opts->use_aes_kernel = false;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool make_scratch_dir(const char* base, char* out, size_t out_size) {
+#ifdef _WIN32
+    char temp[MAX_PATH_LENGTH];
+    if (!base) {
+        DWORD length = GetTempPathA(sizeof(temp), temp);
+        if (length == 0 || length >= sizeof(temp)) {
+            return false;
+        }
+        base = temp;
+    }
+    snprintf(out, out_size, "%s%sunsega_bench_%lu", base, PATH_SEPARATOR, (unsigned long)GetCurrentProcessId());
+    return MKDIR(out) == 0;
+#else
+    if (!base) {
+        base = getenv("TMPDIR");
+        if (!base || !*base) {
+            base = "/tmp";
+        }
+    }
+    snprintf(out, out_size, "%s/unsega_bench_XXXXXX", base);
+    return mkdtemp(out) != NULL;
+#endif
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions opts;
+    if (!parse_options(argc, argv, &opts)) {
+        print_usage();
+        return 1;
+    }
+
+    const AesKernel* kernel = aes_kernel_init(opts.use_aes_kernel);
+
+    char original_dir[MAX_PATH_LENGTH * 4];
+    char scratch_dir[MAX_PATH_LENGTH * 4];
+    if (!GETCWD(original_dir, sizeof(original_dir)) ||
+        !make_scratch_dir(opts.dir, scratch_dir, sizeof(scratch_dir)) ||
+        CHDIR(scratch_dir) != 0) {
+        fprintf(stderr, "Could not create a scratch directory\n");
+        return 1;
+    }
+    fprintf(stderr, "Scratch directory: %s\n", scratch_dir);
+
+    // Library messages would corrupt the JSON on stdout; collect them and
+    // forward them to stderr instead.
+    LogBuffer log;
+    log_buffer_init(&log);
+    log_capture(&log);
+
+    bool ok = write_key_file();
+    bool first = true;
+    printf("{\n  \"kernel\": \"%s\",\n  \"cpu_count\": %d,\n  \"repeat\": %d,\n  \"depth\": %d,\n  \"results\": [",
+        kernel ? kernel->name : "OpenSSL EVP", cpu_count(), opts.repeat, opts.depth);
+
+    for (int s = 0; ok && s < opts.size_count; s++) {
+        uint64_t size = opts.sizes_mib[s] * 1024 * 1024;
+        char container_path[64];
+        char output_path[64];
+        snprintf(container_path, sizeof(container_path), "bench_%llu.app", (unsigned long long)opts.sizes_mib[s]);
+        snprintf(output_path, sizeof(output_path), "bench_%llu.ntfs", (unsigned long long)opts.sizes_mib[s]);
+
+        fprintf(stderr, "Generating %llu MiB container...\n", (unsigned long long)opts.sizes_mib[s]);
+        if (!create_container(container_path, size)) {
+            fprintf(stderr, "Could not create %s\n", container_path);
+            ok = false;
+            break;
+        }
+
+        for (int t = 0; ok && t < opts.thread_count; t++) {
+            uint64_t best = UINT64_MAX;
+            for (int r = 0; ok && r < opts.repeat; r++) {
+                uint64_t elapsed = 0;
+                ok = run_pipeline(container_path, output_path, opts.threads[t], opts.depth, &elapsed);
+                if (ok && r == 0 && t == 0 && !verify_output(output_path, size)) {
+                    fprintf(stderr, "Decrypted output of %s does not match the payload\n", container_path);
+                    ok = false;
+                }
+                best = (elapsed < best) ? elapsed : best;
+            }
+            if (ok) {
+                print_result(&first, "pipeline", size, opts.threads[t], best);
+            }
+
+            if (ok && size <= BENCH_MEMORY_LIMIT) {
+                best = UINT64_MAX;
+                for (int r = 0; ok && r < opts.repeat; r++) {
+                    uint64_t elapsed = 0;
+                    ok = run_memory(container_path, size, opts.threads[t], &elapsed);
+                    best = (elapsed < best) ? elapsed : best;
+                }
+                if (ok) {
+                    print_result(&first, "memory", size, opts.threads[t], best);
+                }
+            }
+            log_buffer_flush(&log, stderr);
+        }
+
+        remove(container_path);
+        remove(output_path);
+    }
+
+    printf("\n  ],\n  \"ok\": %s\n}\n", ok ? "true" : "false");
+
+    log_capture(NULL);
+    log_buffer_flush(&log, stderr);
+    log_buffer_close(&log);
+
+    remove(BENCH_GAME_ID ".bin");
+    if (CHDIR(original_dir) == 0) {
+        RMDIR(scratch_dir);
+    }
+    return ok ? 0 : 1;
+}
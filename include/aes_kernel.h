@@ -0,0 +1,48 @@
+#ifndef AES_KERNEL_H
+#define AES_KERNEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define AES_KERNEL_LANES 8
+
+// Decryption round keys for the equivalent inverse cipher, in the order the
+// AES-NI and ARMv8 instructions consume them.
+typedef struct {
+    uint8_t round_keys[11 * 16];
+} AesKernelKey;
+
+// Decrypts page_count consecutive pages of blocks_per_page AES blocks each,
+// page i chained from ivs[i * 16]. Pages are processed AES_KERNEL_LANES at a
+// time so the independent CBC chains keep the AES units busy. in may equal out.
+typedef void (*AesCbcDecryptFn)(const AesKernelKey* key, const uint8_t* in, uint8_t* out,
+    size_t blocks_per_page, size_t page_count, const uint8_t* ivs);
+
+typedef struct {
+    const char* name;
+    AesCbcDecryptFn decrypt;
+} AesKernel;
+
+void aes_kernel_expand_key(const uint8_t key[16], AesKernelKey* out);
+
+// Picks the fastest kernel the CPU supports and checks it against OpenSSL.
+// Returns NULL when none is usable (or allow_kernel is false), in which case
+// callers stay on EVP. Call once at startup, before any decryptor exists;
+// aes_kernel_get() returns NULL until then.
+const AesKernel* aes_kernel_init(bool allow_kernel);
+const AesKernel* aes_kernel_get(void);
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define AES_KERNEL_X86 1
+void aes_cbc_decrypt_aesni(const AesKernelKey* key, const uint8_t* in, uint8_t* out,
+    size_t blocks_per_page, size_t page_count, const uint8_t* ivs);
+void aes_cbc_decrypt_vaes(const AesKernelKey* key, const uint8_t* in, uint8_t* out,
+    size_t blocks_per_page, size_t page_count, const uint8_t* ivs);
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define AES_KERNEL_ARM64 1
+void aes_cbc_decrypt_armv8(const AesKernelKey* key, const uint8_t* in, uint8_t* out,
+    size_t blocks_per_page, size_t page_count, const uint8_t* ivs);
+#endif
+
+#endif // AES_KERNEL_H
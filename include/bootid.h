@@ -72,4 +72,8 @@ typedef struct {
 
 void format_timestamp(const Timestamp* ts, char* buffer, size_t buffer_size);
 
+// CRC-32 of the decrypted BootId from the byte after crc32 up to length. This
+// is what the crc32 field stores; the payload itself carries no checksum.
+uint32_t bootid_calculate_crc(const BootId* bootid);
+
 #endif // BOOTID_H
\ No newline at end of file
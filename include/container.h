@@ -0,0 +1,66 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "common.h"
+#include "bootid.h"
+#include "decrypt.h"
+#include "image.h"
+#include "page_cache.h"
+#include "thread.h"
+
+typedef struct {
+    FILE* fp;
+    BootId bootid;
+    bool has_key;
+    bool has_fixed_iv;          // IV comes from the key table, not from the first page
+    uint8_t key[16];
+    uint8_t iv[16];
+    uint64_t data_offset;
+    uint64_t payload_size;
+    char image_name[MAX_PATH_LENGTH];
+    Mutex reader_mutex;         // guards fp, the buffers and the decryptor
+    PageDecryptor decryptor;
+    uint8_t* read_buffer;
+    uint8_t* decrypted_buffer;
+    PageCache cache;
+    bool cache_enabled;
+} Container;
+
+// Reads and decrypts the BootId, looks up the key, derives the file IV and
+// builds the canonical image file name. Prints the reason when it fails.
+bool container_open(Container* container, const char* path);
+
+// Only the BootId part of container_open: decrypts the 96-byte header, looks
+// the key up (has_key) and names the image, without touching the payload.
+// The file IV is only known when has_fixed_iv is set.
+bool container_open_header(Container* container, const char* path);
+
+// Decrypts payload bytes [offset, offset + size) on demand, whole pages at a
+// time. Safe to call from several threads; pages found in the cache are
+// served without touching the file.
+bool container_read(Container* container, void* buffer, uint64_t offset, size_t size);
+
+// Keeps up to capacity_bytes of decrypted pages around so repeated reads of
+// the same MFT records, directories or short runs are not decrypted again.
+bool container_enable_cache(Container* container, size_t capacity_bytes);
+
+// Exposes the decrypted payload as an image the NTFS/exFAT parsers can read
+// without the image ever being written to disk. The container stays owned by
+// the caller and must outlive the source.
+void container_as_source(Container* container, ImageSource* source);
+
+// Size of the container file on disk; header_block_count + payload blocks
+// when it is complete.
+uint64_t container_file_size(Container* container);
+
+// Checks what can be checked before decrypting anything: the BootId CRC-32
+// and length, and that the file holds every block the header declares.
+// Prints the first problem found.
+bool container_verify(Container* container);
+
+void container_close(Container* container);
+
+#endif // CONTAINER_H
@@ -0,0 +1,32 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Standard CRC-32 (the zlib/PKZIP polynomial). crc32_update(0, data, size)
+// is the checksum of data; passing a previous result continues it.
+uint32_t crc32_update(uint32_t crc, const void* data, size_t size);
+
+// Checksum of A followed by B from crc(A), crc(B) and B's length, so slices
+// checksummed on different threads can be joined in order.
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+// Builds the tables and picks PCLMULQDQ folding (x86) or the ARMv8 CRC32
+// instructions when the CPU has them, checked against the table version.
+// Call once at startup before any thread checksums; crc32_update does it on
+// first use otherwise. Returns the name of the implementation in use.
+const char* crc32_init(void);
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32_X86 1
+// Takes and returns the inverted register; size must be a multiple of 16, at least 64.
+uint32_t crc32_fold_pclmul(uint32_t crc, const uint8_t* data, size_t size);
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define CRC32_ARM64 1
+// Takes and returns the inverted register.
+uint32_t crc32_armv8(uint32_t crc, const uint8_t* data, size_t size);
+#endif
+
+#endif // CRC32_H
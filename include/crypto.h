@@ -50,6 +50,7 @@ bool calculate_file_iv(
     uint8_t out_iv[16]
 );
 
+// Looks game_id up in the key index; see key_store.h.
 bool get_game_keys(const char* game_id, GameKeys* out_keys);
 
 #endif // CRYPTO_H
\ No newline at end of file
@@ -0,0 +1,111 @@
+#ifndef DECRYPT_H
+#define DECRYPT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "thread.h"
+#include "aes_kernel.h"
+
+#define DECRYPT_PAGE_SIZE 4096
+#define DECRYPT_CHUNK_SIZE (DECRYPT_PAGE_SIZE * 256)
+#define DECRYPT_DEFAULT_DEPTH 4
+#define DECRYPT_CHECKPOINT_INTERVAL (DECRYPT_CHUNK_SIZE * 256)
+
+typedef struct PageDecryptor PageDecryptor;
+
+typedef struct {
+    PageDecryptor* owner;
+    void* cipher;
+    Thread thread;
+    int index;
+    uint32_t crc;           // of this worker's slice of the current run
+} DecryptWorker;
+
+struct PageDecryptor {
+    uint8_t file_iv[16];
+    const AesKernel* kernel;
+    AesKernelKey kernel_key;
+    int thread_count;
+    DecryptWorker* workers;
+    Mutex mutex;
+    CondVar work_cond;
+    CondVar done_cond;
+    uint64_t generation;
+    int pending;
+    bool shutdown;
+    bool failed;
+    const uint8_t* in;
+    uint8_t* out;
+    size_t size;
+    uint64_t file_offset;
+    bool crc_enabled;
+    uint32_t crc;           // of all plaintext decrypted so far
+};
+
+// Splits every chunk by 4 KiB page across thread_count threads (the calling
+// thread included). Each page gets its own IV, so the output is identical to
+// decrypting the pages one after another. Pages go through the CPU AES
+// kernel picked by aes_kernel_init() when there is one, EVP otherwise.
+bool page_decryptor_init(PageDecryptor* pd, const uint8_t key[16], const uint8_t file_iv[16], int thread_count);
+bool page_decryptor_run(PageDecryptor* pd, const uint8_t* in, uint8_t* out, size_t size, uint64_t file_offset);
+void page_decryptor_close(PageDecryptor* pd);
+
+// Checksums the plaintext (CRC-32) while it is still in cache right after each
+// batch of pages is decrypted, instead of in a separate pass. Every
+// page_decryptor_run after this must continue where the previous one ended.
+void page_decryptor_enable_crc(PageDecryptor* pd);
+uint32_t page_decryptor_crc(const PageDecryptor* pd);
+
+typedef struct {
+    FILE* input;            // positioned at start_offset in the encrypted payload
+    FILE* output;           // positioned at start_offset in the image
+    uint64_t size;          // payload bytes in total
+    uint64_t start_offset;  // bytes already decrypted by an earlier run, a multiple of DECRYPT_CHUNK_SIZE
+    int depth;              // chunks in flight between the stages
+    bool show_progress;
+    bool sparse;            // seek over all-zero pages instead of writing them
+    bool direct_output;     // output is a pipe or stdout: write whole chunks to its descriptor, no stdio
+
+    // Called by the writer about every DECRYPT_CHECKPOINT_INTERVAL bytes and
+    // after the last chunk with the payload bytes written so far; returning
+    // false aborts the stream. NULL when nothing needs to be durable.
+    bool (*checkpoint)(void* context, FILE* output, uint64_t completed);
+    void* checkpoint_context;
+} StreamConfig;
+
+typedef struct {
+    uint64_t bytes_written;
+    uint64_t elapsed_ns;
+    uint64_t read_stall_ns;     // reader waiting for a free chunk
+    uint64_t decrypt_stall_ns;  // decrypt stage waiting for the reader
+    uint64_t write_stall_ns;    // writer waiting for the decrypt stage
+    uint64_t bytes_skipped;     // zero pages left as holes in sparse mode
+    bool mapped;                // produced by decrypt_mapped, no stages to stall
+} StreamStats;
+
+// Runs fread -> decrypt -> fwrite as three overlapping stages over a ring of
+// config->depth chunks. The reader and writer get a thread each, the calling
+// thread drives the decryptor; chunks are always written in order. With
+// direct_output the chunks go out with write(), or with vmsplice() on Linux
+// when the output is a pipe, so the pipe takes the pages without a copy.
+bool decrypt_stream(PageDecryptor* pd, const StreamConfig* config, StreamStats* stats);
+void print_stream_stats(const StreamStats* stats);
+
+typedef enum {
+    MAPPED_DECRYPT_OK,
+    MAPPED_DECRYPT_FAILED,
+    MAPPED_DECRYPT_UNAVAILABLE  // nothing was written, use decrypt_stream instead
+} MappedDecryptResult;
+
+// Maps the container read-only and a pre-sized output file read-write and
+// decrypts straight from one mapping into the other, skipping the stdio
+// buffers. Not available on Windows.
+MappedDecryptResult decrypt_mapped(PageDecryptor* pd, const char* input_path, uint64_t data_offset,
+    const char* output_path, uint64_t size, bool show_progress, bool sparse, StreamStats* stats);
+
+// True when every byte is zero. Checks 64 bytes per step with SSE2 or NEON.
+bool buffer_is_zero(const void* data, size_t size);
+
+#endif // DECRYPT_H
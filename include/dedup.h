@@ -0,0 +1,58 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "common.h"
+#include "thread.h"
+
+#define DEDUP_PATH_LENGTH (MAX_PATH_LENGTH * 2)
+// Files up to this size are hashed in memory and never written when the
+// store already has them.
+#define DEDUP_MEMORY_LIMIT (64 * 1024)
+
+// Content-addressed blob store: every distinct file content is kept once as
+// DIR/<first 2 hex digits>/<rest of its SHA-256>, and extracted files are
+// reflinks, hardlinks or, across file systems, copies of those blobs. New
+// blobs are renamed into place, so jobs and processes can share a store.
+typedef struct {
+    char dir[DEDUP_PATH_LENGTH];
+    Mutex mutex;
+    uint64_t next_temp;
+    bool try_reflink;
+    bool warned_copy;
+} DedupStore;
+
+typedef struct DedupFile DedupFile;
+
+// What one image's extraction took from and added to the store. The
+// counters are updated under store->mutex.
+typedef struct {
+    DedupStore* store;
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t duplicate_files;
+    uint64_t duplicate_bytes;
+} DedupImage;
+
+bool dedup_store_open(DedupStore* store, const char* dir);
+void dedup_store_close(DedupStore* store);
+
+// Starts a file whose contents are hashed as they are written.
+DedupFile* dedup_file_create(DedupStore* store);
+bool dedup_file_write(DedupFile* file, const void* data, size_t size);
+// Moves the contents into the store unless an identical blob is already
+// there, in which case *duplicate is set. blob_path receives the blob either
+// way. Frees file.
+bool dedup_file_finish(DedupFile* file, char* blob_path, size_t blob_path_size, bool* duplicate,
+    uint64_t* size);
+void dedup_file_discard(DedupFile* file);
+
+// Makes output_path a copy of the blob, replacing whatever was there.
+// Returns false straight away when the directory of output_path is missing.
+bool dedup_link(DedupStore* store, const char* blob_path, const char* output_path);
+
+void print_dedup_report(const DedupImage* image);
+
+#endif // DEDUP_H
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "common.h"
+#include "image.h"
+#include "sink.h"
 
 #define EXFAT_ENTRY_SIZE 32
 
@@ -82,22 +84,25 @@ typedef struct {
     char name[MAX_PATH_LENGTH];
     uint32_t first_cluster;
     uint64_t data_length;
+    uint64_t mtime;         // DOS timestamp << 8 | 10 ms increments
     bool is_directory;
 } ExfatFileInfo;
 
 typedef struct {
-    FILE* fp;
+    ImageSource source;
     ExfatBootSector boot_sector;
     uint32_t bytes_per_sector;
     uint32_t bytes_per_cluster;
-    uint32_t cluster_heap_offset_bytes;
-    uint32_t fat_offset_bytes;
+    uint64_t cluster_heap_offset_bytes;
+    uint64_t fat_offset_bytes;
     uint32_t fat_length_bytes;
     uint32_t* fat;
 } ExfatContext;
 
 bool exfat_init(ExfatContext* ctx, const char* filename);
-bool exfat_extract_all(ExfatContext* ctx, const char* output_dir);
+// Reads the volume through source; exfat_close() closes the source.
+bool exfat_init_source(ExfatContext* ctx, const ImageSource* source);
+bool exfat_extract_all(ExfatContext* ctx, ExtractSink* sink);
 void exfat_close(ExfatContext* ctx);
 
 #endif // EXFAT_H
@@ -0,0 +1,36 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Positional reads from a filesystem image, either a decrypted image file on
+// disk or the encrypted container itself (see container_as_source). read may
+// be called from several threads at once.
+typedef struct {
+    bool (*read)(void* opaque, void* buffer, uint64_t offset, size_t size);
+    void (*close)(void* opaque);
+    void* opaque;
+    uint64_t size;
+} ImageSource;
+
+bool image_source_open_file(ImageSource* source, const char* path);
+void image_source_close(ImageSource* source);
+
+// Reads size bytes at offset of fp without using or moving its stream
+// position, so threads can share one open file. Fails on a short read.
+bool file_read_at(FILE* fp, void* buffer, uint64_t offset, size_t size);
+// fsync/_commit and ftruncate/_chsize_s on a stdio stream.
+bool file_sync(FILE* file);
+bool file_truncate(FILE* file, uint64_t size);
+// Lets ranges seeked over stay holes. Only needed on Windows, where NTFS
+// fills them with real zeros unless the file is flagged sparse.
+void file_mark_sparse(FILE* file);
+
+static inline bool image_source_read(const ImageSource* source, void* buffer, uint64_t offset, size_t size) {
+    return source->read(source->opaque, buffer, offset, size);
+}
+
+#endif // IMAGE_H
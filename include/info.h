@@ -0,0 +1,17 @@
+#ifndef INFO_H
+#define INFO_H
+
+#include <stdbool.h>
+#include "container.h"
+#include "log.h"
+
+// Prints every BootId field of a container opened with container_open_header,
+// plus what follows from it without reading the payload: image name, payload
+// size, whether the file is complete and whether a key is available. Text
+// goes through log_printf; JSON is one line on stdout.
+void print_container_info(Container* container, const char* path, bool json);
+
+// JSON line for a file whose header could not be read; error is the captured log text.
+void print_container_info_error(const char* path, const char* error);
+
+#endif // INFO_H
@@ -0,0 +1,54 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "common.h"
+#include "bootid.h"
+
+#define JOURNAL_SUFFIX ".journal"
+
+// What the journal remembers about one decryption. The BootId pins the
+// container, so a journal left by a different container (or a different
+// version of it) with the same image name is never trusted.
+typedef struct {
+    char magic[8];
+    uint64_t sequence;          // bumped on every commit, the newer slot wins
+    BootId bootid;
+    uint64_t payload_size;
+    uint64_t completed;         // payload bytes durably written to the image
+    uint32_t crc;               // of everything above, catches torn writes
+} JournalRecord;
+
+// Sidecar "<image>.journal" next to the image being written. The record is
+// written alternately into two slots so a crash in the middle of a commit
+// still leaves the previous checkpoint readable.
+typedef struct {
+    FILE* fp;
+    char path[MAX_PATH_LENGTH];
+    JournalRecord record;
+} Journal;
+
+// Opens (or creates) the journal for image_path. When an existing journal
+// belongs to the same container, *completed is its last checkpoint and the
+// image can be continued from there; otherwise it is 0 and the journal is
+// started over.
+bool journal_open(Journal* journal, const char* image_path, const BootId* bootid,
+    uint64_t payload_size, uint64_t* completed);
+
+// Makes output durable (fflush + fsync) up to completed bytes and only then
+// records that in the journal and syncs it too. Matches the
+// StreamConfig.checkpoint signature; context is the Journal.
+bool journal_commit(void* context, FILE* output, uint64_t completed);
+
+// The image is complete: closes and deletes the journal.
+void journal_finish(Journal* journal);
+
+// Closes the journal and keeps it for the next --resume run.
+void journal_close(Journal* journal);
+
+// Deletes a stale journal for image_path, for runs that rewrite the image from scratch.
+void journal_discard(const char* image_path);
+
+#endif // JOURNAL_H
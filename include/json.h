@@ -0,0 +1,24 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define JSON_BUFFER_SIZE 4096
+
+// Fixed-size builder for the single-line JSON reports. Output that does not
+// fit is cut off rather than reallocated; the reports are far smaller.
+typedef struct {
+    char data[JSON_BUFFER_SIZE];
+    size_t length;
+} JsonBuffer;
+
+void json_init(JsonBuffer* json);
+void json_append(JsonBuffer* json, const char* text);
+void json_appendf(JsonBuffer* json, const char* format, ...);
+void json_append_string(JsonBuffer* json, const char* value);
+
+// Writes the buffer with one call so lines from parallel jobs do not mix.
+void json_write_line(JsonBuffer* json, FILE* out);
+
+#endif // JSON_H
@@ -0,0 +1,25 @@
+#ifndef KEY_STORE_H
+#define KEY_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "crypto.h"
+
+// In-memory index of every known key by game id, so get_game_keys answers
+// from a hash table instead of scanning game_keys[] and probing the disk for
+// "<game id>.bin" on every miss. Sources are indexed in order of precedence:
+// the built-in table, every .bin file in keys_dir (may be NULL) and every
+// .bin file in the working directory. Key files keep their usual formats:
+// 16 bytes of key, or key plus IV.
+//
+// Call once before starting worker threads; lookups afterwards only read the
+// index. get_game_keys builds it without a keys_dir if this was never called.
+// Returns false when keys_dir cannot be read.
+bool key_store_init(const char* keys_dir);
+
+// Number of indexed game ids.
+size_t key_store_count(void);
+
+void key_store_close(void);
+
+#endif // KEY_STORE_H
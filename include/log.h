@@ -0,0 +1,41 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "thread.h"
+
+typedef struct {
+    Mutex mutex;
+    char* data;
+    size_t length;
+    size_t capacity;
+} LogBuffer;
+
+void log_buffer_init(LogBuffer* buffer);
+void log_buffer_flush(LogBuffer* buffer, FILE* out);
+void log_buffer_clear(LogBuffer* buffer);
+void log_buffer_close(LogBuffer* buffer);
+
+// Sends everything this thread logs into buffer instead of stdout, so a job
+// running next to others keeps its output together. Pass NULL to go back to
+// stdout. Returns the previous target so helper threads can share a job's
+// buffer: log_capture(log_current()) on the helper.
+LogBuffer* log_capture(LogBuffer* buffer);
+LogBuffer* log_current(void);
+
+// Where uncaptured output goes, stdout unless changed. Moved to stderr when
+// stdout carries the decrypted image. Set it before starting any threads.
+void log_set_output(FILE* out);
+FILE* log_output(void);
+
+void log_printf(const char* format, ...);
+void log_perror(const char* what);
+
+// "\rProgress: N%" updates only make sense on a live terminal; they are
+// dropped while the thread is captured.
+void log_progress(int percentage);
+void log_progress_done(void);
+
+#endif // LOG_H
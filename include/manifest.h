@@ -0,0 +1,57 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "common.h"
+#include "thread.h"
+
+#define MANIFEST_SUFFIX ".manifest"
+#define MANIFEST_HASH_SIZE 32   // SHA-256
+
+typedef struct {
+    char* path;             // relative to the extraction root
+    uint64_t size;
+    uint64_t mtime;         // as the file system stores it, 0 if it has none
+    bool has_hash;
+    uint8_t hash[MANIFEST_HASH_SIZE];
+} ManifestEntry;
+
+typedef struct {
+    ManifestEntry* entries;
+    size_t count;
+    size_t capacity;
+} ManifestList;
+
+// What an incremental extraction into <root> wrote, kept as <root>.manifest
+// next to the folder: one "<size> <mtime> <sha-256 or -> <path>" line per
+// file. The previous run's entries are indexed by path; the entries of this
+// run replace them when the manifest is saved. previous is only read during
+// the extraction; files may be recorded from several threads.
+typedef struct {
+    char path[MAX_PATH_LENGTH * 2];
+    bool use_hash;
+    ManifestList previous;
+    size_t* slots;          // open addressing into previous, SIZE_MAX when free
+    size_t slot_mask;
+    Mutex mutex;            // guards current and the counters
+    ManifestList current;
+    uint64_t unchanged_files;
+    uint64_t unchanged_bytes;
+    uint64_t written_files;
+    uint64_t written_bytes;
+} Manifest;
+
+// Loads <root>.manifest if there is one. use_hash asks for files to be
+// compared by SHA-256 instead of by modification time.
+bool manifest_open(Manifest* manifest, const char* root, bool use_hash);
+const ManifestEntry* manifest_find(const Manifest* manifest, const char* path);
+// hash may be NULL. unchanged only feeds the report.
+bool manifest_record(Manifest* manifest, const char* path, uint64_t size, uint64_t mtime,
+    const uint8_t* hash, bool unchanged);
+bool manifest_save(Manifest* manifest);
+void manifest_close(Manifest* manifest);
+void print_manifest_report(const Manifest* manifest);
+
+#endif // MANIFEST_H
@@ -8,6 +8,9 @@
 #include <string.h>
 #include <errno.h>
 #include "common.h"
+#include "image.h"
+#include "sink.h"
+#include "thread.h"
 
 #define VHD_FOOTER_SIZE 512
 #define VHD_SECTOR_SIZE 512
@@ -18,6 +21,9 @@
 #define VHD_DYNAMIC_COOKIE "cxsparse"
 #define VHD_TYPE_FIXED 2
 #define VHD_TYPE_DYNAMIC 3
+#define VHD_CACHE_DEFAULT_MB 32
+#define NTFS_MFT_BATCH_SIZE (4 * 1024 * 1024)
+#define NTFS_EXTRACT_DEFAULT_THREADS 4
 #define FILE_NAME_ATTR 0x30
 #define DATA_ATTR 0x80
 #define INDEX_ROOT_ATTR 0x90
@@ -27,15 +33,22 @@
 #define MFT_RECORD_IN_USE 0x0001
 #define MFT_RECORD_IS_DIRECTORY 0x0002
 
+#define DIRECTORY_CACHE_FREE UINT64_MAX
+
 typedef struct {
-    uint64_t ref_number;
-    char path[MAX_PATH_LENGTH];
-} DirectoryInfo;
+    uint64_t ref_number;    // DIRECTORY_CACHE_FREE for an empty slot
+    size_t path_offset;     // into DirectoryCache.arena, NUL-terminated
+} DirectoryEntry;
 
+// Paths of the directories seen so far, keyed by MFT record number in an
+// open-addressing table. The paths live back to back in one growing arena.
 typedef struct {
-    DirectoryInfo* directories;
-    size_t capacity;
+    DirectoryEntry* slots;
+    size_t slot_mask;
     size_t count;
+    char* arena;
+    size_t arena_size;
+    size_t arena_capacity;
 } DirectoryCache;
 
 #pragma pack(push, 1)
@@ -116,8 +129,8 @@ typedef struct {
     uint32_t bytes_allocated;
     uint64_t base_ref;
     uint16_t next_attr_id;
-    uint16_t record_number;
-    uint16_t usa_value;
+    uint16_t reserved;
+    uint32_t record_number;     // NTFS 3.1 only
 } MFTRecordHeader;
 
 typedef struct {
@@ -163,32 +176,92 @@ typedef struct {
     uint16_t name[256];
 } FileNameAttribute;
 
+// One fragment of the $MFT: length bytes of the MFT starting at mft_offset
+// are stored at volume_offset.
+typedef struct {
+    uint64_t mft_offset;
+    uint64_t volume_offset;
+    uint64_t length;
+} MftExtent;
+
+#pragma pack(pop)
+
+// length clusters starting at cluster offset. A sparse run has no clusters
+// on disk and reads as zeros; its offset is 0.
 typedef struct {
     uint64_t offset;
     uint64_t length;
+    bool sparse;
 } DataRun;
 
-#pragma pack(pop)
+typedef struct VHDCacheBlock VHDCacheBlock;
+
+struct VHDCacheBlock {
+    uint32_t block_idx;     // BAT index of the cached block
+    uint8_t* data;
+    uint8_t* loaded;        // one bit per sector of data already read from the file
+    VHDCacheBlock* lru_prev;    // towards most recently used
+    VHDCacheBlock* lru_next;    // towards least recently used
+};
+
+// Shared by the extraction threads: mutex guards the blocks, the list and
+// the counters, but is not held while the file is read.
+typedef struct {
+    Mutex mutex;
+    VHDCacheBlock* blocks;
+    uint8_t* data;
+    uint8_t* loaded;
+    size_t capacity;
+    size_t used;
+    VHDCacheBlock* lru_head;
+    VHDCacheBlock* lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t bytes_read;
+} VHDBlockCache;
 
 typedef struct {
-    FILE* fp;
+    FILE* fp;               // only read with file_read_at()
     VHDFooter footer;
     VHDDynamicHeader dyn_header;
     uint32_t* bat;
     uint32_t sector_bitmap_size;
-    uint8_t* sector_bitmap;
-    uint8_t* block_buffer;
+    VHDBlockCache cache;    // dynamic disks only
 } VHDContext;
 
+// What the first pass of ntfs_extract_all() keeps of one file or directory.
 typedef struct {
-    char name[MAX_FILENAME_LENGTH];
+    uint64_t record_num;
     uint64_t parent_ref;
+    uint64_t mtime;
+    uint64_t size;
+    uint64_t first_offset;  // volume offset of the first data cluster, 0 for resident data
+    size_t name_offset;     // into NtfsIndex.bytes
+    size_t data_offset;     // resident data in NtfsIndex.bytes, or the first run in NtfsIndex.runs
+    uint32_t run_count;     // 0 for resident and compressed data
+    bool is_resident;
+    bool is_compressed;     // not extracted, but reported as failed
     bool is_directory;
-    bool valid;
-} FileInfo;
+} NtfsIndexEntry;
+
+// Every extractable record of the MFT, in record order. Names and resident
+// data share one byte pool and the data runs of all files another, so the
+// index stays compact for volumes with hundreds of thousands of files.
+typedef struct {
+    NtfsIndexEntry* entries;
+    size_t count;
+    size_t capacity;
+    DataRun* runs;
+    size_t run_count;
+    size_t run_capacity;
+    uint8_t* bytes;
+    size_t bytes_size;
+    size_t bytes_capacity;
+} NtfsIndex;
 
 typedef struct {
-    FILE* fp;
+    ImageSource source;
 } RawNTFSContext;
 
 typedef struct {
@@ -203,13 +276,31 @@ typedef struct {
     uint32_t mft_record_size;
     uint64_t mft_data_size;
     uint64_t total_mft_records;
-    char base_path[MAX_PATH_LENGTH];
+    MftExtent* mft_extents;     // where each piece of the $MFT is, in MFT order
+    int mft_extent_count;
+    uint32_t mft_batch_size;    // bytes of MFT read at once, NTFS_MFT_BATCH_SIZE unless changed
+    bool extract_in_mft_order;  // extract files in record order instead of by data offset
+    int extract_threads;        // threads extracting the files, 1 unless changed
+    ExtractSink* sink;      // set for the duration of ntfs_extract_all()
     DirectoryCache dir_cache;
     uint64_t data_start_offset;
 } NTFSContext;
 
-bool ntfs_init(NTFSContext* ctx, const char* vhd_path, const char* extract_path);
-bool ntfs_extract_all(NTFSContext* ctx);
+// Opens a raw NTFS volume or a VHD. Blocks of a dynamic VHD are cached in up
+// to vhd_cache_bytes of memory; 0 reads every request straight from the file.
+bool ntfs_init(NTFSContext* ctx, const char* vhd_path, size_t vhd_cache_bytes);
+// Reads a raw NTFS volume through source; ntfs_close() closes the source.
+bool ntfs_init_source(NTFSContext* ctx, const ImageSource* source);
+// Scans the MFT into an index first, then creates the directories and
+// extracts the files sorted by where their data starts, so the image is read
+// front to back as far as fragmentation allows. With extract_threads above 1
+// and a sink that sets parallel, the files are handed out to that many
+// threads in this order; otherwise, as with a tar sink, the calling thread
+// extracts them all. A file or directory that fails is
+// logged and the rest are still extracted, but the result is then false.
+bool ntfs_extract_all(NTFSContext* ctx, ExtractSink* sink);
+// Prints the block cache line for a dynamic VHD, nothing otherwise.
+void ntfs_print_vhd_cache_stats(const NTFSContext* ctx);
 void ntfs_close(NTFSContext* ctx);
 
 #endif // NTFS_H
\ No newline at end of file
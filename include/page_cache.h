@@ -0,0 +1,68 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "thread.h"
+
+#define PAGE_CACHE_PAGE_SIZE 4096
+#define PAGE_CACHE_DEFAULT_MB 64
+#define PAGE_CACHE_DEFAULT_SHARDS 16
+
+typedef struct PageCacheEntry PageCacheEntry;
+
+struct PageCacheEntry {
+    uint64_t offset;
+    uint8_t* data;
+    PageCacheEntry* hash_next;
+    PageCacheEntry* lru_prev;   // towards most recently used
+    PageCacheEntry* lru_next;   // towards least recently used
+};
+
+typedef struct {
+    Mutex mutex;
+    PageCacheEntry* entries;
+    uint8_t* data;
+    PageCacheEntry** buckets;
+    size_t bucket_mask;
+    size_t capacity;
+    size_t used;
+    PageCacheEntry* lru_head;
+    PageCacheEntry* lru_tail;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} PageCacheShard;
+
+typedef struct {
+    PageCacheShard* shards;
+    int shard_count;
+} PageCache;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t resident_pages;
+    uint64_t capacity_pages;
+} PageCacheStats;
+
+// LRU cache of decrypted 4 KiB pages keyed by their payload offset. Pages are
+// spread over shard_count independently locked shards so concurrent readers
+// rarely contend; each shard evicts its own least recently used page once it
+// holds its share of capacity_bytes.
+bool page_cache_init(PageCache* cache, size_t capacity_bytes, int shard_count);
+
+// Copies the page at offset into out and marks it recently used. Returns
+// false (and counts a miss) when the page is not cached.
+bool page_cache_lookup(PageCache* cache, uint64_t offset, void* out);
+
+// Stores a copy of the page at offset, evicting the shard's LRU page when full.
+void page_cache_insert(PageCache* cache, uint64_t offset, const void* page);
+
+void page_cache_get_stats(PageCache* cache, PageCacheStats* stats);
+void print_page_cache_stats(const PageCacheStats* stats);
+void page_cache_close(PageCache* cache);
+
+#endif // PAGE_CACHE_H
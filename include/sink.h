@@ -0,0 +1,65 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "common.h"
+#include "tar.h"
+#include "dedup.h"
+#include "manifest.h"
+
+// Where the filesystem parsers put what they extract: a directory tree on
+// disk or the members of a tar stream. Paths handed to a sink are relative
+// to the image root and use PATH_SEPARATOR; "" is the root itself.
+typedef struct {
+    bool (*add_directory)(void* opaque, const char* path);
+    void* (*open_file)(void* opaque, const char* path, uint64_t size);
+    bool (*write_file)(void* opaque, void* file, const void* data, size_t size);
+    // Optional: moves size bytes on, leaving a hole that reads as zeros.
+    bool (*skip_file)(void* opaque, void* file, uint64_t size);
+    bool (*close_file)(void* opaque, void* file, bool complete);
+    void* opaque;
+    bool parallel;          // files may be extracted on several threads at once
+    char separator;
+    char root[MAX_PATH_LENGTH];
+    Manifest* manifest;     // --incremental: skip files the last run already wrote
+} ExtractSink;
+
+typedef struct SinkFile SinkFile;
+
+// Writes a file's data with sink_write_file(); returns false when it could
+// not all be read. May be called twice for one file, see sink_extract_file().
+typedef bool (*SinkStreamFunc)(void* context, ExtractSink* sink, SinkFile* file);
+
+// Creates the directories and files below root on disk.
+void sink_init_directory(ExtractSink* sink, const char* root);
+// Adds members named root/... to tar, which several sinks may share. A
+// member holds the writer's lock from its header to its end, so files are
+// taken one at a time.
+void sink_init_tar(ExtractSink* sink, TarWriter* tar, const char* root);
+// Like a directory sink, but the files are taken from image->store, where
+// new contents are added first. image counts what was already there.
+void sink_init_dedup(ExtractSink* sink, DedupImage* image, const char* root);
+
+bool sink_add_directory(ExtractSink* sink, const char* path);
+
+// Extracts a file of size bytes whose data stream writes. size must be
+// known up front for a tar header. When stream fails, a directory sink
+// removes the file and a tar sink zero-fills the member. Returns true only
+// for a file written in full.
+//
+// With a manifest the file is left alone when it is still on disk with the
+// size and mtime (the file system's own timestamp, 0 if there is none) the
+// last run recorded. When the manifest compares hashes, stream is first run
+// only to hash the data, and again to write it if it differs.
+bool sink_extract_file(ExtractSink* sink, const char* path, uint64_t size, uint64_t mtime,
+    SinkStreamFunc stream, void* context);
+bool sink_write_file(ExtractSink* sink, SinkFile* file, const void* data, size_t size);
+// Adds size zero bytes to the file: a hole in a directory sink, written
+// zeros where the format or the hash needs them.
+bool sink_skip_file(ExtractSink* sink, SinkFile* file, uint64_t size);
+
+bool create_directories(const char* path);
+
+#endif // SINK_H
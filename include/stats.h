@@ -0,0 +1,60 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef enum {
+    STAT_TIME_DECRYPT,
+    STAT_TIME_READ,         // fread of the container or image
+    STAT_TIME_WRITE,        // fwrite of the image or extracted files
+    STAT_TIME_VHD_READ,
+    STAT_TIME_MFT_FIXUPS,
+    STAT_TIME_PATH_RESOLVE,
+    STAT_TIME_COUNT
+} StatTimer;
+
+typedef enum {
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_BYTES_DECRYPTED,
+    STAT_MFT_RECORDS,
+    STAT_FILES_EXTRACTED,
+    STAT_DIRS_EXTRACTED,
+    STAT_DIR_CACHE_HITS,
+    STAT_DIR_CACHE_MISSES,
+    STAT_DIR_CACHE_PROBES,      // hash slots inspected by directory cache lookups and inserts
+    STAT_VHD_CACHE_HITS,        // dynamic VHD reads served from cached sectors
+    STAT_VHD_CACHE_MISSES,
+    STAT_BYTES_DEDUPLICATED,    // file contents --dedup-store already had
+    STAT_FILES_UNCHANGED,       // skipped by --incremental
+    STAT_BYTES_SPARSE,          // sparse ranges of extracted files left as holes
+    STAT_COUNTER_COUNT
+} StatCounter;
+
+typedef struct {
+    uint64_t time_ns[STAT_TIME_COUNT];
+    uint64_t calls[STAT_TIME_COUNT];
+    uint64_t counters[STAT_COUNTER_COUNT];
+} ImageStats;
+
+// Like the log capture, stats are collected per thread: attach an ImageStats
+// and every instrumented call on this thread adds to it. With nothing
+// attached the hooks cost one thread-local load. Helper threads attach their
+// own ImageStats and the owner merges them once they are joined.
+ImageStats* stats_attach(ImageStats* stats);
+ImageStats* stats_current(void);
+void stats_merge(ImageStats* into, const ImageStats* from);
+
+// start = stats_now(); ...; stats_time(STAT_TIME_x, start);
+uint64_t stats_now(void);
+void stats_time(StatTimer timer, uint64_t start);
+void stats_count(StatCounter counter, uint64_t amount);
+
+// One JSON object on a single line, written with a single call so lines from
+// parallel jobs do not mix.
+void stats_print_json(FILE* out, const ImageStats* stats, const char* input, const char* image,
+    const char* result, uint64_t elapsed_ns);
+
+#endif // STATS_H
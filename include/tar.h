@@ -0,0 +1,63 @@
+#ifndef TAR_H
+#define TAR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "thread.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_STDOUT "-"
+
+#pragma pack(push, 1)
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+} TarHeader;
+
+#pragma pack(pop)
+
+// Writes a POSIX (pax) tar stream. Names that do not fit the ustar name and
+// prefix fields and sizes of 8 GiB and more get a pax extended header first.
+// Several extractions can share one writer: a member is written under the
+// writer's lock from tar_writer_begin_file() to tar_writer_end_file().
+typedef struct {
+    FILE* fp;
+    bool to_stdout;
+    bool failed;
+    Mutex mutex;
+    uint64_t mtime;
+    uint64_t member_size;
+    uint64_t member_written;
+} TarWriter;
+
+// path is a file to create, or TAR_STDOUT.
+bool tar_writer_open(TarWriter* tar, const char* path);
+// name uses '/' separators, without a trailing one.
+bool tar_writer_add_directory(TarWriter* tar, const char* name);
+// On success the lock is held until tar_writer_end_file().
+bool tar_writer_begin_file(TarWriter* tar, const char* name, uint64_t size);
+bool tar_writer_write(TarWriter* tar, const void* data, size_t size);
+// Zero-fills the member up to the size given to tar_writer_begin_file() if
+// less was written, so the archive stays readable; returns false then.
+bool tar_writer_end_file(TarWriter* tar);
+// Writes the end-of-archive marker. Returns false if any write failed.
+bool tar_writer_close(TarWriter* tar);
+
+#endif // TAR_H
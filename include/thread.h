@@ -0,0 +1,47 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  #include <windows.h>
+  typedef HANDLE Thread;
+  typedef SRWLOCK Mutex;
+  typedef CONDITION_VARIABLE CondVar;
+#else
+  #include <pthread.h>
+  typedef pthread_t Thread;
+  typedef pthread_mutex_t Mutex;
+  typedef pthread_cond_t CondVar;
+#endif
+
+#if defined(_MSC_VER)
+  #define THREAD_LOCAL __declspec(thread)
+#else
+  #define THREAD_LOCAL _Thread_local
+#endif
+
+typedef void (*ThreadFunc)(void* arg);
+
+bool thread_create(Thread* thread, ThreadFunc func, void* arg);
+void thread_join(Thread thread);
+
+void mutex_init(Mutex* mutex);
+void mutex_lock(Mutex* mutex);
+void mutex_unlock(Mutex* mutex);
+void mutex_destroy(Mutex* mutex);
+
+void cond_init(CondVar* cond);
+void cond_wait(CondVar* cond, Mutex* mutex);
+void cond_signal(CondVar* cond);
+void cond_broadcast(CondVar* cond);
+void cond_destroy(CondVar* cond);
+
+int cpu_count(void);
+uint64_t monotonic_ns(void);
+
+#endif // THREAD_H
@@ -0,0 +1,252 @@
+#include "aes_kernel.h"
+#include "log.h"
+#include <string.h>
+#include <stdio.h>
+#include <openssl/evp.h>
+
+#if defined(AES_KERNEL_X86)
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #else
+    #include <cpuid.h>
+  #endif
+#elif defined(AES_KERNEL_ARM64)
+  #if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+      #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+  #elif defined(__linux__)
+    #include <sys/auxv.h>
+    #ifndef HWCAP_AES
+      #define HWCAP_AES (1 << 3)
+    #endif
+  #endif
+#endif
+
+static const uint8_t AES_SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    uint8_t result = 0;
+    while (b) {
+        if (b & 1) result ^= a;
+        a = (uint8_t)((a << 1) ^ ((a & 0x80) ? 0x1B : 0));
+        b >>= 1;
+    }
+    return result;
+}
+
+static void inv_mix_columns(const uint8_t in[16], uint8_t out[16]) {
+    for (int c = 0; c < 4; c++) {
+        const uint8_t* a = in + c * 4;
+        out[c * 4 + 0] = gf_mul(a[0], 14) ^ gf_mul(a[1], 11) ^ gf_mul(a[2], 13) ^ gf_mul(a[3], 9);
+        out[c * 4 + 1] = gf_mul(a[0], 9) ^ gf_mul(a[1], 14) ^ gf_mul(a[2], 11) ^ gf_mul(a[3], 13);
+        out[c * 4 + 2] = gf_mul(a[0], 13) ^ gf_mul(a[1], 9) ^ gf_mul(a[2], 14) ^ gf_mul(a[3], 11);
+        out[c * 4 + 3] = gf_mul(a[0], 11) ^ gf_mul(a[1], 13) ^ gf_mul(a[2], 9) ^ gf_mul(a[3], 14);
+    }
+}
+
+void aes_kernel_expand_key(const uint8_t key[16], AesKernelKey* out) {
+    uint8_t ek[11 * 16];
+    uint8_t rcon = 0x01;
+
+    memcpy(ek, key, 16);
+    for (int i = 16; i < 11 * 16; i += 4) {
+        uint8_t t[4] = { ek[i - 4], ek[i - 3], ek[i - 2], ek[i - 1] };
+        if (i % 16 == 0) {
+            uint8_t first = t[0];
+            t[0] = AES_SBOX[t[1]] ^ rcon;
+            t[1] = AES_SBOX[t[2]];
+            t[2] = AES_SBOX[t[3]];
+            t[3] = AES_SBOX[first];
+            rcon = (uint8_t)((rcon << 1) ^ ((rcon & 0x80) ? 0x1B : 0));
+        }
+        for (int k = 0; k < 4; k++) {
+            ek[i + k] = ek[i - 16 + k] ^ t[k];
+        }
+    }
+
+    memcpy(out->round_keys, ek + 10 * 16, 16);
+    for (int r = 1; r < 10; r++) {
+        inv_mix_columns(ek + (10 - r) * 16, out->round_keys + r * 16);
+    }
+    memcpy(out->round_keys + 10 * 16, ek, 16);
+}
+
+#if defined(AES_KERNEL_X86)
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, (int)leaf, (int)subleaf);
+    for (int i = 0; i < 4; i++) regs[i] = (uint32_t)info[i];
+#else
+    if (!__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3])) {
+        regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    }
+#endif
+}
+
+static uint64_t read_xcr0(void) {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static bool cpu_has_aesni(void) {
+    uint32_t regs[4];
+    cpuid(1, 0, regs);
+    return (regs[2] & (1u << 25)) != 0;
+}
+
+static bool cpu_has_vaes(void) {
+    uint32_t regs[4];
+    cpuid(0, 0, regs);
+    if (regs[0] < 7) {
+        return false;
+    }
+    cpuid(1, 0, regs);
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    bool avx = (regs[2] & (1u << 28)) != 0;
+    if (!osxsave || !avx || (read_xcr0() & 0x6) != 0x6) {
+        return false;
+    }
+    cpuid(7, 0, regs);
+    bool avx2 = (regs[1] & (1u << 5)) != 0;
+    bool vaes = (regs[2] & (1u << 9)) != 0;
+    return avx2 && vaes;
+}
+
+#elif defined(AES_KERNEL_ARM64)
+
+static bool cpu_has_armv8_aes(void) {
+#if defined(__APPLE__)
+    return true;
+#elif defined(_WIN32)
+    return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE) != 0;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+    return false;
+#endif
+}
+
+#endif
+
+static bool kernel_self_test(const AesKernel* kernel) {
+    enum { BLOCKS = 256, PAGES = AES_KERNEL_LANES + 3 };
+    static uint8_t plain[PAGES * BLOCKS * 16];
+    static uint8_t cipher_text[PAGES * BLOCKS * 16];
+    static uint8_t decrypted[PAGES * BLOCKS * 16];
+    uint8_t key[16];
+    uint8_t ivs[PAGES * 16];
+
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < sizeof(plain); i++) {
+        seed = seed * 1103515245 + 12345;
+        plain[i] = (uint8_t)(seed >> 16);
+    }
+    memcpy(key, plain, 16);
+    memcpy(ivs, plain + 16, sizeof(ivs));
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return false;
+    }
+
+    bool ok = true;
+    // Full pages through the lane path, then a short odd-sized page through the tail path.
+    const size_t shapes[2][2] = { { BLOCKS, PAGES }, { 5, 1 } };
+    for (int s = 0; s < 2 && ok; s++) {
+        size_t blocks = shapes[s][0];
+        size_t pages = shapes[s][1];
+        size_t page_bytes = blocks * 16;
+
+        for (size_t p = 0; p < pages && ok; p++) {
+            int len = 0;
+            ok = EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, ivs + p * 16) &&
+                EVP_CIPHER_CTX_set_padding(ctx, 0) &&
+                EVP_EncryptUpdate(ctx, cipher_text + p * page_bytes, &len, plain + p * page_bytes, (int)page_bytes);
+        }
+        if (!ok) {
+            break;
+        }
+
+        AesKernelKey kernel_key;
+        aes_kernel_expand_key(key, &kernel_key);
+        kernel->decrypt(&kernel_key, cipher_text, decrypted, blocks, pages, ivs);
+        ok = memcmp(decrypted, plain, pages * page_bytes) == 0;
+
+        // And once more in place.
+        if (ok) {
+            kernel->decrypt(&kernel_key, cipher_text, cipher_text, blocks, pages, ivs);
+            ok = memcmp(cipher_text, plain, pages * page_bytes) == 0;
+        }
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+static const AesKernel* g_kernel = NULL;
+
+const AesKernel* aes_kernel_init(bool allow_kernel) {
+    g_kernel = NULL;
+
+    if (!allow_kernel) {
+        return NULL;
+    }
+
+    static const AesKernel* candidates[3];
+    int count = 0;
+
+#if defined(AES_KERNEL_X86)
+    static const AesKernel vaes = { "VAES", aes_cbc_decrypt_vaes };
+    static const AesKernel aesni = { "AES-NI", aes_cbc_decrypt_aesni };
+    if (cpu_has_aesni()) {
+        if (cpu_has_vaes()) {
+            candidates[count++] = &vaes;
+        }
+        candidates[count++] = &aesni;
+    }
+#elif defined(AES_KERNEL_ARM64)
+    static const AesKernel armv8 = { "ARMv8-CE", aes_cbc_decrypt_armv8 };
+    if (cpu_has_armv8_aes()) {
+        candidates[count++] = &armv8;
+    }
+#endif
+
+    for (int i = 0; i < count; i++) {
+        if (kernel_self_test(candidates[i])) {
+            g_kernel = candidates[i];
+            break;
+        }
+        log_printf("AES kernel %s failed its self-test, not using it\n", candidates[i]->name);
+    }
+    return g_kernel;
+}
+
+const AesKernel* aes_kernel_get(void) {
+    return g_kernel;
+}
@@ -0,0 +1,70 @@
+#include "aes_kernel.h"
+
+#if defined(AES_KERNEL_ARM64)
+#include <arm_neon.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(__ARM_FEATURE_CRYPTO) && !defined(__ARM_FEATURE_AES)
+  #define ARMV8_TARGET __attribute__((target("+crypto")))
+#else
+  #define ARMV8_TARGET
+#endif
+
+static ARMV8_TARGET inline uint8x16_t armv8_decrypt_block(uint8x16_t x, const uint8x16_t* rk) {
+    for (int r = 0; r < 9; r++) {
+        x = vaesimcq_u8(vaesdq_u8(x, rk[r]));
+    }
+    x = vaesdq_u8(x, rk[9]);
+    return veorq_u8(x, rk[10]);
+}
+
+ARMV8_TARGET void aes_cbc_decrypt_armv8(const AesKernelKey* key, const uint8_t* in, uint8_t* out,
+    size_t blocks_per_page, size_t page_count, const uint8_t* ivs) {
+    uint8x16_t rk[11];
+    for (int r = 0; r < 11; r++) {
+        rk[r] = vld1q_u8(key->round_keys + r * 16);
+    }
+
+    size_t page_bytes = blocks_per_page * 16;
+    size_t p = 0;
+
+    // Lane l walks page p + l; every step decrypts block b of all eight pages.
+    for (; p + AES_KERNEL_LANES <= page_count; p += AES_KERNEL_LANES) {
+        const uint8_t* src = in + p * page_bytes;
+        uint8_t* dst = out + p * page_bytes;
+        uint8x16_t prev[AES_KERNEL_LANES];
+        for (int l = 0; l < AES_KERNEL_LANES; l++) {
+            prev[l] = vld1q_u8(ivs + (p + l) * 16);
+        }
+
+        for (size_t offset = 0; offset < page_bytes; offset += 16) {
+            uint8x16_t c[AES_KERNEL_LANES], x[AES_KERNEL_LANES];
+            for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                c[l] = vld1q_u8(src + l * page_bytes + offset);
+                x[l] = c[l];
+            }
+            for (int r = 0; r < 9; r++) {
+                for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                    x[l] = vaesimcq_u8(vaesdq_u8(x[l], rk[r]));
+                }
+            }
+            for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                x[l] = veorq_u8(vaesdq_u8(x[l], rk[9]), rk[10]);
+                vst1q_u8(dst + l * page_bytes + offset, veorq_u8(x[l], prev[l]));
+                prev[l] = c[l];
+            }
+        }
+    }
+
+    for (; p < page_count; p++) {
+        const uint8_t* src = in + p * page_bytes;
+        uint8_t* dst = out + p * page_bytes;
+        uint8x16_t prev = vld1q_u8(ivs + p * 16);
+        for (size_t offset = 0; offset < page_bytes; offset += 16) {
+            uint8x16_t c = vld1q_u8(src + offset);
+            vst1q_u8(dst + offset, veorq_u8(armv8_decrypt_block(c, rk), prev));
+            prev = c;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,66 @@
+#include "aes_kernel.h"
+
+#if defined(AES_KERNEL_X86)
+#include <immintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+  #define VAES_TARGET __attribute__((target("vaes,avx2,aes")))
+#else
+  #define VAES_TARGET
+#endif
+
+// Same lane layout as the AES-NI kernel, but every lane holds two consecutive
+// blocks of its page in one 256-bit register, so 16 blocks are in flight.
+VAES_TARGET void aes_cbc_decrypt_vaes(const AesKernelKey* key, const uint8_t* in, uint8_t* out,
+    size_t blocks_per_page, size_t page_count, const uint8_t* ivs) {
+    if (blocks_per_page % 2 != 0) {
+        aes_cbc_decrypt_aesni(key, in, out, blocks_per_page, page_count, ivs);
+        return;
+    }
+
+    __m256i rk[11];
+    for (int r = 0; r < 11; r++) {
+        rk[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(key->round_keys + r * 16)));
+    }
+
+    size_t page_bytes = blocks_per_page * 16;
+    size_t p = 0;
+
+    for (; p + AES_KERNEL_LANES <= page_count; p += AES_KERNEL_LANES) {
+        const uint8_t* src = in + p * page_bytes;
+        uint8_t* dst = out + p * page_bytes;
+
+        // The upper half of prev[l] is the ciphertext block preceding the pair.
+        __m256i prev[AES_KERNEL_LANES];
+        for (int l = 0; l < AES_KERNEL_LANES; l++) {
+            __m128i iv = _mm_loadu_si128((const __m128i*)(ivs + (p + l) * 16));
+            prev[l] = _mm256_inserti128_si256(_mm256_setzero_si256(), iv, 1);
+        }
+
+        for (size_t offset = 0; offset < page_bytes; offset += 32) {
+            __m256i c[AES_KERNEL_LANES], x[AES_KERNEL_LANES];
+            for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                c[l] = _mm256_loadu_si256((const __m256i*)(src + l * page_bytes + offset));
+                x[l] = _mm256_xor_si256(c[l], rk[0]);
+            }
+            for (int r = 1; r < 10; r++) {
+                for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                    x[l] = _mm256_aesdec_epi128(x[l], rk[r]);
+                }
+            }
+            for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                x[l] = _mm256_aesdeclast_epi128(x[l], rk[10]);
+                __m256i chain = _mm256_permute2x128_si256(prev[l], c[l], 0x21);
+                _mm256_storeu_si256((__m256i*)(dst + l * page_bytes + offset), _mm256_xor_si256(x[l], chain));
+                prev[l] = c[l];
+            }
+        }
+    }
+
+    if (p < page_count) {
+        aes_cbc_decrypt_aesni(key, in + p * page_bytes, out + p * page_bytes,
+            blocks_per_page, page_count - p, ivs + p * 16);
+    }
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include "aes_kernel.h"
+
+#if defined(AES_KERNEL_X86)
+#include <wmmintrin.h>
+#include <emmintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+  #define AESNI_TARGET __attribute__((target("aes,sse2")))
+#else
+  #define AESNI_TARGET
+#endif
+
+static AESNI_TARGET inline __m128i aesni_decrypt_block(__m128i x, const __m128i* rk) {
+    x = _mm_xor_si128(x, rk[0]);
+    for (int r = 1; r < 10; r++) {
+        x = _mm_aesdec_si128(x, rk[r]);
+    }
+    return _mm_aesdeclast_si128(x, rk[10]);
+}
+
+// One page at a time, eight consecutive blocks in flight (CBC decryption only
+// chains through the ciphertext, so the blocks of a page are independent).
+static AESNI_TARGET void aesni_decrypt_page(const __m128i* rk, const uint8_t* in, uint8_t* out,
+    size_t blocks, __m128i prev) {
+    size_t b = 0;
+    for (; b + AES_KERNEL_LANES <= blocks; b += AES_KERNEL_LANES) {
+        __m128i c[AES_KERNEL_LANES], x[AES_KERNEL_LANES];
+        for (int l = 0; l < AES_KERNEL_LANES; l++) {
+            c[l] = _mm_loadu_si128((const __m128i*)(in + (b + l) * 16));
+            x[l] = _mm_xor_si128(c[l], rk[0]);
+        }
+        for (int r = 1; r < 10; r++) {
+            for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                x[l] = _mm_aesdec_si128(x[l], rk[r]);
+            }
+        }
+        for (int l = 0; l < AES_KERNEL_LANES; l++) {
+            x[l] = _mm_aesdeclast_si128(x[l], rk[10]);
+            x[l] = _mm_xor_si128(x[l], l == 0 ? prev : c[l - 1]);
+            _mm_storeu_si128((__m128i*)(out + (b + l) * 16), x[l]);
+        }
+        prev = c[AES_KERNEL_LANES - 1];
+    }
+    for (; b < blocks; b++) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(in + b * 16));
+        __m128i x = _mm_xor_si128(aesni_decrypt_block(c, rk), prev);
+        _mm_storeu_si128((__m128i*)(out + b * 16), x);
+        prev = c;
+    }
+}
+
+AESNI_TARGET void aes_cbc_decrypt_aesni(const AesKernelKey* key, const uint8_t* in, uint8_t* out,
+    size_t blocks_per_page, size_t page_count, const uint8_t* ivs) {
+    __m128i rk[11];
+    for (int r = 0; r < 11; r++) {
+        rk[r] = _mm_loadu_si128((const __m128i*)(key->round_keys + r * 16));
+    }
+
+    size_t page_bytes = blocks_per_page * 16;
+    size_t p = 0;
+
+    // Lane l walks page p + l; every step decrypts block b of all eight pages.
+    for (; p + AES_KERNEL_LANES <= page_count; p += AES_KERNEL_LANES) {
+        const uint8_t* src = in + p * page_bytes;
+        uint8_t* dst = out + p * page_bytes;
+        __m128i prev[AES_KERNEL_LANES];
+        for (int l = 0; l < AES_KERNEL_LANES; l++) {
+            prev[l] = _mm_loadu_si128((const __m128i*)(ivs + (p + l) * 16));
+        }
+
+        for (size_t offset = 0; offset < page_bytes; offset += 16) {
+            __m128i c[AES_KERNEL_LANES], x[AES_KERNEL_LANES];
+            for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                c[l] = _mm_loadu_si128((const __m128i*)(src + l * page_bytes + offset));
+                x[l] = _mm_xor_si128(c[l], rk[0]);
+            }
+            for (int r = 1; r < 10; r++) {
+                for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                    x[l] = _mm_aesdec_si128(x[l], rk[r]);
+                }
+            }
+            for (int l = 0; l < AES_KERNEL_LANES; l++) {
+                x[l] = _mm_aesdeclast_si128(x[l], rk[10]);
+                _mm_storeu_si128((__m128i*)(dst + l * page_bytes + offset), _mm_xor_si128(x[l], prev[l]));
+                prev[l] = c[l];
+            }
+        }
+    }
+
+    for (; p < page_count; p++) {
+        __m128i iv = _mm_loadu_si128((const __m128i*)(ivs + p * 16));
+        aesni_decrypt_page(rk, in + p * page_bytes, out + p * page_bytes, blocks_per_page, iv);
+    }
+}
+
+#endif
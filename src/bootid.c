@@ -1,7 +1,16 @@
 #include "bootid.h"
+#include "crc32.h"
 #include <stdio.h>
 
 void format_timestamp(const Timestamp* ts, char* buffer, size_t buffer_size) {
     snprintf(buffer, buffer_size, "%04d%02d%02d%02d%02d%02d",
         ts->year, ts->month, ts->day, ts->hour, ts->minute, ts->second);
+}
+
+uint32_t bootid_calculate_crc(const BootId* bootid) {
+    size_t length = bootid->length;
+    if (length < sizeof(bootid->crc32) || length > sizeof(BootId)) {
+        length = sizeof(BootId);
+    }
+    return crc32_update(0, (const uint8_t*)bootid + sizeof(bootid->crc32), length - sizeof(bootid->crc32));
 }
\ No newline at end of file
@@ -0,0 +1,384 @@
+#include "container.h"
+#include "log.h"
+#include "stats.h"
+#include "crypto.h"
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#define BOOTID_SIZE 96
+#define CONTAINER_READ_SIZE (DECRYPT_PAGE_SIZE * 16)
+
+static bool decrypt_bootid(const uint8_t* encrypted, BootId* bootid) {
+    uint8_t decrypted[BOOTID_SIZE];
+    int out_len = 0;
+    int final_len = 0;
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        log_printf("Could not create cipher context\n");
+        return false;
+    }
+
+    EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, BOOTID_KEY, BOOTID_IV);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+    if (!EVP_DecryptUpdate(ctx, decrypted, &out_len, encrypted, BOOTID_SIZE)) {
+        log_printf("Could not decrypt BootId\n");
+        EVP_CIPHER_CTX_free(ctx);
+        return false;
+    }
+
+    if (!EVP_DecryptFinal_ex(ctx, decrypted + out_len, &final_len)) {
+        log_printf("Could not finalize decryption\n");
+        EVP_CIPHER_CTX_free(ctx);
+        return false;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    memcpy(bootid, decrypted, sizeof(BootId));
+    return true;
+}
+
+static void build_image_name(const BootId* bootid, char* out, size_t out_size) {
+    char target_timestamp_str[20];
+    format_timestamp(&bootid->target_timestamp, target_timestamp_str, sizeof(target_timestamp_str));
+
+    char os_id[4];
+    char game_id[5];
+    memcpy(os_id, bootid->os_id, 3);
+    os_id[3] = '\0';
+    memcpy(game_id, bootid->game_id, 4);
+    game_id[4] = '\0';
+
+    if (bootid->container_type == CONTAINER_TYPE_OS) {
+        snprintf(out, out_size, "%s_%04d%02d%02d_%s_%d.ntfs",
+            os_id,
+            bootid->os_version.major,
+            bootid->os_version.minor,
+            bootid->os_version.release,
+            target_timestamp_str,
+            bootid->sequence_number);
+    }
+    else if (bootid->container_type == CONTAINER_TYPE_APP) {
+        if (bootid->sequence_number > 0) {
+            snprintf(out, out_size, "%s_%d%02d%02d_%s_%d_%d%02d%02d.ntfs",
+                game_id,
+                bootid->target_version.version.major,
+                bootid->target_version.version.minor,
+                bootid->target_version.version.release,
+                target_timestamp_str,
+                bootid->sequence_number,
+                bootid->source_version.major,
+                bootid->source_version.minor,
+                bootid->source_version.release);
+        }
+        else {
+            snprintf(out, out_size, "%s_%d%02d%02d_%s_%d.ntfs",
+                game_id,
+                bootid->target_version.version.major,
+                bootid->target_version.version.minor,
+                bootid->target_version.version.release,
+                target_timestamp_str,
+                bootid->sequence_number);
+        }
+    }
+    else if (bootid->container_type == CONTAINER_TYPE_OPTION) {
+        char option_str[5];
+        memcpy(option_str, bootid->target_version.option, 4);
+        option_str[4] = '\0';
+        snprintf(out, out_size, "%s_%s_%s_%d.exfat",
+            game_id,
+            option_str,
+            target_timestamp_str,
+            bootid->sequence_number);
+    }
+}
+
+static bool container_fail(Container* container) {
+    container_close(container);
+    return false;
+}
+
+bool container_open_header(Container* container, const char* path) {
+    memset(container, 0, sizeof(Container));
+    mutex_init(&container->reader_mutex);
+
+    container->fp = fopen(path, "rb");
+    if (!container->fp) {
+        log_perror(path);
+        return container_fail(container);
+    }
+
+    uint8_t bootid_bytes[BOOTID_SIZE];
+    if (fread(bootid_bytes, 1, BOOTID_SIZE, container->fp) != BOOTID_SIZE) {
+        log_printf("Could not read BootId from %s\n", path);
+        return container_fail(container);
+    }
+
+    if (!decrypt_bootid(bootid_bytes, &container->bootid)) {
+        return container_fail(container);
+    }
+
+    const BootId* bootid = &container->bootid;
+    if (bootid->container_type != CONTAINER_TYPE_OS &&
+        bootid->container_type != CONTAINER_TYPE_APP &&
+        bootid->container_type != CONTAINER_TYPE_OPTION) {
+        log_printf("Unknown container type %d\n", bootid->container_type);
+        return container_fail(container);
+    }
+
+    char os_id[4];
+    char game_id[5];
+    memcpy(os_id, bootid->os_id, 3);
+    os_id[3] = '\0';
+    memcpy(game_id, bootid->game_id, 4);
+    game_id[4] = '\0';
+
+    const char* id = (bootid->container_type == CONTAINER_TYPE_OS) ? os_id : game_id;
+
+    GameKeys keys;
+    if (bootid->container_type == CONTAINER_TYPE_OS || bootid->container_type == CONTAINER_TYPE_APP) {
+        container->has_key = get_game_keys(id, &keys);
+    }
+    else {
+        memcpy(keys.key, OPTION_KEY, 16);
+        memcpy(keys.iv, OPTION_IV, 16);
+        keys.has_iv = true;
+        container->has_key = true;
+    }
+
+    if (container->has_key) {
+        memcpy(container->key, keys.key, 16);
+        container->has_fixed_iv = !bootid->use_custom_iv && keys.has_iv;
+        if (container->has_fixed_iv) {
+            memcpy(container->iv, keys.iv, 16);
+        }
+    }
+
+    container->data_offset = bootid->header_block_count * bootid->block_size;
+    container->payload_size = (bootid->block_count - bootid->header_block_count) * bootid->block_size;
+
+    build_image_name(bootid, container->image_name, sizeof(container->image_name));
+    return true;
+}
+
+bool container_open(Container* container, const char* path) {
+    if (!container_open_header(container, path)) {
+        return false;
+    }
+
+    if (!container->has_key) {
+        log_printf("Decryption key invalid or not found.\n");
+        return container_fail(container);
+    }
+
+    if (!container->has_fixed_iv) {
+        uint8_t first_page[DECRYPT_PAGE_SIZE];
+
+        if (FSEEKO(container->fp, container->data_offset, SEEK_SET) != 0) {
+            log_perror("fseek");
+            return container_fail(container);
+        }
+
+        if (fread(first_page, 1, DECRYPT_PAGE_SIZE, container->fp) != DECRYPT_PAGE_SIZE) {
+            log_perror("fread");
+            return container_fail(container);
+        }
+
+        const uint8_t* expected_header =
+            (container->bootid.container_type == CONTAINER_TYPE_OPTION) ? EXFAT_HEADER : NTFS_HEADER;
+        if (!calculate_file_iv(container->key, expected_header, first_page, container->iv)) {
+            log_printf("Could not calculate file IV\n");
+            return container_fail(container);
+        }
+    }
+
+    return true;
+}
+
+uint64_t container_file_size(Container* container) {
+    mutex_lock(&container->reader_mutex);
+    uint64_t size = 0;
+    if (FSEEKO(container->fp, 0, SEEK_END) == 0) {
+        size = (uint64_t)FTELLO(container->fp);
+    }
+    mutex_unlock(&container->reader_mutex);
+    return size;
+}
+
+bool container_verify(Container* container) {
+    const BootId* bootid = &container->bootid;
+    if (bootid->length != BOOTID_SIZE) {
+        log_printf("Header length is %u bytes, expected %d\n", bootid->length, BOOTID_SIZE);
+        return false;
+    }
+
+    uint32_t crc = bootid_calculate_crc(bootid);
+    if (crc != bootid->crc32) {
+        log_printf("Header checksum mismatch: stored %08X, calculated %08X\n", bootid->crc32, crc);
+        return false;
+    }
+
+    uint64_t expected = bootid->block_count * bootid->block_size;
+    uint64_t actual = container_file_size(container);
+    if (actual < expected) {
+        log_printf("Container is truncated: %llu of %llu bytes present\n",
+            (unsigned long long)actual, (unsigned long long)expected);
+        return false;
+    }
+    return true;
+}
+
+static bool container_prepare_reader(Container* container) {
+    if (container->read_buffer) {
+        return true;
+    }
+
+    container->read_buffer = malloc(CONTAINER_READ_SIZE);
+    container->decrypted_buffer = malloc(CONTAINER_READ_SIZE);
+    if (!container->read_buffer || !container->decrypted_buffer) {
+        free(container->read_buffer);
+        free(container->decrypted_buffer);
+        container->read_buffer = NULL;
+        container->decrypted_buffer = NULL;
+        return false;
+    }
+
+    if (!page_decryptor_init(&container->decryptor, container->key, container->iv, 1)) {
+        free(container->read_buffer);
+        free(container->decrypted_buffer);
+        container->read_buffer = NULL;
+        container->decrypted_buffer = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Reads and decrypts payload pages [page_start, page_start + span) into
+// decrypted_buffer. The caller holds reader_mutex.
+static bool container_decrypt_span(Container* container, uint64_t page_start, size_t span) {
+    if (!container_prepare_reader(container)) {
+        return false;
+    }
+
+    if (FSEEKO(container->fp, container->data_offset + page_start, SEEK_SET) != 0) {
+        return false;
+    }
+
+    uint64_t start = stats_now();
+    size_t read = fread(container->read_buffer, 1, span, container->fp);
+    stats_time(STAT_TIME_READ, start);
+    stats_count(STAT_BYTES_READ, read);
+    if (read != span) {
+        return false;
+    }
+
+    if (!page_decryptor_run(&container->decryptor, container->read_buffer,
+            container->decrypted_buffer, span, page_start)) {
+        return false;
+    }
+
+    if (container->cache_enabled) {
+        for (size_t pos = 0; pos + DECRYPT_PAGE_SIZE <= span; pos += DECRYPT_PAGE_SIZE) {
+            page_cache_insert(&container->cache, page_start + pos, container->decrypted_buffer + pos);
+        }
+    }
+    return true;
+}
+
+bool container_read(Container* container, void* buffer, uint64_t offset, size_t size) {
+    if (offset > container->payload_size || size > container->payload_size - offset) {
+        return false;
+    }
+
+    uint8_t page[DECRYPT_PAGE_SIZE];
+    uint8_t* out = (uint8_t*)buffer;
+    while (size > 0) {
+        uint64_t page_start = offset - (offset % DECRYPT_PAGE_SIZE);
+        size_t skip = (size_t)(offset - page_start);
+
+        if (container->cache_enabled && page_start + DECRYPT_PAGE_SIZE <= container->payload_size &&
+            page_cache_lookup(&container->cache, page_start, page)) {
+            size_t chunk = DECRYPT_PAGE_SIZE - skip;
+            if (chunk > size) {
+                chunk = size;
+            }
+            memcpy(out, page + skip, chunk);
+
+            out += chunk;
+            offset += chunk;
+            size -= chunk;
+            continue;
+        }
+
+        uint64_t span_end = offset + size;
+        span_end = (span_end + DECRYPT_PAGE_SIZE - 1) / DECRYPT_PAGE_SIZE * DECRYPT_PAGE_SIZE;
+        if (span_end > container->payload_size) {
+            span_end = container->payload_size;
+        }
+        if (span_end - page_start > CONTAINER_READ_SIZE) {
+            span_end = page_start + CONTAINER_READ_SIZE;
+        }
+        size_t span = (size_t)(span_end - page_start);
+        size_t chunk = span - skip;
+        if (chunk > size) {
+            chunk = size;
+        }
+
+        mutex_lock(&container->reader_mutex);
+        bool decrypted = container_decrypt_span(container, page_start, span);
+        if (decrypted) {
+            memcpy(out, container->decrypted_buffer + skip, chunk);
+        }
+        mutex_unlock(&container->reader_mutex);
+
+        if (!decrypted) {
+            return false;
+        }
+
+        out += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool container_enable_cache(Container* container, size_t capacity_bytes) {
+    if (container->cache_enabled) {
+        return true;
+    }
+    if (!page_cache_init(&container->cache, capacity_bytes, PAGE_CACHE_DEFAULT_SHARDS)) {
+        return false;
+    }
+    container->cache_enabled = true;
+    return true;
+}
+
+static bool container_source_read(void* opaque, void* buffer, uint64_t offset, size_t size) {
+    return container_read((Container*)opaque, buffer, offset, size);
+}
+
+void container_as_source(Container* container, ImageSource* source) {
+    memset(source, 0, sizeof(ImageSource));
+    source->read = container_source_read;
+    source->close = NULL;
+    source->opaque = container;
+    source->size = container->payload_size;
+}
+
+void container_close(Container* container) {
+    if (container->read_buffer) {
+        page_decryptor_close(&container->decryptor);
+    }
+    if (container->cache_enabled) {
+        page_cache_close(&container->cache);
+    }
+    mutex_destroy(&container->reader_mutex);
+    free(container->read_buffer);
+    free(container->decrypted_buffer);
+    if (container->fp) {
+        fclose(container->fp);
+    }
+    memset(container, 0, sizeof(Container));
+}
@@ -0,0 +1,207 @@
+#include "crc32.h"
+#include <string.h>
+
+#if defined(CRC32_X86)
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #else
+    #include <cpuid.h>
+  #endif
+#elif defined(CRC32_ARM64)
+  #if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+      #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+  #elif defined(__linux__)
+    #include <sys/auxv.h>
+    #ifndef HWCAP_CRC32
+      #define HWCAP_CRC32 (1 << 7)
+    #endif
+  #endif
+#endif
+
+#define CRC32_POLY 0xEDB88320u  // reflected 0x04C11DB7
+
+typedef uint32_t (*Crc32Fn)(uint32_t crc, const uint8_t* data, size_t size);
+
+static uint32_t g_table[8][256];
+static uint32_t g_x2n[32];      // x^(2^n) mod P, for crc32_combine
+static Crc32Fn g_accelerated = NULL;
+static const char* g_name = NULL;
+
+// Slice-by-8 over the inverted register.
+static uint32_t crc32_table(uint32_t crc, const uint8_t* data, size_t size) {
+    while (size > 0 && ((uintptr_t)data & 7) != 0) {
+        crc = g_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+    while (size >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = g_table[7][lo & 0xFF] ^ g_table[6][(lo >> 8) & 0xFF] ^
+              g_table[5][(lo >> 16) & 0xFF] ^ g_table[4][lo >> 24] ^
+              g_table[3][hi & 0xFF] ^ g_table[2][(hi >> 8) & 0xFF] ^
+              g_table[1][(hi >> 16) & 0xFF] ^ g_table[0][hi >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = g_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+    return crc;
+}
+
+#if defined(CRC32_X86)
+
+static bool cpu_has_pclmul(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    uint32_t ecx = (uint32_t)info[2];
+#else
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+#endif
+    // PCLMULQDQ and SSE4.1 (for the final extract)
+    return (ecx & (1u << 1)) != 0 && (ecx & (1u << 19)) != 0;
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t* data, size_t size) {
+    if (size >= 64) {
+        size_t folded = size & ~(size_t)15;
+        crc = crc32_fold_pclmul(crc, data, folded);
+        data += folded;
+        size -= folded;
+    }
+    return crc32_table(crc, data, size);
+}
+
+#elif defined(CRC32_ARM64)
+
+static bool cpu_has_armv8_crc(void) {
+#if defined(__APPLE__)
+    return true;
+#elif defined(_WIN32)
+    return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE) != 0;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+    return false;
+#endif
+}
+
+#endif
+
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(n * 2^k) mod P
+static uint32_t x2nmodp(uint64_t n, unsigned k) {
+    uint32_t p = 1u << 31;  // x^0
+    while (n) {
+        if (n & 1) {
+            p = multmodp(g_x2n[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+static bool accelerated_self_test(Crc32Fn fn) {
+    static uint8_t data[4096 + 67];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 131 + (i >> 7));
+    }
+    // Odd lengths and offsets exercise the unaligned heads and short tails.
+    static const size_t sizes[] = { 0, 1, 15, 16, 63, 64, 65, 127, 128, 1000, 4096, 4096 + 67 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t offset = 0; offset < 3 && offset + sizes[i] <= sizeof(data); offset++) {
+            if (fn(0xFFFFFFFFu, data + offset, sizes[i]) != crc32_table(0xFFFFFFFFu, data + offset, sizes[i])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+const char* crc32_init(void) {
+    if (g_name) {
+        return g_name;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+        }
+        g_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            g_table[t][i] = g_table[0][g_table[t - 1][i] & 0xFF] ^ (g_table[t - 1][i] >> 8);
+        }
+    }
+
+    uint32_t p = 1u << 30;  // x^1
+    g_x2n[0] = p;
+    for (int n = 1; n < 32; n++) {
+        g_x2n[n] = p = multmodp(p, p);
+    }
+
+    Crc32Fn candidate = NULL;
+    const char* name = NULL;
+#if defined(CRC32_X86)
+    if (cpu_has_pclmul()) {
+        candidate = crc32_pclmul;
+        name = "PCLMUL";
+    }
+#elif defined(CRC32_ARM64)
+    if (cpu_has_armv8_crc()) {
+        candidate = crc32_armv8;
+        name = "ARMv8-CRC";
+    }
+#endif
+    if (candidate && accelerated_self_test(candidate)) {
+        g_accelerated = candidate;
+        g_name = name;
+    }
+    else {
+        g_name = "table";
+    }
+    return g_name;
+}
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t size) {
+    if (!g_name) {
+        crc32_init();
+    }
+    Crc32Fn fn = g_accelerated ? g_accelerated : crc32_table;
+    return ~fn(~crc, (const uint8_t*)data, size);
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+    if (!g_name) {
+        crc32_init();
+    }
+    return multmodp(x2nmodp(size2, 3), crc1) ^ crc2;
+}
@@ -0,0 +1,51 @@
+#include "crc32.h"
+
+#if defined(CRC32_ARM64)
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <arm_acle.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(__ARM_FEATURE_CRC32)
+  #define ARMV8_CRC_TARGET __attribute__((target("+crc")))
+#else
+  #define ARMV8_CRC_TARGET
+#endif
+
+// CRC32X/W/B implement the same reflected polynomial as the table version,
+// eight bytes per instruction.
+ARMV8_CRC_TARGET uint32_t crc32_armv8(uint32_t crc, const uint8_t* data, size_t size) {
+    while (size > 0 && ((uintptr_t)data & 7) != 0) {
+        crc = __crc32b(crc, *data++);
+        size--;
+    }
+    while (size >= 32) {
+        uint64_t a, b, c, d;
+        memcpy(&a, data, 8);
+        memcpy(&b, data + 8, 8);
+        memcpy(&c, data + 16, 8);
+        memcpy(&d, data + 24, 8);
+        crc = __crc32d(crc, a);
+        crc = __crc32d(crc, b);
+        crc = __crc32d(crc, c);
+        crc = __crc32d(crc, d);
+        data += 32;
+        size -= 32;
+    }
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = __crc32d(crc, word);
+        data += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = __crc32b(crc, *data++);
+        size--;
+    }
+    return crc;
+}
+
+#endif
@@ -61,56 +61,3 @@ bool calculate_file_iv(
 
     return true;
 }
-
-bool get_game_keys(const char* game_id, GameKeys* out_keys) {
-    const GameKeyEntry* entry = game_keys;
-    while (entry->game_id != NULL) {
-        if (strcmp(entry->game_id, game_id) == 0) {
-            memcpy(out_keys->key, entry->key, 16);
-            if (entry->has_iv) {
-                memcpy(out_keys->iv, entry->iv, 16);
-                out_keys->has_iv = true;
-            }
-            else {
-                memset(out_keys->iv, 0, 16);
-                out_keys->has_iv = false;
-            }
-            return true;
-        }
-        entry++;
-    }
-
-    char filename[256];
-    SNPRINTF(filename, sizeof(filename), "%s.bin", game_id);
-
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        return false;
-    }
-
-    uint8_t buffer[32];
-    size_t read_size = fread(buffer, 1, sizeof(buffer), file);
-    fclose(file);
-
-    if (read_size == 16) {
-        memcpy(out_keys->key, buffer, 16);
-        memset(out_keys->iv, 0, 16);
-        out_keys->has_iv = false;
-        return true;
-    }
-    else if (read_size == 32) {
-        memcpy(out_keys->key, buffer, 16);
-        memcpy(out_keys->iv, buffer + 16, 16);
-
-        if (memcmp(out_keys->iv, NTFS_HEADER, 16) == 0 || memcmp(out_keys->iv, EXFAT_HEADER, 16) == 0) {
-            out_keys->has_iv = false;
-        }
-        else {
-            out_keys->has_iv = true;
-        }
-        return true;
-    }
-    else {
-        return false;
-    }
-}
\ No newline at end of file
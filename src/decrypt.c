@@ -0,0 +1,939 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // vmsplice, F_SETPIPE_SZ
+#endif
+
+#include "decrypt.h"
+#include "crypto.h"
+#include "crc32.h"
+#include "common.h"
+#include "log.h"
+#include "stats.h"
+#include "image.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/uio.h>
+#define STREAM_VMSPLICE
+#endif
+#else
+#include <io.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <emmintrin.h>
+#define ZERO_CHECK_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define ZERO_CHECK_NEON
+#endif
+
+#define MAPPED_WINDOW_SIZE (DECRYPT_CHUNK_SIZE * 16)
+#define MAPPED_SYNC_INTERVAL (MAPPED_WINDOW_SIZE * 4)
+
+typedef struct {
+    uint8_t* in;
+    uint8_t* out;
+    size_t size;
+} StreamChunk;
+
+typedef enum {
+    STREAM_OUTPUT_STDIO,
+    STREAM_OUTPUT_WRITE,
+    STREAM_OUTPUT_VMSPLICE
+} StreamOutputMode;
+
+typedef struct {
+    const StreamConfig* config;
+    StreamChunk* chunks;
+    uint64_t chunk_count;
+    Mutex mutex;
+    CondVar cond;
+    uint64_t read_count;
+    uint64_t decrypted_count;
+    uint64_t written_count;
+    uint64_t bytes_written;
+    bool aborted;
+    StreamOutputMode output_mode;
+    int output_fd;
+    StreamStats* stats;
+    LogBuffer* log;         // the caller's log target, shared with the stage threads
+    bool collect_stats;     // the caller has stats attached; merged after the join
+    ImageStats reader_stats;
+    ImageStats writer_stats;
+} DecryptStream;
+
+static bool decrypt_pages(EVP_CIPHER_CTX* cipher, const uint8_t* file_iv,
+    const uint8_t* in, uint8_t* out, size_t size, uint64_t file_offset, uint32_t* crc) {
+    uint8_t page_iv[16];
+    size_t offset = 0;
+
+    while (offset < size) {
+        size_t block_size = (size - offset > DECRYPT_PAGE_SIZE) ? DECRYPT_PAGE_SIZE : (size - offset);
+
+        calculate_page_iv(file_offset + offset, file_iv, page_iv);  // Generate unique IV for each 4KB page
+
+        if (!EVP_DecryptInit_ex(cipher, NULL, NULL, NULL, page_iv)) {
+            return false;
+        }
+
+        int out_len1 = 0, out_len2 = 0;
+        if (!EVP_DecryptUpdate(cipher, out + offset, &out_len1, in + offset, (int)block_size)) {
+            return false;
+        }
+        if (!EVP_DecryptFinal_ex(cipher, out + offset + out_len1, &out_len2)) {
+            return false;
+        }
+        if (out_len1 + out_len2 != (int)block_size) {
+            return false;
+        }
+        if (crc) {
+            *crc = crc32_update(*crc, out + offset, block_size);
+        }
+        offset += block_size;
+    }
+    return true;
+}
+
+#define KERNEL_BATCH_PAGES 64
+
+static bool decrypt_pages_kernel(const PageDecryptor* pd, const uint8_t* in, uint8_t* out,
+    size_t size, uint64_t file_offset, uint32_t* crc) {
+    uint8_t ivs[KERNEL_BATCH_PAGES * 16];
+    size_t full_pages = size / DECRYPT_PAGE_SIZE;
+    size_t tail = size % DECRYPT_PAGE_SIZE;
+
+    if (tail % 16 != 0) {
+        return false;
+    }
+
+    while (full_pages > 0) {
+        size_t batch = (full_pages > KERNEL_BATCH_PAGES) ? KERNEL_BATCH_PAGES : full_pages;
+        for (size_t p = 0; p < batch; p++) {
+            calculate_page_iv(file_offset + p * DECRYPT_PAGE_SIZE, pd->file_iv, ivs + p * 16);
+        }
+        pd->kernel->decrypt(&pd->kernel_key, in, out, DECRYPT_PAGE_SIZE / 16, batch, ivs);
+
+        size_t bytes = batch * DECRYPT_PAGE_SIZE;
+        if (crc) {
+            // The batch is still in L2 here; a later pass would go back to memory.
+            *crc = crc32_update(*crc, out, bytes);
+        }
+        in += bytes;
+        out += bytes;
+        file_offset += bytes;
+        full_pages -= batch;
+    }
+
+    if (tail > 0) {
+        calculate_page_iv(file_offset, pd->file_iv, ivs);
+        pd->kernel->decrypt(&pd->kernel_key, in, out, tail / 16, 1, ivs);
+        if (crc) {
+            *crc = crc32_update(*crc, out, tail);
+        }
+    }
+    return true;
+}
+
+static void slice_bounds(const PageDecryptor* pd, int index, size_t* start, size_t* end) {
+    size_t page_count = (pd->size + DECRYPT_PAGE_SIZE - 1) / DECRYPT_PAGE_SIZE;
+    *start = page_count * index / pd->thread_count * DECRYPT_PAGE_SIZE;
+    *end = page_count * (index + 1) / pd->thread_count * DECRYPT_PAGE_SIZE;
+    if (*end > pd->size) {
+        *end = pd->size;
+    }
+    if (*start > *end) {
+        *start = *end;
+    }
+}
+
+static bool decrypt_slice(PageDecryptor* pd, DecryptWorker* worker) {
+    size_t start, end;
+    slice_bounds(pd, worker->index, &start, &end);
+    worker->crc = 0;
+    if (start == end) {
+        return true;
+    }
+
+    uint32_t* crc = pd->crc_enabled ? &worker->crc : NULL;
+    if (pd->kernel) {
+        return decrypt_pages_kernel(pd, pd->in + start, pd->out + start, end - start,
+            pd->file_offset + start, crc);
+    }
+    return decrypt_pages(worker->cipher, pd->file_iv, pd->in + start, pd->out + start,
+        end - start, pd->file_offset + start, crc);
+}
+
+static void decrypt_worker_main(void* arg) {
+    DecryptWorker* worker = (DecryptWorker*)arg;
+    PageDecryptor* pd = worker->owner;
+    uint64_t seen_generation = 0;
+
+    mutex_lock(&pd->mutex);
+    for (;;) {
+        while (!pd->shutdown && pd->generation == seen_generation) {
+            cond_wait(&pd->work_cond, &pd->mutex);
+        }
+        if (pd->shutdown) {
+            break;
+        }
+        seen_generation = pd->generation;
+        mutex_unlock(&pd->mutex);
+
+        bool ok = decrypt_slice(pd, worker);
+
+        mutex_lock(&pd->mutex);
+        if (!ok) {
+            pd->failed = true;
+        }
+        if (--pd->pending == 0) {
+            cond_signal(&pd->done_cond);
+        }
+    }
+    mutex_unlock(&pd->mutex);
+}
+
+static EVP_CIPHER_CTX* create_page_cipher(const uint8_t key[16]) {
+    EVP_CIPHER_CTX* cipher = EVP_CIPHER_CTX_new();
+    if (!cipher) {
+        return NULL;
+    }
+    if (!EVP_DecryptInit_ex(cipher, EVP_aes_128_cbc(), NULL, key, NULL)) {
+        EVP_CIPHER_CTX_free(cipher);
+        return NULL;
+    }
+    EVP_CIPHER_CTX_set_padding(cipher, 0);
+    return cipher;
+}
+
+bool page_decryptor_init(PageDecryptor* pd, const uint8_t key[16], const uint8_t file_iv[16], int thread_count) {
+    memset(pd, 0, sizeof(PageDecryptor));
+    memcpy(pd->file_iv, file_iv, 16);
+    pd->kernel = aes_kernel_get();
+    if (pd->kernel) {
+        aes_kernel_expand_key(key, &pd->kernel_key);
+    }
+    pd->thread_count = (thread_count > 0) ? thread_count : 1;
+
+    pd->workers = calloc(pd->thread_count, sizeof(DecryptWorker));
+    if (!pd->workers) {
+        return false;
+    }
+
+    mutex_init(&pd->mutex);
+    cond_init(&pd->work_cond);
+    cond_init(&pd->done_cond);
+
+    for (int i = 0; i < pd->thread_count; i++) {
+        pd->workers[i].owner = pd;
+        pd->workers[i].index = i;
+        pd->workers[i].cipher = create_page_cipher(key);
+        if (!pd->workers[i].cipher) {
+            for (int j = 0; j < i; j++) {
+                EVP_CIPHER_CTX_free(pd->workers[j].cipher);
+            }
+            cond_destroy(&pd->done_cond);
+            cond_destroy(&pd->work_cond);
+            mutex_destroy(&pd->mutex);
+            free(pd->workers);
+            pd->workers = NULL;
+            return false;
+        }
+    }
+
+    // Worker 0 is the calling thread; only the others need a thread of their own.
+    for (int i = 1; i < pd->thread_count; i++) {
+        if (!thread_create(&pd->workers[i].thread, decrypt_worker_main, &pd->workers[i])) {
+            EVP_CIPHER_CTX_free(pd->workers[i].cipher);
+            for (int j = i + 1; j < pd->thread_count; j++) {
+                EVP_CIPHER_CTX_free(pd->workers[j].cipher);
+            }
+            pd->thread_count = i;
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool page_decryptor_run(PageDecryptor* pd, const uint8_t* in, uint8_t* out, size_t size, uint64_t file_offset) {
+    pd->in = in;
+    pd->out = out;
+    pd->size = size;
+    pd->file_offset = file_offset;
+    pd->failed = false;
+    uint64_t start = stats_now();
+
+    if (pd->thread_count > 1) {
+        mutex_lock(&pd->mutex);
+        pd->pending = pd->thread_count - 1;
+        pd->generation++;
+        cond_broadcast(&pd->work_cond);
+        mutex_unlock(&pd->mutex);
+    }
+
+    bool ok = decrypt_slice(pd, &pd->workers[0]);
+
+    if (pd->thread_count > 1) {
+        mutex_lock(&pd->mutex);
+        while (pd->pending > 0) {
+            cond_wait(&pd->done_cond, &pd->mutex);
+        }
+        if (pd->failed) {
+            ok = false;
+        }
+        mutex_unlock(&pd->mutex);
+    }
+
+    if (ok && pd->crc_enabled) {
+        // Join the slices in payload order.
+        for (int i = 0; i < pd->thread_count; i++) {
+            size_t slice_start, slice_end;
+            slice_bounds(pd, i, &slice_start, &slice_end);
+            pd->crc = crc32_combine(pd->crc, pd->workers[i].crc, slice_end - slice_start);
+        }
+    }
+
+    stats_time(STAT_TIME_DECRYPT, start);
+    stats_count(STAT_BYTES_DECRYPTED, size);
+    return ok;
+}
+
+void page_decryptor_enable_crc(PageDecryptor* pd) {
+    pd->crc_enabled = true;
+    pd->crc = 0;
+}
+
+uint32_t page_decryptor_crc(const PageDecryptor* pd) {
+    return pd->crc;
+}
+
+void page_decryptor_close(PageDecryptor* pd) {
+    if (!pd->workers) {
+        return;
+    }
+
+    mutex_lock(&pd->mutex);
+    pd->shutdown = true;
+    cond_broadcast(&pd->work_cond);
+    mutex_unlock(&pd->mutex);
+
+    for (int i = 0; i < pd->thread_count; i++) {
+        if (i > 0) {
+            thread_join(pd->workers[i].thread);
+        }
+        EVP_CIPHER_CTX_free(pd->workers[i].cipher);
+    }
+
+    cond_destroy(&pd->done_cond);
+    cond_destroy(&pd->work_cond);
+    mutex_destroy(&pd->mutex);
+    free(pd->workers);
+    memset(pd, 0, sizeof(PageDecryptor));
+}
+
+bool buffer_is_zero(const void* data, size_t size) {
+    const uint8_t* p = (const uint8_t*)data;
+    size_t i = 0;
+
+#if defined(ZERO_CHECK_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= size; i += 64) {
+        __m128i acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i)), _mm_loadu_si128((const __m128i*)(p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)), _mm_loadu_si128((const __m128i*)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+#elif defined(ZERO_CHECK_NEON)
+    for (; i + 64 <= size; i += 64) {
+        uint8x16_t acc = vorrq_u8(vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+            vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48)));
+        if (vmaxvq_u8(acc) != 0) {
+            return false;
+        }
+    }
+#else
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        if (word != 0) {
+            return false;
+        }
+    }
+#endif
+
+    for (; i < size; i++) {
+        if (p[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes a chunk, seeking over runs of all-zero pages instead of writing
+// them. A run that ends the image still gets its final byte written so the
+// file reaches its full length without a separate truncate.
+static bool write_sparse(FILE* output, const uint8_t* data, size_t size, bool ends_image, uint64_t* skipped) {
+    size_t pos = 0;
+    while (pos < size) {
+        size_t run_end = pos;
+        bool zero = buffer_is_zero(data + pos, min(DECRYPT_PAGE_SIZE, size - pos));
+        while (run_end < size) {
+            size_t page = min(DECRYPT_PAGE_SIZE, size - run_end);
+            if (buffer_is_zero(data + run_end, page) != zero) {
+                break;
+            }
+            run_end += page;
+        }
+
+        size_t run = run_end - pos;
+        if (!zero) {
+            if (fwrite(data + pos, 1, run, output) != run) {
+                return false;
+            }
+        }
+        else if (ends_image && run_end == size) {
+            if (FSEEKO(output, (int64_t)(run - 1), SEEK_CUR) != 0 || fputc(0, output) == EOF) {
+                return false;
+            }
+            *skipped += run - 1;
+        }
+        else {
+            if (FSEEKO(output, (int64_t)run, SEEK_CUR) != 0) {
+                return false;
+            }
+            *skipped += run;
+        }
+        pos = run_end;
+    }
+    return true;
+}
+
+#ifndef _WIN32
+
+// Output chunks in direct mode are anonymous mappings: page aligned for the
+// writes, and pages vmsplice() left in the pipe are never reused by malloc.
+static uint8_t* alloc_direct_buffer(void) {
+    void* buffer = mmap(NULL, DECRYPT_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (buffer == MAP_FAILED) ? NULL : (uint8_t*)buffer;
+}
+
+static void free_direct_buffer(uint8_t* buffer) {
+    if (buffer) {
+        munmap(buffer, DECRYPT_CHUNK_SIZE);
+    }
+}
+
+static bool write_direct(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+#endif
+
+#ifdef STREAM_VMSPLICE
+
+static bool write_vmsplice(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        struct iovec iov = { (void*)data, size };
+        ssize_t written = vmsplice(fd, &iov, 1, 0);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+// vmsplice() lends the chunk's pages to the pipe instead of copying them, so
+// a chunk may only be reused once the reader has drained it. With the pipe
+// sized to exactly one chunk that is certain as soon as the following full
+// chunk has gone in, which needs at least two chunks in the ring.
+static bool use_vmsplice(int fd, int depth) {
+    struct stat st;
+    if (depth < 2 || fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode)) {
+        return false;
+    }
+    return fcntl(fd, F_SETPIPE_SZ, DECRYPT_CHUNK_SIZE) == DECRYPT_CHUNK_SIZE;
+}
+
+#endif
+
+static uint8_t* alloc_chunk_out(const DecryptStream* stream) {
+#ifndef _WIN32
+    if (stream->output_mode != STREAM_OUTPUT_STDIO) {
+        return alloc_direct_buffer();
+    }
+#endif
+    return malloc(DECRYPT_CHUNK_SIZE);
+}
+
+static void free_chunk_out(const DecryptStream* stream, uint8_t* buffer) {
+#ifndef _WIN32
+    if (stream->output_mode != STREAM_OUTPUT_STDIO) {
+        free_direct_buffer(buffer);
+        return;
+    }
+#endif
+    free(buffer);
+}
+
+static void stream_abort(DecryptStream* stream) {
+    mutex_lock(&stream->mutex);
+    stream->aborted = true;
+    cond_broadcast(&stream->cond);
+    mutex_unlock(&stream->mutex);
+}
+
+static void stream_reader_main(void* arg) {
+    DecryptStream* stream = (DecryptStream*)arg;
+    log_capture(stream->log);
+    stats_attach(stream->collect_stats ? &stream->reader_stats : NULL);
+    const StreamConfig* config = stream->config;
+    uint64_t remaining = config->size - config->start_offset;
+
+    for (uint64_t i = 0; i < stream->chunk_count; i++) {
+        mutex_lock(&stream->mutex);
+        uint64_t wait_start = monotonic_ns();
+        while (!stream->aborted && i - stream->written_count >= (uint64_t)config->depth) {
+            cond_wait(&stream->cond, &stream->mutex);
+        }
+        stream->stats->read_stall_ns += monotonic_ns() - wait_start;
+        bool aborted = stream->aborted;
+        mutex_unlock(&stream->mutex);
+        if (aborted) {
+            return;
+        }
+
+        StreamChunk* chunk = &stream->chunks[i % config->depth];
+        chunk->size = (remaining > DECRYPT_CHUNK_SIZE) ? DECRYPT_CHUNK_SIZE : (size_t)remaining;
+
+        uint64_t read_start = stats_now();
+        size_t read = fread(chunk->in, 1, chunk->size, config->input);
+        stats_time(STAT_TIME_READ, read_start);
+        stats_count(STAT_BYTES_READ, read);
+        if (read != chunk->size) {
+            if (feof(config->input)) {
+                log_printf("\nUnexpected end of file\n");
+            } else {
+                log_perror("\nread_chunk");
+            }
+            stream_abort(stream);
+            return;
+        }
+        remaining -= chunk->size;
+
+        mutex_lock(&stream->mutex);
+        stream->read_count++;
+        cond_broadcast(&stream->cond);
+        mutex_unlock(&stream->mutex);
+    }
+}
+
+static void stream_writer_main(void* arg) {
+    DecryptStream* stream = (DecryptStream*)arg;
+    log_capture(stream->log);
+    stats_attach(stream->collect_stats ? &stream->writer_stats : NULL);
+    const StreamConfig* config = stream->config;
+    uint64_t skipped = 0;
+    uint64_t checkpointed = config->start_offset;
+
+    if (config->sparse) {
+        file_mark_sparse(config->output);
+    }
+
+    for (uint64_t i = 0; i < stream->chunk_count; i++) {
+        mutex_lock(&stream->mutex);
+        uint64_t wait_start = monotonic_ns();
+        while (!stream->aborted && stream->decrypted_count <= i) {
+            cond_wait(&stream->cond, &stream->mutex);
+        }
+        stream->stats->write_stall_ns += monotonic_ns() - wait_start;
+        bool aborted = stream->aborted;
+        mutex_unlock(&stream->mutex);
+        if (aborted) {
+            return;
+        }
+
+        StreamChunk* chunk = &stream->chunks[i % config->depth];
+        bool written;
+        uint64_t skipped_before = skipped;
+        uint64_t write_start = stats_now();
+        switch (stream->output_mode) {
+#ifndef _WIN32
+        case STREAM_OUTPUT_WRITE:
+            written = write_direct(stream->output_fd, chunk->out, chunk->size);
+            break;
+#endif
+#ifdef STREAM_VMSPLICE
+        case STREAM_OUTPUT_VMSPLICE:
+            written = write_vmsplice(stream->output_fd, chunk->out, chunk->size);
+            break;
+#endif
+        default:
+            if (config->sparse) {
+                written = write_sparse(config->output, chunk->out, chunk->size,
+                    i + 1 == stream->chunk_count, &skipped);
+            }
+            else {
+                written = fwrite(chunk->out, 1, chunk->size, config->output) == chunk->size;
+            }
+            break;
+        }
+        stats_time(STAT_TIME_WRITE, write_start);
+        stats_count(STAT_BYTES_WRITTEN, chunk->size - (skipped - skipped_before));
+        if (!written) {
+            log_perror("\nwrite");
+            stream_abort(stream);
+            return;
+        }
+
+        uint64_t completed = config->start_offset + (i + 1) * (uint64_t)DECRYPT_CHUNK_SIZE;
+        bool last = i + 1 == stream->chunk_count;
+        if (last) {
+            completed = config->size;
+        }
+        if (config->checkpoint &&
+            (last || completed - checkpointed >= DECRYPT_CHECKPOINT_INTERVAL)) {
+            if (!config->checkpoint(config->checkpoint_context, config->output, completed)) {
+                log_perror("\ncheckpoint");
+                stream_abort(stream);
+                return;
+            }
+            checkpointed = completed;
+        }
+
+        mutex_lock(&stream->mutex);
+        // A spliced chunk is only handed back once the next one is in the pipe.
+        bool lend = stream->output_mode == STREAM_OUTPUT_VMSPLICE && !last;
+        stream->written_count = lend ? i : i + 1;
+        stream->bytes_written += chunk->size;
+        stream->stats->bytes_skipped = skipped;
+        cond_broadcast(&stream->cond);
+        mutex_unlock(&stream->mutex);
+    }
+}
+
+bool decrypt_stream(PageDecryptor* pd, const StreamConfig* config, StreamStats* stats) {
+    memset(stats, 0, sizeof(StreamStats));
+    uint64_t start_time = monotonic_ns();
+
+    DecryptStream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.config = config;
+    stream.stats = stats;
+    stream.log = log_current();
+    stream.collect_stats = stats_current() != NULL;
+    if (config->depth < 1 || config->start_offset > config->size ||
+        (config->start_offset % DECRYPT_CHUNK_SIZE != 0 && config->start_offset != config->size)) {
+        return false;
+    }
+    stream.chunk_count = (config->size - config->start_offset + DECRYPT_CHUNK_SIZE - 1) / DECRYPT_CHUNK_SIZE;
+
+    stream.output_mode = STREAM_OUTPUT_STDIO;
+#ifndef _WIN32
+    if (config->direct_output) {
+        fflush(config->output);
+        stream.output_fd = fileno(config->output);
+        stream.output_mode = STREAM_OUTPUT_WRITE;
+#ifdef STREAM_VMSPLICE
+        if (use_vmsplice(stream.output_fd, config->depth)) {
+            stream.output_mode = STREAM_OUTPUT_VMSPLICE;
+        }
+#endif
+    }
+#endif
+
+    stream.chunks = calloc(config->depth, sizeof(StreamChunk));
+    if (!stream.chunks) {
+        log_printf("Memory allocation failed\n");
+        return false;
+    }
+
+    bool success = true;
+    for (int i = 0; i < config->depth; i++) {
+        stream.chunks[i].in = malloc(DECRYPT_CHUNK_SIZE);
+        stream.chunks[i].out = alloc_chunk_out(&stream);
+        if (!stream.chunks[i].in || !stream.chunks[i].out) {
+            log_printf("Memory allocation failed\n");
+            success = false;
+        }
+    }
+
+    mutex_init(&stream.mutex);
+    cond_init(&stream.cond);
+
+    Thread reader, writer;
+    bool reader_started = false, writer_started = false;
+    if (success) {
+        reader_started = thread_create(&reader, stream_reader_main, &stream);
+        writer_started = reader_started && thread_create(&writer, stream_writer_main, &stream);
+        if (!writer_started) {
+            log_printf("Could not start pipeline threads\n");
+            stream_abort(&stream);
+            success = false;
+        }
+    }
+
+    time_t last_update_time = time(NULL);
+    int last_percentage = -1;
+
+    for (uint64_t i = 0; success && i < stream.chunk_count; i++) {
+        mutex_lock(&stream.mutex);
+        uint64_t wait_start = monotonic_ns();
+        while (!stream.aborted && stream.read_count <= i) {
+            cond_wait(&stream.cond, &stream.mutex);
+        }
+        stats->decrypt_stall_ns += monotonic_ns() - wait_start;
+        bool aborted = stream.aborted;
+        uint64_t bytes_written = stream.bytes_written;
+        mutex_unlock(&stream.mutex);
+        if (aborted) {
+            success = false;
+            break;
+        }
+
+        StreamChunk* chunk = &stream.chunks[i % config->depth];
+        if (!page_decryptor_run(pd, chunk->in, chunk->out, chunk->size,
+            config->start_offset + i * DECRYPT_CHUNK_SIZE)) {
+            log_printf("\nCould not decrypt data\n");
+            stream_abort(&stream);
+            success = false;
+            break;
+        }
+
+        mutex_lock(&stream.mutex);
+        stream.decrypted_count++;
+        cond_broadcast(&stream.cond);
+        mutex_unlock(&stream.mutex);
+
+        time_t current_time = time(NULL);
+        if (config->show_progress && current_time != last_update_time) {
+            int percentage = (int)(((config->start_offset + bytes_written) * 100) / config->size);
+            if (percentage != last_percentage) {
+                log_progress(percentage);
+                last_percentage = percentage;
+            }
+            last_update_time = current_time;
+        }
+    }
+
+    if (reader_started) {
+        thread_join(reader);
+    }
+    if (writer_started) {
+        thread_join(writer);
+    }
+    if (stream.aborted) {
+        success = false;
+    }
+    if (stream.collect_stats) {
+        stats_merge(stats_current(), &stream.reader_stats);
+        stats_merge(stats_current(), &stream.writer_stats);
+    }
+
+    if (success && config->show_progress) {
+        log_progress_done();
+    }
+
+    stats->bytes_written = stream.bytes_written;
+    stats->elapsed_ns = monotonic_ns() - start_time;
+
+    cond_destroy(&stream.cond);
+    mutex_destroy(&stream.mutex);
+    for (int i = 0; i < config->depth; i++) {
+        free(stream.chunks[i].in);
+        free_chunk_out(&stream, stream.chunks[i].out);
+    }
+    free(stream.chunks);
+    return success;
+}
+
+void print_stream_stats(const StreamStats* stats) {
+    double elapsed = stats->elapsed_ns / 1e9;
+    double throughput = (elapsed > 0) ? (stats->bytes_written / (1024.0 * 1024.0)) / elapsed : 0;
+    if (stats->mapped) {
+        log_printf("Mapped: %.2fs, %.1f MiB/s\n", elapsed, throughput);
+    }
+    else {
+        log_printf("Pipeline: %.2fs, %.1f MiB/s, stalls: read %.2fs, decrypt %.2fs, write %.2fs\n",
+            elapsed, throughput,
+            stats->read_stall_ns / 1e9,
+            stats->decrypt_stall_ns / 1e9,
+            stats->write_stall_ns / 1e9);
+    }
+    if (stats->bytes_skipped > 0) {
+        log_printf("Sparse: %.1f MiB of zero pages left as holes (%.1f%% of the image not written)\n",
+            stats->bytes_skipped / (1024.0 * 1024.0),
+            stats->bytes_written ? 100.0 * stats->bytes_skipped / stats->bytes_written : 0.0);
+    }
+}
+
+#ifdef _WIN32
+
+MappedDecryptResult decrypt_mapped(PageDecryptor* pd, const char* input_path, uint64_t data_offset,
+    const char* output_path, uint64_t size, bool show_progress, bool sparse, StreamStats* stats) {
+    (void)pd; (void)input_path; (void)data_offset; (void)output_path; (void)size; (void)show_progress; (void)sparse;
+    memset(stats, 0, sizeof(StreamStats));
+    return MAPPED_DECRYPT_UNAVAILABLE;
+}
+
+#else
+
+MappedDecryptResult decrypt_mapped(PageDecryptor* pd, const char* input_path, uint64_t data_offset,
+    const char* output_path, uint64_t size, bool show_progress, bool sparse, StreamStats* stats) {
+    memset(stats, 0, sizeof(StreamStats));
+    uint64_t start_time = monotonic_ns();
+
+    if (size == 0 || (uint64_t)(size_t)(data_offset + size) != data_offset + size) {
+        return MAPPED_DECRYPT_UNAVAILABLE;
+    }
+
+    int in_fd = open(input_path, O_RDONLY);
+    if (in_fd < 0) {
+        return MAPPED_DECRYPT_UNAVAILABLE;
+    }
+
+    // A short container would fault inside the mapping, let the stream path report it.
+    struct stat st;
+    if (fstat(in_fd, &st) != 0 || (uint64_t)st.st_size < data_offset + size) {
+        close(in_fd);
+        return MAPPED_DECRYPT_UNAVAILABLE;
+    }
+
+    size_t in_length = (size_t)(data_offset + size);
+    uint8_t* in_map = mmap(NULL, in_length, PROT_READ, MAP_SHARED, in_fd, 0);
+    close(in_fd);
+    if (in_map == MAP_FAILED) {
+        return MAPPED_DECRYPT_UNAVAILABLE;
+    }
+
+    int out_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        log_perror(output_path);
+        munmap(in_map, in_length);
+        return MAPPED_DECRYPT_FAILED;
+    }
+
+    if (ftruncate(out_fd, (off_t)size) != 0) {
+        munmap(in_map, in_length);
+        close(out_fd);
+        return MAPPED_DECRYPT_UNAVAILABLE;
+    }
+
+    uint8_t* out_map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    close(out_fd);
+    if (out_map == MAP_FAILED) {
+        munmap(in_map, in_length);
+        return MAPPED_DECRYPT_UNAVAILABLE;
+    }
+
+    madvise(in_map, in_length, MADV_SEQUENTIAL);
+    madvise(out_map, (size_t)size, MADV_SEQUENTIAL);
+
+    // The output starts out as one big hole after ftruncate. In sparse mode
+    // pages are decrypted into a bounce buffer and only the non-zero ones are
+    // copied in, so zero pages never get backing blocks.
+    uint8_t* bounce = NULL;
+    if (sparse) {
+        bounce = malloc(MAPPED_WINDOW_SIZE);
+        if (!bounce) {
+            log_printf("Memory allocation failed\n");
+            munmap(out_map, (size_t)size);
+            munmap(in_map, in_length);
+            return MAPPED_DECRYPT_FAILED;
+        }
+    }
+
+    const uint8_t* payload = in_map + data_offset;
+    uint64_t offset = 0;
+    uint64_t synced = 0;
+    bool success = true;
+    time_t last_update_time = time(NULL);
+    int last_percentage = -1;
+
+    while (offset < size) {
+        size_t window = (size - offset > MAPPED_WINDOW_SIZE) ? MAPPED_WINDOW_SIZE : (size_t)(size - offset);
+
+        uint8_t* target = bounce ? bounce : out_map + offset;
+        if (!page_decryptor_run(pd, payload + offset, target, window, offset)) {
+            log_printf("\nCould not decrypt data\n");
+            success = false;
+            break;
+        }
+        // Reads and writes happen as page faults inside the decrypt, only the volume is counted.
+        uint64_t skipped_before = stats->bytes_skipped;
+        if (bounce) {
+            for (size_t pos = 0; pos < window; pos += DECRYPT_PAGE_SIZE) {
+                size_t page = min(DECRYPT_PAGE_SIZE, window - pos);
+                if (buffer_is_zero(bounce + pos, page)) {
+                    stats->bytes_skipped += page;
+                }
+                else {
+                    memcpy(out_map + offset + pos, bounce + pos, page);
+                }
+            }
+        }
+        stats_count(STAT_BYTES_READ, window);
+        stats_count(STAT_BYTES_WRITTEN, window - (stats->bytes_skipped - skipped_before));
+        offset += window;
+
+        // Start writeback of finished ranges early instead of leaving it all to munmap.
+        if (offset - synced >= MAPPED_SYNC_INTERVAL || offset == size) {
+            msync(out_map + synced, (size_t)(offset - synced), MS_ASYNC);
+            synced = offset;
+        }
+
+        time_t current_time = time(NULL);
+        if (show_progress && current_time != last_update_time) {
+            int percentage = (int)((offset * 100) / size);
+            if (percentage != last_percentage) {
+                log_progress(percentage);
+                last_percentage = percentage;
+            }
+            last_update_time = current_time;
+        }
+    }
+
+    if (success && show_progress) {
+        log_progress_done();
+    }
+
+    if (munmap(out_map, (size_t)size) != 0) {
+        log_perror(output_path);
+        success = false;
+    }
+    munmap(in_map, in_length);
+    free(bounce);
+
+    stats->bytes_written = offset;
+    stats->mapped = true;
+    stats->elapsed_ns = monotonic_ns() - start_time;
+    return success ? MAPPED_DECRYPT_OK : MAPPED_DECRYPT_FAILED;
+}
+
+#endif
@@ -0,0 +1,321 @@
+#include "dedup.h"
+#include "log.h"
+#include "sink.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <openssl/evp.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#endif
+
+struct DedupFile {
+    DedupStore* store;
+    EVP_MD_CTX* md;
+    uint8_t memory[DEDUP_MEMORY_LIMIT];
+    size_t memory_used;
+    FILE* spill;            // temporary blob once the data outgrows memory
+    char temp_path[DEDUP_PATH_LENGTH];
+    uint64_t size;
+};
+
+// Longest name the store adds below its directory: a separator, 2 hex
+// digits, a separator and the other 62 digits of a blob. Temporary names,
+// tmp/<pid>-<n>, are at most 46 characters.
+#define DEDUP_NAME_LENGTH 66
+
+static bool path_fits(int length, size_t size) {
+    return length >= 0 && (size_t)length < size;
+}
+
+static bool file_exists(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp) {
+        fclose(fp);
+        return true;
+    }
+    return false;
+}
+
+static bool open_spill(DedupFile* file) {
+    DedupStore* store = file->store;
+    mutex_lock(&store->mutex);
+    uint64_t temp = store->next_temp++;
+    mutex_unlock(&store->mutex);
+
+    int length = SNPRINTF(file->temp_path, sizeof(file->temp_path), "%s%stmp%s%lu-%llu", store->dir,
+        PATH_SEPARATOR, PATH_SEPARATOR, (unsigned long)getpid(), (unsigned long long)temp);
+    if (!path_fits(length, sizeof(file->temp_path))) {
+        file->temp_path[0] = '\0';
+        log_printf("Dedup store path too long: %s\n", store->dir);
+        return false;
+    }
+    file->spill = fopen(file->temp_path, "wb");
+    if (!file->spill) {
+        log_perror(file->temp_path);
+        return false;
+    }
+    if (fwrite(file->memory, 1, file->memory_used, file->spill) != file->memory_used) {
+        log_perror(file->temp_path);
+        return false;
+    }
+    return true;
+}
+
+static bool copy_file(const char* from, const char* to) {
+    FILE* in = fopen(from, "rb");
+    if (!in) {
+        return false;
+    }
+    FILE* out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return false;
+    }
+
+    uint8_t buffer[DEDUP_MEMORY_LIMIT];
+    bool success = true;
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, read, out) != read) {
+            success = false;
+            break;
+        }
+    }
+    if (ferror(in)) {
+        success = false;
+    }
+    fclose(in);
+    if (fclose(out) != 0) {
+        success = false;
+    }
+    return success;
+}
+
+#ifdef FICLONE
+// Copy-on-write clone; only some file systems (btrfs, XFS, ...) support it.
+static bool reflink_file(DedupStore* store, const char* from, const char* to) {
+    int in = open(from, O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+    bool cloned = ioctl(out, FICLONE, in) == 0;
+    int error = errno;
+    close(in);
+    close(out);
+    if (!cloned) {
+        remove(to);
+        if (error == EOPNOTSUPP || error == EXDEV || error == EINVAL || error == ENOTTY) {
+            mutex_lock(&store->mutex);
+            store->try_reflink = false;
+            mutex_unlock(&store->mutex);
+        }
+    }
+    return cloned;
+}
+#endif
+
+static bool hardlink_file(const char* from, const char* to) {
+#ifdef _WIN32
+    return CreateHardLinkA(to, from, NULL) != 0;
+#else
+    return link(from, to) == 0;
+#endif
+}
+
+bool dedup_store_open(DedupStore* store, const char* dir) {
+    memset(store, 0, sizeof(DedupStore));
+    // Cut-off blob names would let different contents share a blob.
+    if (strlen(dir) + DEDUP_NAME_LENGTH >= sizeof(store->dir)) {
+        log_printf("Dedup store path too long: %s\n", dir);
+        return false;
+    }
+    STRCPY_S(store->dir, sizeof(store->dir), dir);
+
+    char temp_dir[DEDUP_PATH_LENGTH];
+    SNPRINTF(temp_dir, sizeof(temp_dir), "%s%stmp", dir, PATH_SEPARATOR);
+    if (!create_directories(temp_dir)) {
+        log_printf("Could not create dedup store: %s\n", dir);
+        return false;
+    }
+
+#ifdef FICLONE
+    store->try_reflink = true;
+#endif
+    mutex_init(&store->mutex);
+    return true;
+}
+
+void dedup_store_close(DedupStore* store) {
+    mutex_destroy(&store->mutex);
+    memset(store, 0, sizeof(DedupStore));
+}
+
+DedupFile* dedup_file_create(DedupStore* store) {
+    DedupFile* file = malloc(sizeof(DedupFile));
+    if (!file) {
+        return NULL;
+    }
+    file->store = store;
+    file->memory_used = 0;
+    file->spill = NULL;
+    file->temp_path[0] = '\0';
+    file->size = 0;
+    file->md = EVP_MD_CTX_new();
+    if (!file->md || !EVP_DigestInit_ex(file->md, EVP_sha256(), NULL)) {
+        EVP_MD_CTX_free(file->md);
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+bool dedup_file_write(DedupFile* file, const void* data, size_t size) {
+    if (!EVP_DigestUpdate(file->md, data, size)) {
+        return false;
+    }
+    file->size += size;
+
+    if (!file->spill) {
+        if (file->memory_used + size <= sizeof(file->memory)) {
+            memcpy(file->memory + file->memory_used, data, size);
+            file->memory_used += size;
+            return true;
+        }
+        if (!open_spill(file)) {
+            return false;
+        }
+    }
+    return fwrite(data, 1, size, file->spill) == size;
+}
+
+bool dedup_file_finish(DedupFile* file, char* blob_path, size_t blob_path_size, bool* duplicate,
+    uint64_t* size) {
+    DedupStore* store = file->store;
+    *duplicate = false;
+    *size = file->size;
+
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    if (!EVP_DigestFinal_ex(file->md, digest, &digest_length)) {
+        dedup_file_discard(file);
+        return false;
+    }
+    char hex[EVP_MAX_MD_SIZE * 2 + 1];
+    for (unsigned int i = 0; i < digest_length; i++) {
+        SNPRINTF(hex + i * 2, 3, "%02x", digest[i]);
+    }
+
+    char blob_dir[DEDUP_PATH_LENGTH];
+    if (!path_fits(SNPRINTF(blob_dir, sizeof(blob_dir), "%s%s%.2s", store->dir, PATH_SEPARATOR, hex),
+            sizeof(blob_dir)) ||
+        !path_fits(SNPRINTF(blob_path, blob_path_size, "%s%s%s", blob_dir, PATH_SEPARATOR, hex + 2),
+            blob_path_size)) {
+        log_printf("Dedup store path too long: %s\n", store->dir);
+        dedup_file_discard(file);
+        return false;
+    }
+
+    if (file_exists(blob_path)) {
+        *duplicate = true;
+        dedup_file_discard(file);
+        return true;
+    }
+
+    // New contents: the temporary blob only has to be written now for files
+    // that stayed in memory.
+    bool success = file->spill || open_spill(file);
+    if (file->spill && fclose(file->spill) != 0) {
+        success = false;
+    }
+    file->spill = NULL;
+#ifndef _WIN32
+    if (success) {
+        // Blobs are shared by every tree linked to them.
+        chmod(file->temp_path, 0444);
+    }
+#endif
+    if (success && rename(file->temp_path, blob_path) != 0) {
+        MKDIR(blob_dir);
+        if (rename(file->temp_path, blob_path) != 0) {
+            // Lost a race against another job storing the same contents.
+            *duplicate = file_exists(blob_path);
+            success = *duplicate;
+        }
+    }
+    if (!success) {
+        log_printf("Could not add %s to the dedup store\n", blob_path);
+    }
+    dedup_file_discard(file);
+    return success;
+}
+
+void dedup_file_discard(DedupFile* file) {
+    if (file->spill) {
+        fclose(file->spill);
+    }
+    if (file->temp_path[0]) {
+        remove(file->temp_path);
+    }
+    EVP_MD_CTX_free(file->md);
+    free(file);
+}
+
+bool dedup_link(DedupStore* store, const char* blob_path, const char* output_path) {
+    // An earlier extraction may have left a link to a blob here; writing
+    // through it would change the blob, so only ever replace it.
+    remove(output_path);
+#ifdef FICLONE
+    mutex_lock(&store->mutex);
+    bool try_reflink = store->try_reflink;
+    mutex_unlock(&store->mutex);
+    if (try_reflink && reflink_file(store, blob_path, output_path)) {
+        return true;
+    }
+#endif
+    if (hardlink_file(blob_path, output_path)) {
+        return true;
+    }
+#ifdef _WIN32
+    if (GetLastError() == ERROR_PATH_NOT_FOUND) {
+        return false;
+    }
+#else
+    if (errno == ENOENT) {
+        return false;
+    }
+#endif
+
+    mutex_lock(&store->mutex);
+    bool warn = !store->warned_copy;
+    store->warned_copy = true;
+    mutex_unlock(&store->mutex);
+    if (warn) {
+        log_printf("Cannot link into the dedup store from here, copying files out of it instead\n");
+    }
+    return copy_file(blob_path, output_path);
+}
+
+void print_dedup_report(const DedupImage* image) {
+    log_printf("Dedup: %llu of %llu files (%.1f of %.1f MiB) were already in the store\n",
+        (unsigned long long)image->duplicate_files,
+        (unsigned long long)image->files,
+        image->duplicate_bytes / (1024.0 * 1024.0),
+        image->bytes / (1024.0 * 1024.0));
+}
@@ -1,53 +1,18 @@
 #include "exfat.h"
+#include "log.h"
 #include <stdlib.h>
 #include <string.h>
-#include <errno.h>
 #include <stdio.h>
 #include <locale.h>
 #include <wchar.h>
 
-static bool create_directories(const char* path) {
-    char temp[MAX_PATH_LENGTH];
-    char* p = NULL;
-    size_t len;
-    bool result = true;
-
-    strncpy(temp, path, MAX_PATH_LENGTH - 1);
-    temp[MAX_PATH_LENGTH - 1] = '\0';
-    len = strlen(temp);
-
-    if (len > 0 && (temp[len - 1] == '/' || temp[len - 1] == '\\')) {
-        temp[len - 1] = '\0';
-    }
-
-    for (p = temp + 1; *p; p++) {
-        if (*p == '/' || *p == '\\') {
-            *p = '\0';
-            if (MKDIR(temp) != 0 && errno != EEXIST) {
-                result = false;
-                break;
-            }
-            *p = PATH_SEPARATOR[0];
-        }
-    }
-
-    if (result && MKDIR(temp) != 0 && errno != EEXIST) {
-        result = false;
-    }
-
-    return result;
-}
-
-static uint32_t get_cluster_offset(ExfatContext* ctx, uint32_t cluster) {
-    return ctx->cluster_heap_offset_bytes + ((cluster - 2) * ctx->bytes_per_cluster);
+static uint64_t get_cluster_offset(ExfatContext* ctx, uint32_t cluster) {
+    return ctx->cluster_heap_offset_bytes + ((uint64_t)(cluster - 2) * ctx->bytes_per_cluster);
 }
 
 static bool read_cluster(ExfatContext* ctx, uint32_t cluster, void* buffer) {
-    uint32_t offset = get_cluster_offset(ctx, cluster);
-    if (fseek(ctx->fp, offset, SEEK_SET) != 0) {
-        return false;
-    }
-    return fread(buffer, 1, ctx->bytes_per_cluster, ctx->fp) == ctx->bytes_per_cluster;
+    uint64_t offset = get_cluster_offset(ctx, cluster);
+    return image_source_read(&ctx->source, buffer, offset, ctx->bytes_per_cluster);
 }
 
 static uint32_t get_next_cluster(ExfatContext* ctx, uint32_t cluster) {
@@ -101,17 +66,19 @@ static bool combine_path(char* dest, size_t dest_size, const char* dir, const ch
     return true;
 }
 
-static bool extract_file(ExfatContext* ctx, ExfatFileInfo* file, const char* output_path) {
-    FILE* out = fopen(output_path, "wb");
-    if (!out) {
-        return false;
-    }
+typedef struct {
+    ExfatContext* ctx;
+    const ExfatFileInfo* file;
+} ClusterStream;
+
+static bool stream_clusters(void* context, ExtractSink* sink, SinkFile* out) {
+    ExfatContext* ctx = ((ClusterStream*)context)->ctx;
+    const ExfatFileInfo* file = ((ClusterStream*)context)->file;
 
     uint32_t current_cluster = file->first_cluster;
     uint64_t remaining = file->data_length;
     uint8_t* buffer = malloc(ctx->bytes_per_cluster);
     if (!buffer) {
-        fclose(out);
         return false;
     }
 
@@ -123,7 +90,7 @@ static bool extract_file(ExfatContext* ctx, ExfatFileInfo* file, const char* out
         }
 
         size_t write_size = (remaining > ctx->bytes_per_cluster) ? ctx->bytes_per_cluster : (size_t)remaining;
-        if (fwrite(buffer, 1, write_size, out) != write_size) {
+        if (!sink_write_file(sink, out, buffer, write_size)) {
             success = false;
             break;
         }
@@ -133,11 +100,16 @@ static bool extract_file(ExfatContext* ctx, ExfatFileInfo* file, const char* out
     }
 
     free(buffer);
-    fclose(out);
-    return success;
+    return success && remaining == 0;
+}
+
+static bool extract_file(ExfatContext* ctx, ExtractSink* sink, const ExfatFileInfo* file, const char* output_path) {
+    ClusterStream stream = { ctx, file };
+    return sink_extract_file(sink, output_path, file->data_length, file->mtime, stream_clusters, &stream);
 }
 
-static bool process_directory(ExfatContext* ctx, uint32_t start_cluster, const char* output_dir) {
+// output_dir is relative to the sink root, "" for the root directory.
+static bool process_directory(ExfatContext* ctx, ExtractSink* sink, uint32_t start_cluster, const char* output_dir) {
     uint8_t* cluster_buffer = malloc(ctx->bytes_per_cluster);
     if (!cluster_buffer) {
         return false;
@@ -204,20 +176,22 @@ static bool process_directory(ExfatContext* ctx, uint32_t start_cluster, const c
                 file_info.first_cluster = stream_entry->first_cluster;
                 file_info.data_length = stream_entry->data_length;
                 file_info.is_directory = ((file_entry->file_attributes & 0x10) != 0);
+                file_info.mtime = ((uint64_t)file_entry->last_modified_timestamp << 8) |
+                    file_entry->last_modified_10ms;
 
                 char full_path[MAX_PATH_LENGTH];
                 if (!combine_path(full_path, sizeof(full_path), output_dir, file_info.name)) {
-                    fprintf(stderr, "Warning: Invalid or too long path, skipping: %s/%s\n", output_dir, file_info.name);
+                    log_printf("Warning: Invalid or too long path, skipping: %s/%s\n", output_dir, file_info.name);
                     continue;
                 }
 
                 if (file_info.is_directory) {
-                    if (create_directories(full_path)) {
-                        process_directory(ctx, file_info.first_cluster, full_path);
+                    if (sink_add_directory(sink, full_path)) {
+                        process_directory(ctx, sink, file_info.first_cluster, full_path);
                     }
                 }
                 else {
-                    extract_file(ctx, &file_info, full_path);
+                    extract_file(ctx, sink, &file_info, full_path);
                 }
 
                 int total_entries = 2 + num_name_entries;
@@ -241,58 +215,55 @@ static bool process_directory(ExfatContext* ctx, uint32_t start_cluster, const c
 }
 
 bool exfat_init(ExfatContext* ctx, const char* filename) {
-    memset(ctx, 0, sizeof(ExfatContext));
-
-    ctx->fp = fopen(filename, "rb");
-    if (!ctx->fp) {
+    ImageSource source;
+    if (!image_source_open_file(&source, filename)) {
+        memset(ctx, 0, sizeof(ExfatContext));
         return false;
     }
+    return exfat_init_source(ctx, &source);
+}
 
-    if (fread(&ctx->boot_sector, sizeof(ExfatBootSector), 1, ctx->fp) != 1) {
-        fclose(ctx->fp);
+bool exfat_init_source(ExfatContext* ctx, const ImageSource* source) {
+    memset(ctx, 0, sizeof(ExfatContext));
+    ctx->source = *source;
+
+    if (!image_source_read(&ctx->source, &ctx->boot_sector, 0, sizeof(ExfatBootSector))) {
+        image_source_close(&ctx->source);
         return false;
     }
 
     ctx->bytes_per_sector = (1 << ctx->boot_sector.bytes_per_sector_shift);
     ctx->bytes_per_cluster = ctx->bytes_per_sector * (1 << ctx->boot_sector.sectors_per_cluster_shift);
-    ctx->cluster_heap_offset_bytes = ctx->boot_sector.cluster_heap_offset * ctx->bytes_per_sector;
+    ctx->cluster_heap_offset_bytes = (uint64_t)ctx->boot_sector.cluster_heap_offset * ctx->bytes_per_sector;
 
-    ctx->fat_offset_bytes = ctx->boot_sector.fat_offset * ctx->bytes_per_sector;
+    ctx->fat_offset_bytes = (uint64_t)ctx->boot_sector.fat_offset * ctx->bytes_per_sector;
     ctx->fat_length_bytes = ctx->boot_sector.fat_length * ctx->bytes_per_sector;
 
     ctx->fat = malloc(ctx->fat_length_bytes);
     if (!ctx->fat) {
-        fclose(ctx->fp);
+        image_source_close(&ctx->source);
         return false;
     }
 
-    if (fseek(ctx->fp, ctx->fat_offset_bytes, SEEK_SET) != 0) {
+    if (!image_source_read(&ctx->source, ctx->fat, ctx->fat_offset_bytes, ctx->fat_length_bytes)) {
         free(ctx->fat);
-        fclose(ctx->fp);
-        return false;
-    }
-
-    if (fread(ctx->fat, 1, ctx->fat_length_bytes, ctx->fp) != ctx->fat_length_bytes) {
-        free(ctx->fat);
-        fclose(ctx->fp);
+        ctx->fat = NULL;
+        image_source_close(&ctx->source);
         return false;
     }
 
     return true;
 }
 
-bool exfat_extract_all(ExfatContext* ctx, const char* output_dir) {
-    if (!create_directories(output_dir)) {
+bool exfat_extract_all(ExfatContext* ctx, ExtractSink* sink) {
+    if (!sink_add_directory(sink, "")) {
         return false;
     }
-    return process_directory(ctx, ctx->boot_sector.first_cluster_of_root_dir, output_dir);
+    return process_directory(ctx, sink, ctx->boot_sector.first_cluster_of_root_dir, "");
 }
 
 void exfat_close(ExfatContext* ctx) {
-    if (ctx->fp) {
-        fclose(ctx->fp);
-        ctx->fp = NULL;
-    }
+    image_source_close(&ctx->source);
     if (ctx->fat) {
         free(ctx->fat);
         ctx->fat = NULL;
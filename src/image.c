@@ -0,0 +1,121 @@
+#include "image.h"
+#include "common.h"
+#include "stats.h"
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#include <io.h>
+#else
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+// Like file_read_at(), returning the bytes read.
+static size_t read_at(FILE* fp, void* buffer, uint64_t offset, size_t size) {
+    uint8_t* out = (uint8_t*)buffer;
+    size_t done = 0;
+#ifdef _WIN32
+    HANDLE handle = (HANDLE)_get_osfhandle(_fileno(fp));
+    while (done < size) {
+        DWORD chunk = (size - done > 0x40000000) ? 0x40000000 : (DWORD)(size - done);
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)(offset + done);
+        overlapped.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD read = 0;
+        if (!ReadFile(handle, out + done, chunk, &read, &overlapped) || read == 0) {
+            break;
+        }
+        done += read;
+    }
+#else
+    int fd = fileno(fp);
+    while (done < size) {
+        ssize_t read = pread(fd, out + done, size - done, (off_t)(offset + done));
+        if (read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read <= 0) {
+            break;
+        }
+        done += (size_t)read;
+    }
+#endif
+    return done;
+}
+
+bool file_read_at(FILE* fp, void* buffer, uint64_t offset, size_t size) {
+    return read_at(fp, buffer, offset, size) == size;
+}
+
+bool file_sync(FILE* file) {
+    if (fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+bool file_truncate(FILE* file, uint64_t size) {
+    if (fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), (__int64)size) == 0;
+#else
+    return ftruncate(fileno(file), (off_t)size) == 0;
+#endif
+}
+
+void file_mark_sparse(FILE* file) {
+#ifdef _WIN32
+    DWORD returned = 0;
+    HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+    DeviceIoControl(handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+#else
+    (void)file;
+#endif
+}
+
+static bool file_source_read(void* opaque, void* buffer, uint64_t offset, size_t size) {
+    uint64_t start = stats_now();
+    size_t read = read_at((FILE*)opaque, buffer, offset, size);
+    stats_time(STAT_TIME_READ, start);
+    stats_count(STAT_BYTES_READ, read);
+    return read == size;
+}
+
+static void file_source_close(void* opaque) {
+    fclose((FILE*)opaque);
+}
+
+bool image_source_open_file(ImageSource* source, const char* path) {
+    memset(source, 0, sizeof(ImageSource));
+
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+
+    if (FSEEKO(fp, 0, SEEK_END) != 0) {
+        fclose(fp);
+        return false;
+    }
+    source->size = (uint64_t)FTELLO(fp);
+
+    source->read = file_source_read;
+    source->close = file_source_close;
+    source->opaque = fp;
+    return true;
+}
+
+void image_source_close(ImageSource* source) {
+    if (source->close && source->opaque) {
+        source->close(source->opaque);
+    }
+    memset(source, 0, sizeof(ImageSource));
+}
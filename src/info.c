@@ -0,0 +1,180 @@
+#include "info.h"
+#include "json.h"
+#include <string.h>
+
+static const char* container_type_name(uint8_t type) {
+    switch (type) {
+    case CONTAINER_TYPE_OS:     return "OS";
+    case CONTAINER_TYPE_APP:    return "APP";
+    case CONTAINER_TYPE_OPTION: return "OPTION";
+    }
+    return "UNKNOWN";
+}
+
+// Ids are fixed-size byte arrays; anything unprintable would garble the
+// terminal or produce invalid JSON.
+static void copy_id(char* out, const uint8_t* in, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        out[i] = (in[i] >= 0x20 && in[i] < 0x7f) ? (char)in[i] : '.';
+    }
+    out[length] = '\0';
+}
+
+static void format_date(const Timestamp* ts, char* out, size_t out_size) {
+    snprintf(out, out_size, "%04d-%02d-%02d %02d:%02d:%02d",
+        ts->year, ts->month, ts->day, ts->hour, ts->minute, ts->second);
+}
+
+static void format_version(const Version* version, char* out, size_t out_size) {
+    snprintf(out, out_size, "%d.%02d.%02d", version->major, version->minor, version->release);
+}
+
+static const char* iv_source(const Container* container) {
+    if (!container->has_key) {
+        return "none";
+    }
+    return container->has_fixed_iv ? "key table" : "first page";
+}
+
+static void print_text(const Container* container, const char* path, uint64_t file_size) {
+    const BootId* b = &container->bootid;
+    uint64_t expected_size = b->block_count * b->block_size;
+    char game_id[5], os_id[4], signature[5], option[5];
+    char target_time[32], source_time[32];
+    char target_version[32], source_version[32], os_version[32];
+
+    copy_id(game_id, b->game_id, 4);
+    copy_id(os_id, b->os_id, 3);
+    copy_id(signature, b->signature, 4);
+    copy_id(option, b->target_version.option, 4);
+    format_date(&b->target_timestamp, target_time, sizeof(target_time));
+    format_date(&b->source_timestamp, source_time, sizeof(source_time));
+    format_version(&b->target_version.version, target_version, sizeof(target_version));
+    format_version(&b->source_version, source_version, sizeof(source_version));
+    format_version(&b->os_version, os_version, sizeof(os_version));
+
+    log_printf("File:              %s\n", path);
+    log_printf("Image name:        %s\n", container->image_name);
+    log_printf("Container type:    %s (%d)\n", container_type_name(b->container_type), b->container_type);
+    log_printf("Game ID:           %s\n", game_id);
+    log_printf("OS ID:             %s (generation %d)\n", os_id, b->os_generation);
+    log_printf("Sequence number:   %d\n", b->sequence_number);
+    log_printf("Target timestamp:  %s\n", target_time);
+    if (b->container_type == CONTAINER_TYPE_OPTION) {
+        log_printf("Option:            %s\n", option);
+    }
+    else {
+        log_printf("Target version:    %s\n", target_version);
+    }
+    log_printf("Source timestamp:  %s\n", source_time);
+    log_printf("Source version:    %s\n", source_version);
+    log_printf("OS version:        %s\n", os_version);
+    log_printf("Block size:        %llu\n", (unsigned long long)b->block_size);
+    log_printf("Block count:       %llu (%llu header)\n",
+        (unsigned long long)b->block_count, (unsigned long long)b->header_block_count);
+    log_printf("Payload size:      %llu bytes at offset %llu\n",
+        (unsigned long long)container->payload_size, (unsigned long long)container->data_offset);
+    if (file_size >= expected_size) {
+        log_printf("File size:         %llu bytes (complete)\n", (unsigned long long)file_size);
+    }
+    else {
+        log_printf("File size:         %llu bytes (truncated, %llu bytes missing)\n",
+            (unsigned long long)file_size, (unsigned long long)(expected_size - file_size));
+    }
+    log_printf("Custom IV:         %s\n", b->use_custom_iv ? "yes" : "no");
+    if (container->has_key) {
+        log_printf("Key:               available (IV from %s)\n", iv_source(container));
+    }
+    else {
+        log_printf("Key:               not found\n");
+    }
+    log_printf("Header:            %s, length 0x%X, CRC32 0x%08X (%s), unk1 0x%02X, unk2 0x%llX\n",
+        signature, b->length, b->crc32, bootid_calculate_crc(b) == b->crc32 ? "valid" : "mismatch",
+        b->unk1, (unsigned long long)b->unk2);
+    log_printf("\n");
+}
+
+static void print_json(const Container* container, const char* path, uint64_t file_size) {
+    const BootId* b = &container->bootid;
+    char text[32];
+    JsonBuffer json;
+    json_init(&json);
+
+    json_append(&json, "{\"input\":");
+    json_append_string(&json, path);
+    json_append(&json, ",\"ok\":true,\"image\":");
+    json_append_string(&json, container->image_name);
+    json_append(&json, ",\"container_type\":");
+    json_append_string(&json, container_type_name(b->container_type));
+
+    copy_id(text, b->game_id, 4);
+    json_append(&json, ",\"game_id\":");
+    json_append_string(&json, text);
+    copy_id(text, b->os_id, 3);
+    json_append(&json, ",\"os_id\":");
+    json_append_string(&json, text);
+    json_appendf(&json, ",\"os_generation\":%d,\"sequence_number\":%d", b->os_generation, b->sequence_number);
+
+    format_date(&b->target_timestamp, text, sizeof(text));
+    json_append(&json, ",\"target_timestamp\":");
+    json_append_string(&json, text);
+    if (b->container_type == CONTAINER_TYPE_OPTION) {
+        copy_id(text, b->target_version.option, 4);
+        json_append(&json, ",\"option\":");
+    }
+    else {
+        format_version(&b->target_version.version, text, sizeof(text));
+        json_append(&json, ",\"target_version\":");
+    }
+    json_append_string(&json, text);
+
+    format_date(&b->source_timestamp, text, sizeof(text));
+    json_append(&json, ",\"source_timestamp\":");
+    json_append_string(&json, text);
+    format_version(&b->source_version, text, sizeof(text));
+    json_append(&json, ",\"source_version\":");
+    json_append_string(&json, text);
+    format_version(&b->os_version, text, sizeof(text));
+    json_append(&json, ",\"os_version\":");
+    json_append_string(&json, text);
+
+    json_appendf(&json, ",\"block_size\":%llu,\"block_count\":%llu,\"header_block_count\":%llu",
+        (unsigned long long)b->block_size, (unsigned long long)b->block_count,
+        (unsigned long long)b->header_block_count);
+    json_appendf(&json, ",\"data_offset\":%llu,\"payload_size\":%llu,\"file_size\":%llu,\"complete\":%s",
+        (unsigned long long)container->data_offset, (unsigned long long)container->payload_size,
+        (unsigned long long)file_size, file_size >= b->block_count * b->block_size ? "true" : "false");
+    json_appendf(&json, ",\"use_custom_iv\":%s,\"key_available\":%s,\"iv_source\":",
+        b->use_custom_iv ? "true" : "false", container->has_key ? "true" : "false");
+    json_append_string(&json, iv_source(container));
+
+    copy_id(text, b->signature, 4);
+    json_append(&json, ",\"signature\":");
+    json_append_string(&json, text);
+    json_appendf(&json, ",\"length\":%u,\"crc32\":\"%08X\",\"crc32_valid\":%s,\"unk1\":%u,\"unk2\":%llu}",
+        b->length, b->crc32, bootid_calculate_crc(b) == b->crc32 ? "true" : "false",
+        b->unk1, (unsigned long long)b->unk2);
+
+    json_write_line(&json, stdout);
+}
+
+void print_container_info(Container* container, const char* path, bool json) {
+    uint64_t file_size = container_file_size(container);
+    if (json) {
+        print_json(container, path, file_size);
+    }
+    else {
+        print_text(container, path, file_size);
+    }
+}
+
+void print_container_info_error(const char* path, const char* error) {
+    JsonBuffer json;
+    json_init(&json);
+    json_append(&json, "{\"input\":");
+    json_append_string(&json, path);
+    json_append(&json, ",\"ok\":false,\"error\":");
+    json_append_string(&json, error);
+    json_append(&json, "}");
+    json_write_line(&json, stdout);
+}
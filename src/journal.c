@@ -0,0 +1,109 @@
+#include "journal.h"
+#include "image.h"
+#include "crc32.h"
+#include "log.h"
+#include <stddef.h>
+#include <string.h>
+
+static const char JOURNAL_MAGIC[8] = { 'U', 'N', 'S', 'E', 'G', 'A', 'J', '1' };
+
+static uint32_t record_crc(const JournalRecord* record) {
+    return crc32_update(0, record, offsetof(JournalRecord, crc));
+}
+
+static bool record_valid(const JournalRecord* record) {
+    return memcmp(record->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == 0 &&
+        record->crc == record_crc(record);
+}
+
+static void journal_path(char* out, size_t out_size, const char* image_path) {
+    SNPRINTF(out, out_size, "%s%s", image_path, JOURNAL_SUFFIX);
+}
+
+static bool journal_write(Journal* journal) {
+    JournalRecord* record = &journal->record;
+    record->sequence++;
+    record->crc = record_crc(record);
+
+    long slot = (long)(record->sequence % 2) * (long)sizeof(JournalRecord);
+    if (fseek(journal->fp, slot, SEEK_SET) != 0 ||
+        fwrite(record, sizeof(JournalRecord), 1, journal->fp) != 1) {
+        return false;
+    }
+    return file_sync(journal->fp);
+}
+
+bool journal_open(Journal* journal, const char* image_path, const BootId* bootid,
+    uint64_t payload_size, uint64_t* completed) {
+    memset(journal, 0, sizeof(Journal));
+    *completed = 0;
+    journal_path(journal->path, sizeof(journal->path), image_path);
+
+    JournalRecord slots[2];
+    memset(slots, 0, sizeof(slots));
+    journal->fp = fopen(journal->path, "r+b");
+    if (journal->fp) {
+        size_t read = fread(slots, sizeof(JournalRecord), 2, journal->fp);
+        const JournalRecord* newest = NULL;
+        for (size_t i = 0; i < read; i++) {
+            if (record_valid(&slots[i]) && (!newest || slots[i].sequence > newest->sequence)) {
+                newest = &slots[i];
+            }
+        }
+
+        if (newest && memcmp(&newest->bootid, bootid, sizeof(BootId)) == 0 &&
+            newest->payload_size == payload_size && newest->completed <= payload_size) {
+            journal->record = *newest;
+            *completed = newest->completed;
+            return true;
+        }
+        fclose(journal->fp);
+    }
+
+    journal->fp = fopen(journal->path, "w+b");
+    if (!journal->fp) {
+        log_perror(journal->path);
+        return false;
+    }
+    memcpy(journal->record.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    journal->record.bootid = *bootid;
+    journal->record.payload_size = payload_size;
+    journal->record.completed = 0;
+
+    // Both slots start out valid, so either one can be overwritten first.
+    if (!journal_write(journal) || !journal_write(journal)) {
+        log_perror(journal->path);
+        journal_close(journal);
+        return false;
+    }
+    return true;
+}
+
+bool journal_commit(void* context, FILE* output, uint64_t completed) {
+    Journal* journal = (Journal*)context;
+    // Sparse writes seek over zero pages, so the file can end short of
+    // completed; extending it keeps "image at least this long" meaningful.
+    if (!file_truncate(output, completed) || !file_sync(output)) {
+        return false;
+    }
+    journal->record.completed = completed;
+    return journal_write(journal);
+}
+
+void journal_finish(Journal* journal) {
+    journal_close(journal);
+    remove(journal->path);
+}
+
+void journal_close(Journal* journal) {
+    if (journal->fp) {
+        fclose(journal->fp);
+        journal->fp = NULL;
+    }
+}
+
+void journal_discard(const char* image_path) {
+    char path[MAX_PATH_LENGTH];
+    journal_path(path, sizeof(path), image_path);
+    remove(path);
+}
@@ -0,0 +1,52 @@
+#include "json.h"
+#include <stdarg.h>
+#include <string.h>
+
+void json_init(JsonBuffer* json) {
+    json->length = 0;
+    json->data[0] = '\0';
+}
+
+void json_append(JsonBuffer* json, const char* text) {
+    size_t length = strlen(text);
+    if (json->length + length >= sizeof(json->data)) {
+        length = sizeof(json->data) - 1 - json->length;
+    }
+    memcpy(json->data + json->length, text, length);
+    json->length += length;
+    json->data[json->length] = '\0';
+}
+
+void json_appendf(JsonBuffer* json, const char* format, ...) {
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    json_append(json, text);
+}
+
+void json_append_string(JsonBuffer* json, const char* value) {
+    char escaped[8];
+    json_append(json, "\"");
+    for (const unsigned char* p = (const unsigned char*)(value ? value : ""); *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            snprintf(escaped, sizeof(escaped), "\\%c", *p);
+        }
+        else if (*p < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *p);
+        }
+        else {
+            escaped[0] = (char)*p;
+            escaped[1] = '\0';
+        }
+        json_append(json, escaped);
+    }
+    json_append(json, "\"");
+}
+
+void json_write_line(JsonBuffer* json, FILE* out) {
+    json_append(json, "\n");
+    fputs(json->data, out);
+    fflush(out);
+}
@@ -0,0 +1,226 @@
+#include "key_store.h"
+#include "common.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#define KEY_ID_LENGTH 16
+#define KEY_INDEX_MIN_SLOTS 64
+
+typedef struct {
+    char game_id[KEY_ID_LENGTH];    // empty when the slot is free
+    GameKeys keys;
+} KeyIndexEntry;
+
+// Open addressing with linear probing, kept at most half full.
+static KeyIndexEntry* g_slots = NULL;
+static size_t g_slot_mask = 0;
+static size_t g_count = 0;
+static bool g_ready = false;
+
+static uint32_t id_hash(const char* game_id) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (const char* p = game_id; *p; p++) {
+        h ^= (uint8_t)*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static KeyIndexEntry* index_find_slot(KeyIndexEntry* slots, size_t mask, const char* game_id) {
+    size_t i = id_hash(game_id) & mask;
+    while (slots[i].game_id[0] != '\0' && strcmp(slots[i].game_id, game_id) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static bool index_grow(void) {
+    size_t slot_count = g_slots ? (g_slot_mask + 1) * 2 : KEY_INDEX_MIN_SLOTS;
+    KeyIndexEntry* slots = calloc(slot_count, sizeof(KeyIndexEntry));
+    if (!slots) {
+        return false;
+    }
+
+    if (g_slots) {
+        for (size_t i = 0; i <= g_slot_mask; i++) {
+            if (g_slots[i].game_id[0] != '\0') {
+                *index_find_slot(slots, slot_count - 1, g_slots[i].game_id) = g_slots[i];
+            }
+        }
+        free(g_slots);
+    }
+    g_slots = slots;
+    g_slot_mask = slot_count - 1;
+    return true;
+}
+
+// The first source to provide an id wins, matching the old lookup order.
+static void index_add(const char* game_id, const GameKeys* keys) {
+    if (game_id[0] == '\0' || strlen(game_id) >= KEY_ID_LENGTH) {
+        return;
+    }
+    if ((!g_slots || (g_count + 1) * 2 > g_slot_mask + 1) && !index_grow()) {
+        return;
+    }
+
+    KeyIndexEntry* entry = index_find_slot(g_slots, g_slot_mask, game_id);
+    if (entry->game_id[0] != '\0') {
+        return;
+    }
+    STRCPY_S(entry->game_id, sizeof(entry->game_id), game_id);
+    entry->keys = *keys;
+    g_count++;
+}
+
+static bool parse_key_file(const char* path, GameKeys* keys) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    uint8_t buffer[32];
+    size_t read_size = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+
+    if (read_size == 16) {
+        memcpy(keys->key, buffer, 16);
+        memset(keys->iv, 0, 16);
+        keys->has_iv = false;
+        return true;
+    }
+    else if (read_size == 32) {
+        memcpy(keys->key, buffer, 16);
+        memcpy(keys->iv, buffer + 16, 16);
+
+        // Some key files carry the plaintext header in place of an IV; the
+        // real IV then has to be derived from the first page.
+        if (memcmp(keys->iv, NTFS_HEADER, 16) == 0 || memcmp(keys->iv, EXFAT_HEADER, 16) == 0) {
+            keys->has_iv = false;
+        }
+        else {
+            keys->has_iv = true;
+        }
+        return true;
+    }
+    return false;
+}
+
+static void index_key_file(const char* dir, const char* filename) {
+    size_t length = strlen(filename);
+    if (length <= 4 || length - 4 >= KEY_ID_LENGTH || strcmp(filename + length - 4, ".bin") != 0) {
+        return;
+    }
+
+    char game_id[KEY_ID_LENGTH];
+    memcpy(game_id, filename, length - 4);
+    game_id[length - 4] = '\0';
+
+    char path[MAX_PATH_LENGTH];
+    if (dir) {
+        SNPRINTF(path, sizeof(path), "%s%s%s", dir, PATH_SEPARATOR, filename);
+    }
+    else {
+        STRCPY_S(path, sizeof(path), filename);
+    }
+
+    GameKeys keys;
+    if (parse_key_file(path, &keys)) {
+        index_add(game_id, &keys);
+    }
+}
+
+// dir NULL means the working directory, where key files have always been looked up.
+static bool index_directory(const char* dir) {
+#ifdef _WIN32
+    char pattern[MAX_PATH_LENGTH];
+    SNPRINTF(pattern, sizeof(pattern), "%s\\*.bin", dir ? dir : ".");
+
+    WIN32_FIND_DATAA found;
+    HANDLE handle = FindFirstFileA(pattern, &found);
+    if (handle == INVALID_HANDLE_VALUE) {
+        // An existing directory without key files is not an error.
+        return GetLastError() == ERROR_FILE_NOT_FOUND;
+    }
+    do {
+        if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            index_key_file(dir, found.cFileName);
+        }
+    } while (FindNextFileA(handle, &found));
+    FindClose(handle);
+    return true;
+#else
+    DIR* handle = opendir(dir ? dir : ".");
+    if (!handle) {
+        return false;
+    }
+    struct dirent* found;
+    while ((found = readdir(handle)) != NULL) {
+        index_key_file(dir, found->d_name);
+    }
+    closedir(handle);
+    return true;
+#endif
+}
+
+bool key_store_init(const char* keys_dir) {
+    key_store_close();
+    g_ready = true;
+
+    for (size_t i = 0; i < game_keys_count && game_keys[i].game_id != NULL; i++) {
+        const GameKeyEntry* entry = &game_keys[i];
+        GameKeys keys;
+        memcpy(keys.key, entry->key, 16);
+        if (entry->has_iv) {
+            memcpy(keys.iv, entry->iv, 16);
+        }
+        else {
+            memset(keys.iv, 0, 16);
+        }
+        keys.has_iv = entry->has_iv;
+        index_add(entry->game_id, &keys);
+    }
+
+    bool result = true;
+    if (keys_dir && !index_directory(keys_dir)) {
+        log_perror(keys_dir);
+        result = false;
+    }
+    index_directory(NULL);
+    return result;
+}
+
+size_t key_store_count(void) {
+    return g_count;
+}
+
+void key_store_close(void) {
+    free(g_slots);
+    g_slots = NULL;
+    g_slot_mask = 0;
+    g_count = 0;
+    g_ready = false;
+}
+
+bool get_game_keys(const char* game_id, GameKeys* out_keys) {
+    if (!g_ready) {
+        key_store_init(NULL);
+    }
+    if (!g_slots || game_id[0] == '\0') {
+        return false;
+    }
+
+    const KeyIndexEntry* entry = index_find_slot(g_slots, g_slot_mask, game_id);
+    if (entry->game_id[0] == '\0') {
+        return false;
+    }
+    *out_keys = entry->keys;
+    return true;
+}
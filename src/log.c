@@ -0,0 +1,136 @@
+#include "log.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+static THREAD_LOCAL LogBuffer* t_capture = NULL;
+static FILE* g_output = NULL;
+
+void log_buffer_init(LogBuffer* buffer) {
+    memset(buffer, 0, sizeof(LogBuffer));
+    mutex_init(&buffer->mutex);
+}
+
+static void log_buffer_append(LogBuffer* buffer, const char* text, size_t length) {
+    mutex_lock(&buffer->mutex);
+    if (buffer->length + length + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 1024;
+        while (buffer->length + length + 1 > capacity) {
+            capacity *= 2;
+        }
+        char* data = realloc(buffer->data, capacity);
+        if (!data) {
+            // Losing log lines beats failing the job.
+            mutex_unlock(&buffer->mutex);
+            return;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+    mutex_unlock(&buffer->mutex);
+}
+
+void log_buffer_flush(LogBuffer* buffer, FILE* out) {
+    mutex_lock(&buffer->mutex);
+    if (buffer->length > 0) {
+        fwrite(buffer->data, 1, buffer->length, out);
+        fflush(out);
+        buffer->length = 0;
+    }
+    mutex_unlock(&buffer->mutex);
+}
+
+void log_buffer_clear(LogBuffer* buffer) {
+    mutex_lock(&buffer->mutex);
+    buffer->length = 0;
+    mutex_unlock(&buffer->mutex);
+}
+
+void log_buffer_close(LogBuffer* buffer) {
+    mutex_destroy(&buffer->mutex);
+    free(buffer->data);
+    memset(buffer, 0, sizeof(LogBuffer));
+}
+
+LogBuffer* log_capture(LogBuffer* buffer) {
+    LogBuffer* previous = t_capture;
+    t_capture = buffer;
+    return previous;
+}
+
+LogBuffer* log_current(void) {
+    return t_capture;
+}
+
+void log_set_output(FILE* out) {
+    g_output = out;
+}
+
+FILE* log_output(void) {
+    return g_output ? g_output : stdout;
+}
+
+static void log_vprintf(const char* format, va_list args) {
+    if (!t_capture) {
+        vfprintf(log_output(), format, args);
+        return;
+    }
+
+    char line[1024];
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(line, sizeof(line), format, copy);
+    va_end(copy);
+    if (length < 0) {
+        return;
+    }
+
+    if ((size_t)length < sizeof(line)) {
+        log_buffer_append(t_capture, line, (size_t)length);
+        return;
+    }
+
+    char* long_line = malloc((size_t)length + 1);
+    if (!long_line) {
+        return;
+    }
+    vsnprintf(long_line, (size_t)length + 1, format, args);
+    log_buffer_append(t_capture, long_line, (size_t)length);
+    free(long_line);
+}
+
+void log_printf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_vprintf(format, args);
+    va_end(args);
+}
+
+void log_perror(const char* what) {
+    int error = errno;
+    if (!t_capture) {
+        errno = error;
+        perror(what);
+        return;
+    }
+    log_printf("%s: %s\n", what, strerror(error));
+}
+
+void log_progress(int percentage) {
+    if (t_capture) {
+        return;
+    }
+    fprintf(log_output(), "\rProgress: %d%%    ", percentage);  // Extra spaces to clear line
+    fflush(log_output());
+}
+
+void log_progress_done(void) {
+    if (t_capture) {
+        return;
+    }
+    fprintf(log_output(), "\rProgress: 100%%    \n");
+}
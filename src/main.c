@@ -8,493 +8,947 @@
 #include "crypto.h"
 #include "exfat.h"
 #include "ntfs.h"
-#include <openssl/evp.h>
-#include <openssl/aes.h>
-
-#define PAGE_SIZE 4096
-#define BUFFER_SIZE (PAGE_SIZE * 256)
-#define MAX_PATH_LENGTH 256
-
-char* g_output_filename = NULL;
-
-int process_file(const char* path, bool extract_fs) {
-    uint8_t* bootid_bytes = malloc(96);
-    uint8_t* read_buffer = malloc(BUFFER_SIZE);
-    uint8_t* decrypted_buffer = malloc(BUFFER_SIZE);
-    uint8_t iv[16];
-    uint8_t page_iv[16];
-    uint8_t key[16];
-
-    if (!bootid_bytes || !read_buffer || !decrypted_buffer) {
-        printf("Memory allocation failed\n");
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+#include "decrypt.h"
+#include "container.h"
+#include "thread.h"
+#include "log.h"
+#include "stats.h"
+#include "info.h"
+#include "key_store.h"
+#include "crc32.h"
+#include "journal.h"
+#include "image.h"
+#include "tar.h"
+#include "dedup.h"
+#include "manifest.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#define OUTPUT_STDOUT "-"
+
+typedef struct {
+    bool extract_fs;
+    int threads;
+    int depth;
+    bool use_aes_kernel;
+    bool use_mmap;
+    bool write_image;
+    int cache_mb;
+    int vhd_cache_mb;
+    int extract_threads;    // threads extracting the files of an NTFS image
+    bool sparse;
+    int parallel;
+    bool stats;
+    bool info;
+    bool info_json;
+    const char* keys_dir;
+    bool verify;
+    bool resume;
+    bool output_stdout;     // -o -: the image goes to stdout, messages to stderr
+    TarWriter* tar;         // --tar: extract into this archive instead of directories
+    DedupStore* dedup;      // --dedup-store: extracted files are links into this store
+    bool incremental;       // only write files that changed since the last extraction
+    bool incremental_hash;  // --incremental=hash: compare contents instead of timestamps
+} Options;
+
+typedef enum {
+    JOB_OK,
+    JOB_OPEN_FAILED,
+    JOB_VERIFY_FAILED,
+    JOB_DECRYPT_FAILED,
+    JOB_EXTRACT_FAILED
+} JobResult;
+
+// Everything one input image produces. Jobs never share state, so a batch
+// can run several of them at once.
+typedef struct {
+    const char* path;
+    char image_name[MAX_PATH_LENGTH];
+    JobResult result;
+    uint64_t bytes;         // decrypted payload size
+    uint64_t elapsed_ns;
+    LogBuffer log;
+    ImageStats stats;
+} Job;
+
+typedef struct {
+    Job* jobs;
+    int job_count;
+    int next_job;
+    Mutex mutex;            // guards next_job and stdout
+    const Options* opts;
+} JobQueue;
+
+// start_offset > 0 continues an image an earlier run left behind; anything
+// past start_offset is cut off first since it was never made durable.
+// OUTPUT_STDOUT as output_filename streams the image to stdout instead.
+static bool decrypt_to_file(PageDecryptor* decryptor, FILE* file, uint64_t data_offset,
+    const char* output_filename, uint64_t output_size, uint64_t start_offset, Journal* journal,
+    int depth, bool sparse, StreamStats* stats) {
+    memset(stats, 0, sizeof(StreamStats));
+
+    bool to_stdout = strcmp(output_filename, OUTPUT_STDOUT) == 0;
+    FILE* output_file = to_stdout ? stdout : fopen(output_filename, start_offset > 0 ? "r+b" : "wb");
+    if (!output_file) {
+        log_perror(output_filename);
+        return false;
     }
-
-    FILE* file = fopen(path, "rb");
-    if (!file) {
-        perror(path);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+#ifdef _WIN32
+    if (to_stdout) {
+        _setmode(_fileno(stdout), _O_BINARY);
     }
+#endif
 
-    if (fread(bootid_bytes, 1, 96, file) != 96) {
-        printf("Could not read BootId from %s\n", path);
-        fclose(file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+    if (start_offset > 0 &&
+        (!file_truncate(output_file, start_offset) || FSEEKO(output_file, start_offset, SEEK_SET) != 0)) {
+        log_perror(output_filename);
+        fclose(output_file);
+        return false;
     }
 
-    uint8_t decrypted_bootid_bytes[96];
-    int out_len = 0;
+    if (FSEEKO(file, data_offset + start_offset, SEEK_SET) != 0) {
+        log_perror("fseek");
+        if (!to_stdout) {
+            fclose(output_file);
+        }
+        return false;
+    }
 
-    EVP_CIPHER_CTX* bootid_ctx = EVP_CIPHER_CTX_new();
-    if (!bootid_ctx) {
-        printf("Could not create cipher context\n");
-        fclose(file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+    StreamConfig stream_config;
+    stream_config.input = file;
+    stream_config.output = output_file;
+    stream_config.size = output_size;
+    stream_config.start_offset = start_offset;
+    stream_config.checkpoint = journal ? journal_commit : NULL;
+    stream_config.checkpoint_context = journal;
+    stream_config.depth = depth;
+    stream_config.show_progress = true;
+    stream_config.sparse = sparse;
+    stream_config.direct_output = to_stdout;
+
+    bool decrypted = decrypt_stream(decryptor, &stream_config, stats);
+
+    if (to_stdout) {
+        if (fflush(stdout) != 0) {
+            log_perror("stdout");
+            decrypted = false;
+        }
     }
+    else if (fclose(output_file) != 0) {
+        log_perror(output_filename);
+        decrypted = false;
+    }
+    return decrypted;
+}
 
-    EVP_DecryptInit_ex(bootid_ctx, EVP_aes_128_cbc(), NULL, BOOTID_KEY, BOOTID_IV);
-    EVP_CIPHER_CTX_set_padding(bootid_ctx, 0);
+// Picks the sink the options ask for; dedup collects what --dedup-store
+// saved and manifest is loaded for --incremental.
+static bool init_sink(ExtractSink* sink, const Options* opts, DedupImage* dedup, Manifest* manifest,
+    const char* root) {
+    if (opts->tar) {
+        sink_init_tar(sink, opts->tar, root);
+    }
+    else if (opts->dedup) {
+        sink_init_dedup(sink, dedup, root);
+    }
+    else {
+        sink_init_directory(sink, root);
+    }
 
-    if (!EVP_DecryptUpdate(bootid_ctx, decrypted_bootid_bytes, &out_len, bootid_bytes, 96)) {
-        printf("Could not decrypt BootId in %s\n", path);
-        EVP_CIPHER_CTX_free(bootid_ctx);
-        fclose(file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+    if (opts->incremental) {
+        if (!manifest_open(manifest, root, opts->incremental_hash)) {
+            log_printf("Could not load the manifest of %s\n", root);
+            return false;
+        }
+        sink->manifest = manifest;
     }
+    return true;
+}
 
-    int final_len = 0;
-    if (!EVP_DecryptFinal_ex(bootid_ctx, decrypted_bootid_bytes + out_len, &final_len)) {
-        printf("Could not finalize decryption\n");
-        EVP_CIPHER_CTX_free(bootid_ctx);
-        fclose(file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+static void finish_sink(ExtractSink* sink) {
+    if (sink->manifest) {
+        print_manifest_report(sink->manifest);
+        manifest_save(sink->manifest);
+        manifest_close(sink->manifest);
+        sink->manifest = NULL;
     }
-    EVP_CIPHER_CTX_free(bootid_ctx);
+}
 
-    BootId bootid;
-    memcpy(&bootid, decrypted_bootid_bytes, sizeof(BootId));
+// Extracts into a directory named after the image, or into the --tar
+// archive under that name.
+static bool extract_image(const char* image_name, const ImageSource* source, const Options* opts) {
+    char output_dir[MAX_PATH_LENGTH];
+    strncpy(output_dir, image_name, sizeof(output_dir) - 1);
+    output_dir[sizeof(output_dir) - 1] = '\0';
 
-    if (bootid.container_type != CONTAINER_TYPE_OS &&
-        bootid.container_type != CONTAINER_TYPE_APP &&
-        bootid.container_type != CONTAINER_TYPE_OPTION) {
-        printf("Unknown container type %d\n", bootid.container_type);
-        fclose(file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+    char* ext = strrchr(output_dir, '.');
+    if (ext) *ext = '\0';
+
+    DedupImage dedup;
+    memset(&dedup, 0, sizeof(dedup));
+    dedup.store = opts->dedup;
+
+    ExtractSink sink;
+    Manifest manifest;
+    if (!init_sink(&sink, opts, &dedup, &manifest, output_dir)) {
+        return false;
     }
 
-    char target_timestamp_str[20];
-    format_timestamp(&bootid.target_timestamp, target_timestamp_str, sizeof(target_timestamp_str));
+    bool extracted = false;
+    size_t vhd_cache_bytes = (size_t)opts->vhd_cache_mb * 1024 * 1024;
 
-    char os_id[4];
-    char game_id[5];
-    memcpy(os_id, bootid.os_id, 3);
-    os_id[3] = '\0';
-    memcpy(game_id, bootid.game_id, 4);
-    game_id[4] = '\0';
+    if (strstr(image_name, ".exfat") != NULL) {
+        ExfatContext ctx;
+        bool opened = source ? exfat_init_source(&ctx, source) : exfat_init(&ctx, image_name);
+        if (opened) {
+            if (exfat_extract_all(&ctx, &sink)) {
+                log_printf("\nExFAT extraction completed successfully\n");
+                extracted = true;
+            }
+            else {
+                log_printf("\nFailed to extract ExFAT archive\n");
+            }
+            exfat_close(&ctx);
+        }
+        else {
+            log_printf("\nFailed to initialize ExFAT context\n");
+        }
+    }
+    else if (strstr(image_name, ".ntfs") != NULL) {
+        NTFSContext ctx = { 0 };
+        bool opened = source ? ntfs_init_source(&ctx, source) : ntfs_init(&ctx, image_name, vhd_cache_bytes);
+        if (opened) {
+            ctx.extract_threads = opts->extract_threads;
+            log_printf("\nExtracting NTFS archive...\n");
+
+            if (ntfs_extract_all(&ctx, &sink)) {
+                log_printf("\nNTFS extraction completed successfully\n");
+                ntfs_print_vhd_cache_stats(&ctx);
+                extracted = true;
+
+                char vhd_path[MAX_PATH_LENGTH];
+                bool found_child = false;
+
+                // Internal VHDs only exist on disk with directory output; a
+                // tar archive keeps them as plain members.
+                for (int vhd_num = 0; !opts->tar && vhd_num < 10; vhd_num++) {
+                    snprintf(vhd_path, sizeof(vhd_path), "%s%sinternal_%d.vhd",
+                        output_dir, PATH_SEPARATOR, vhd_num);
+
+                    FILE* test = fopen(vhd_path, "rb");
+                    if (!test) continue;
+                    fclose(test);
+
+                    if (vhd_num > 0) {
+                        log_printf("\nChild internal VHD identified, finalizing process.\n");
+                        found_child = true;
+                        break;
+                    }
 
-    const char* id = (bootid.container_type == CONTAINER_TYPE_OS) ? os_id : game_id;
+                    char vhd_output_dir[MAX_PATH_LENGTH];
+                    snprintf(vhd_output_dir, sizeof(vhd_output_dir), "%s%scontents",
+                        output_dir, PATH_SEPARATOR);
 
-    GameKeys keys;
-    bool got_keys = false;
-    if (bootid.container_type == CONTAINER_TYPE_OS || bootid.container_type == CONTAINER_TYPE_APP) {
-        got_keys = get_game_keys(id, &keys);
+                    NTFSContext vhd_ctx = { 0 };
+                    ExtractSink vhd_sink;
+                    Manifest vhd_manifest;
+                    if (!init_sink(&vhd_sink, opts, &dedup, &vhd_manifest, vhd_output_dir)) {
+                        break;
+                    }
+                    if (ntfs_init(&vhd_ctx, vhd_path, vhd_cache_bytes)) {
+                        vhd_ctx.extract_threads = opts->extract_threads;
+                        log_printf("\nExtracting from internal VHD...\n");
+                        if (ntfs_extract_all(&vhd_ctx, &vhd_sink)) {
+                            log_printf("\nInternal VHD extraction completed successfully\n");
+                        }
+                        else {
+                            log_printf("\nFailed to extract VHD contents\n");
+                        }
+                        ntfs_print_vhd_cache_stats(&vhd_ctx);
+                        ntfs_close(&vhd_ctx);
+                    }
+                    else {
+                        log_printf("\nFailed to open internal VHD\n");
+                    }
+                    finish_sink(&vhd_sink);
+                    break;
+                }
+            }
+            else {
+                log_printf("\nFailed to extract NTFS archive\n");
+            }
+            ntfs_close(&ctx);
+        }
+        else {
+            log_printf("\nFailed to initialize NTFS context\n");
+        }
     }
     else {
-        memcpy(keys.key, OPTION_KEY, 16);
-        memcpy(keys.iv, OPTION_IV, 16);
-        keys.has_iv = true;
-        got_keys = true;
-    }
-
-    if (!got_keys) {
-        printf("Decryption key invalid or not found.\n");
-        fclose(file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+        log_printf("\nUnknown filesystem type for file %s\n", image_name);
     }
 
-    uint64_t data_offset = bootid.header_block_count * bootid.block_size;
-
-    bool has_iv = false;
-    memcpy(key, keys.key, 16);
+    finish_sink(&sink);
+    if (opts->dedup && extracted) {
+        print_dedup_report(&dedup);
+    }
+    return extracted;
+}
 
-    if (bootid.use_custom_iv) {
-        has_iv = false;
+// Opens the journal for output_filename and returns where the image can be
+// continued from: the last checkpoint, provided the image still holds that
+// much, otherwise 0.
+static bool open_journal(Journal* journal, const Container* container, const char* output_filename,
+    uint64_t* start_offset) {
+    if (!journal_open(journal, output_filename, &container->bootid, container->payload_size, start_offset)) {
+        return false;
     }
-    else {
-        has_iv = keys.has_iv;
-        if (has_iv) {
-            memcpy(iv, keys.iv, 16);
+    if (*start_offset == 0) {
+        return true;
+    }
+
+    uint64_t image_size = 0;
+    FILE* image = fopen(output_filename, "rb");
+    if (image) {
+        if (FSEEKO(image, 0, SEEK_END) == 0) {
+            image_size = (uint64_t)FTELLO(image);
         }
+        fclose(image);
+    }
+    if (image_size < *start_offset) {
+        log_printf("%s is shorter than its journal says, starting over\n", output_filename);
+        *start_offset = 0;
     }
+    return true;
+}
 
-    if (!has_iv) {
-        if (fseek(file, data_offset, SEEK_SET) != 0) {
-            perror("fseek");
-            fclose(file);
-            free(bootid_bytes);
-            free(read_buffer);
-            free(decrypted_buffer);
-            return 1;
+// Opens the container and either writes the decrypted image (returning its
+// name through job->image_name for extraction) or, with --no-image, extracts
+// straight from the container.
+static bool process_file(Job* job, const Options* opts) {
+    Container container;
+    if (!container_open(&container, job->path)) {
+        job->result = JOB_OPEN_FAILED;
+        return false;
+    }
+
+    STRCPY_S(job->image_name, sizeof(job->image_name), container.image_name);
+    if (opts->verify) {
+        // Fail before anything is decrypted or written.
+        if (!container_verify(&container)) {
+            log_printf("Verification failed: %s\n", job->path);
+            container_close(&container);
+            job->result = JOB_VERIFY_FAILED;
+            return false;
+        }
+        log_printf("Header checksum OK, container complete\n");
+    }
+    job->bytes = container.payload_size;
+
+    if (!opts->write_image) {
+        // Extract straight from the container, decrypting pages as the parsers ask for them.
+        log_printf("\nExtracting from container without writing %s\n", container.image_name);
+        if (opts->cache_mb > 0 &&
+            !container_enable_cache(&container, (size_t)opts->cache_mb * 1024 * 1024)) {
+            log_printf("Could not allocate a %d MiB page cache, reading uncached\n", opts->cache_mb);
         }
 
-        size_t read_size = fread(read_buffer, 1, PAGE_SIZE, file);
-        if (read_size != PAGE_SIZE) {
-            perror("fread");
-            fclose(file);
-            free(bootid_bytes);
-            free(read_buffer);
-            free(decrypted_buffer);
-            return 1;
+        ImageSource source;
+        container_as_source(&container, &source);
+        bool extracted = extract_image(container.image_name, &source, opts);
+
+        if (container.cache_enabled) {
+            PageCacheStats cache_stats;
+            page_cache_get_stats(&container.cache, &cache_stats);
+            print_page_cache_stats(&cache_stats);
         }
+        container_close(&container);
 
-        if (bootid.container_type == CONTAINER_TYPE_OPTION) {
-            if (!calculate_file_iv(key, EXFAT_HEADER, read_buffer, iv)) {
-                printf("Could not calculate file IV\n");
-                fclose(file);
-                free(bootid_bytes);
-                free(read_buffer);
-                free(decrypted_buffer);
-                return 1;
-            }
+        job->result = extracted ? JOB_OK : JOB_EXTRACT_FAILED;
+        return extracted;
+    }
+
+    const char* output_filename = opts->output_stdout ? OUTPUT_STDOUT : job->image_name;
+    if (opts->output_stdout) {
+        log_printf("Image name: %s\n", job->image_name);
+    }
+
+    PageDecryptor decryptor;
+    if (!page_decryptor_init(&decryptor, container.key, container.iv, opts->threads)) {
+        log_printf("Could not create cipher context\n");
+        container_close(&container);
+        job->result = JOB_DECRYPT_FAILED;
+        return false;
+    }
+
+    log_printf("\nDecrypting file (%d threads, %s)...\n", decryptor.thread_count,
+        decryptor.kernel ? decryptor.kernel->name : "OpenSSL EVP");
+    if (opts->verify) {
+        page_decryptor_enable_crc(&decryptor);
+    }
+
+    Journal journal;
+    uint64_t start_offset = 0;
+    if (opts->resume) {
+        if (!open_journal(&journal, &container, output_filename, &start_offset)) {
+            page_decryptor_close(&decryptor);
+            container_close(&container);
+            job->result = JOB_DECRYPT_FAILED;
+            return false;
         }
-        else {
-            if (!calculate_file_iv(key, NTFS_HEADER, read_buffer, iv)) {
-                printf("Could not calculate file IV\n");
-                fclose(file);
-                free(bootid_bytes);
-                free(read_buffer);
-                free(decrypted_buffer);
-                return 1;
-            }
+        if (start_offset > 0) {
+            log_printf("Resuming at %.1f of %.1f MiB\n", start_offset / (1024.0 * 1024.0),
+                container.payload_size / (1024.0 * 1024.0));
         }
-        has_iv = true;
+    }
+    else if (!opts->output_stdout) {
+        // This run rewrites the image, an old journal no longer describes it.
+        journal_discard(output_filename);
     }
 
-    char* output_filename = malloc(MAX_PATH_LENGTH);
-    if (!output_filename) {
-        printf("Memory allocation failed\n");
-        fclose(file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+    StreamStats stream_stats;
+    bool decrypted = false;
+    MappedDecryptResult mapped = MAPPED_DECRYPT_UNAVAILABLE;
+
+    // Resuming needs the checkpoints of the buffered pipeline.
+    if (opts->use_mmap && !opts->resume) {
+        mapped = decrypt_mapped(&decryptor, job->path, container.data_offset, output_filename,
+            container.payload_size, true, opts->sparse, &stream_stats);
+        if (mapped == MAPPED_DECRYPT_UNAVAILABLE) {
+            log_printf("Memory mapping unavailable, using buffered I/O\n");
+        }
+        decrypted = (mapped == MAPPED_DECRYPT_OK);
     }
 
-    if (bootid.container_type == CONTAINER_TYPE_OS) {
-        snprintf(output_filename, MAX_PATH_LENGTH, "%s_%04d%02d%02d_%s_%d.ntfs",
-            os_id,
-            bootid.os_version.major,
-            bootid.os_version.minor,
-            bootid.os_version.release,
-            target_timestamp_str,
-            bootid.sequence_number);
-    }
-    else if (bootid.container_type == CONTAINER_TYPE_APP) {
-        if (bootid.sequence_number > 0) {
-            snprintf(output_filename, MAX_PATH_LENGTH, "%s_%d%02d%02d_%s_%d_%d%02d%02d.ntfs",
-                game_id,
-                bootid.target_version.version.major,
-                bootid.target_version.version.minor,
-                bootid.target_version.version.release,
-                target_timestamp_str,
-                bootid.sequence_number,
-                bootid.source_version.major,
-                bootid.source_version.minor,
-                bootid.source_version.release);
+    if (mapped == MAPPED_DECRYPT_UNAVAILABLE) {
+        decrypted = decrypt_to_file(&decryptor, container.fp, container.data_offset, output_filename,
+            container.payload_size, start_offset, opts->resume ? &journal : NULL,
+            opts->depth, opts->sparse, &stream_stats);
+    }
+
+    if (opts->resume) {
+        if (decrypted) {
+            journal_finish(&journal);
         }
         else {
-            snprintf(output_filename, MAX_PATH_LENGTH, "%s_%d%02d%02d_%s_%d.ntfs",
-                game_id,
-                bootid.target_version.version.major,
-                bootid.target_version.version.minor,
-                bootid.target_version.version.release,
-                target_timestamp_str,
-                bootid.sequence_number);
-        }
-    }
-    else if (bootid.container_type == CONTAINER_TYPE_OPTION) {
-        char option_str[5];
-        memcpy(option_str, bootid.target_version.option, 4);
-        option_str[4] = '\0';
-        snprintf(output_filename, MAX_PATH_LENGTH, "%s_%s_%s_%d.exfat",
-            game_id,
-            option_str,
-            target_timestamp_str,
-            bootid.sequence_number);
-    }
-
-    FILE* output_file = fopen(output_filename, "wb");
-    if (!output_file) {
-        perror(output_filename);
-        free(output_filename);
-        fclose(file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        return 1;
+            journal_close(&journal);
+            log_printf("Progress kept in %s, run again with --resume to continue\n", journal.path);
+        }
     }
 
-    uint64_t output_size = (bootid.block_count - bootid.header_block_count) * bootid.block_size;
+    uint32_t payload_crc = page_decryptor_crc(&decryptor);
+    page_decryptor_close(&decryptor);
+    container_close(&container);
 
-    if (fseek(file, data_offset, SEEK_SET) != 0) {
-        perror("fseek");
-        fclose(file);
-        fclose(output_file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        free(output_filename);
-        return 1;
+    print_stream_stats(&stream_stats);
+    if (decrypted && opts->verify) {
+        if (start_offset == 0) {
+            log_printf("Image CRC32: %08X\n", payload_crc);
+        }
+        else {
+            log_printf("Image CRC32 not available, the image was resumed\n");
+        }
     }
 
-    EVP_CIPHER_CTX* page_ctx = EVP_CIPHER_CTX_new();
-    if (!page_ctx) {
-        printf("Could not create cipher context\n");
-        fclose(file);
-        fclose(output_file);
-        free(bootid_bytes);
-        free(read_buffer);
-        free(decrypted_buffer);
-        free(output_filename);
-        return 1;
+    if (!decrypted) {
+        log_printf("Decryption failed: %s\n", output_filename);
+        job->result = JOB_DECRYPT_FAILED;
+        return false;
     }
-    EVP_DecryptInit_ex(page_ctx, EVP_aes_128_cbc(), NULL, key, NULL);
-    EVP_CIPHER_CTX_set_padding(page_ctx, 0);
 
-    printf("\nDecrypting file...\n");
-    time_t last_update_time = time(NULL);
-    int last_percentage = -1;
+    if (opts->output_stdout) {
+        log_printf("Decryption finalized: %s written to standard output\n", job->image_name);
+    }
+    else {
+        log_printf("Decryption finalized: %s\n", output_filename);
+    }
+    job->result = JOB_OK;
+    return true;
+}
 
-    uint64_t total_bytes_read = 0;
-    uint64_t bytes_remaining = output_size;
+static const char* job_result_name(JobResult result);
 
-    while (bytes_remaining > 0) {
-        size_t chunk_size = (bytes_remaining > BUFFER_SIZE) ? BUFFER_SIZE : (size_t)bytes_remaining;
+// Reports the BootId of one file without touching its payload, so a whole
+// library can be inventoried in seconds.
+static void run_info_job(Job* job, const Options* opts) {
+    uint64_t start_time = monotonic_ns();
+    LogBuffer* previous = NULL;
+    if (opts->info_json) {
+        // Open errors become part of the file's JSON line instead of free text.
+        previous = log_capture(&job->log);
+    }
 
-        size_t read_size = fread(read_buffer, 1, chunk_size, file);
-        if (read_size != chunk_size) {
-            if (feof(file)) {
-                printf("\nUnexpected end of file\n");
-            } else {
-                perror("\nread_chunk");
+    Container container;
+    if (container_open_header(&container, job->path)) {
+        STRCPY_S(job->image_name, sizeof(job->image_name), container.image_name);
+        print_container_info(&container, job->path, opts->info_json);
+        container_close(&container);
+        job->result = JOB_OK;
+    }
+    else {
+        job->result = JOB_OPEN_FAILED;
+        if (opts->info_json) {
+            char error[512];
+            snprintf(error, sizeof(error), "%s", job->log.data ? job->log.data : "");
+            size_t length = strlen(error);
+            while (length > 0 && (error[length - 1] == '\n' || error[length - 1] == '\r')) {
+                error[--length] = '\0';
             }
-            break;
+            print_container_info_error(job->path, error);
         }
+    }
 
-        size_t offset = 0;
-        while (offset < read_size) {
-            size_t block_size = (read_size - offset > PAGE_SIZE) ? PAGE_SIZE : (read_size - offset);
+    if (opts->info_json) {
+        log_buffer_clear(&job->log);
+        log_capture(previous);
+    }
+    job->elapsed_ns = monotonic_ns() - start_time;
+}
 
-            uint64_t file_offset = total_bytes_read + offset;
-            calculate_page_iv(file_offset, iv, page_iv);  // Generate unique IV for each 4KB page
+static void run_job(Job* job, const Options* opts) {
+    if (opts->info) {
+        run_info_job(job, opts);
+        return;
+    }
 
-            EVP_DecryptInit_ex(page_ctx, NULL, NULL, NULL, page_iv);
+    uint64_t start_time = monotonic_ns();
+    stats_attach(opts->stats ? &job->stats : NULL);
+    log_printf("Processing file: %s\n", job->path);
 
-            int out_len1 = 0, out_len2 = 0;
-            if (!EVP_DecryptUpdate(page_ctx, decrypted_buffer + offset, &out_len1, read_buffer + offset, block_size)) {
-                printf("\nCould not decrypt data\n");
-                break;
-            }
-            if (!EVP_DecryptFinal_ex(page_ctx, decrypted_buffer + offset + out_len1, &out_len2)) {
-                printf("\nCould not finalize decryption\n");
-                break;
-            }
-            if (out_len1 + out_len2 != (int)block_size) {
-                printf("\nDecrypted data size mismatch\n");
-                break;
-            }
-            offset += block_size;
+    if (process_file(job, opts)) {
+        if (opts->extract_fs && opts->write_image && !extract_image(job->image_name, NULL, opts)) {
+            job->result = JOB_EXTRACT_FAILED;
         }
+    }
+    else {
+        log_printf("Failed to process %s\n", job->path);
+    }
+
+    job->elapsed_ns = monotonic_ns() - start_time;
+    stats_attach(NULL);
+
+    if (opts->stats) {
+        stats_print_json(stderr, &job->stats, job->path, job->image_name,
+            job_result_name(job->result), job->elapsed_ns);
+    }
+}
 
-        if (fwrite(decrypted_buffer, 1, read_size, output_file) != read_size) {
-            perror("\nfwrite");
-            break;
+static void job_worker_main(void* arg) {
+    JobQueue* queue = (JobQueue*)arg;
+
+    for (;;) {
+        mutex_lock(&queue->mutex);
+        int index = queue->next_job++;
+        mutex_unlock(&queue->mutex);
+        if (index >= queue->job_count) {
+            return;
         }
 
-        total_bytes_read += read_size;
-        bytes_remaining -= read_size;
+        // Buffer the job's output and print it in one piece once it is done,
+        // so lines from jobs running side by side do not interleave.
+        Job* job = &queue->jobs[index];
+        log_capture(&job->log);
+        run_job(job, queue->opts);
+        log_capture(NULL);
 
-        time_t current_time = time(NULL);
-        if (current_time != last_update_time) {
-            int percentage = (int)((total_bytes_read * 100) / output_size);
-            if (percentage != last_percentage) {
-                printf("\rProgress: %d%%    ", percentage);  // Extra spaces to clear line
-                fflush(stdout);
-                last_percentage = percentage;
-            }
-            last_update_time = current_time;
+        mutex_lock(&queue->mutex);
+        log_buffer_flush(&job->log, log_output());
+        mutex_unlock(&queue->mutex);
+    }
+}
+
+static void run_jobs(Job* jobs, int job_count, const Options* opts) {
+    int workers = (opts->parallel < job_count) ? opts->parallel : job_count;
+    if (workers <= 1) {
+        for (int i = 0; i < job_count; i++) {
+            run_job(&jobs[i], opts);
         }
+        return;
     }
 
-    printf("\rProgress: 100%%    \n");
+    JobQueue queue;
+    queue.jobs = jobs;
+    queue.job_count = job_count;
+    queue.next_job = 0;
+    queue.opts = opts;
+    mutex_init(&queue.mutex);
+
+    Thread* threads = calloc((size_t)workers, sizeof(Thread));
+    int started = 0;
+    if (threads) {
+        for (; started < workers - 1; started++) {
+            if (!thread_create(&threads[started], job_worker_main, &queue)) {
+                break;
+            }
+        }
+    }
 
-    EVP_CIPHER_CTX_free(page_ctx);
+    // The main thread takes jobs as well, which also covers thread creation failing.
+    job_worker_main(&queue);
 
-    fclose(file);
-    fclose(output_file);
+    for (int i = 0; i < started; i++) {
+        thread_join(threads[i]);
+    }
+    free(threads);
+    mutex_destroy(&queue.mutex);
+}
 
-    printf("Decryption finalized: %s\n", output_filename);
+static const char* job_result_name(JobResult result) {
+    switch (result) {
+    case JOB_OK:             return "ok";
+    case JOB_OPEN_FAILED:    return "open failed";
+    case JOB_VERIFY_FAILED:  return "verify failed";
+    case JOB_DECRYPT_FAILED: return "decrypt failed";
+    case JOB_EXTRACT_FAILED: return "extract failed";
+    }
+    return "unknown";
+}
 
-    if (extract_fs) {
-        if (g_output_filename) {
-            free(g_output_filename);
+static void print_job_summary(const Job* jobs, int job_count) {
+    log_printf("\n%-40s %-15s %10s %9s %10s\n", "Image", "Result", "Size MiB", "Time s", "MiB/s");
+
+    int failed = 0;
+    for (int i = 0; i < job_count; i++) {
+        const Job* job = &jobs[i];
+        double size_mib = job->bytes / (1024.0 * 1024.0);
+        double elapsed = job->elapsed_ns / 1e9;
+        double throughput = (elapsed > 0) ? size_mib / elapsed : 0;
+        const char* name = job->image_name[0] ? job->image_name : job->path;
+
+        log_printf("%-40.40s %-15s %10.1f %9.2f %10.1f\n",
+            name, job_result_name(job->result), size_mib, elapsed, throughput);
+        if (job->result != JOB_OK) {
+            failed++;
         }
-        g_output_filename = output_filename;
     }
-    else {
-        free(output_filename);
-    }
-
-    free(bootid_bytes);
-    free(read_buffer);
-    free(decrypted_buffer);
+    log_printf("%d of %d images processed successfully\n", job_count - failed, job_count);
+}
 
-    return 0;
+static void print_usage(void) {
+    printf("usage: unsegaREBORN [-no] [-j N] [--depth N] [--no-image] [--cache-mb N] [--vhd-cache-mb N] [--extract-threads N] [--sparse] [--mmap] [--verify] [--resume] [-o -] [--tar FILE] [--dedup-store DIR] [--incremental[=hash]] [--parallel N] [--keys-dir DIR] [--stats] [--info[=json]] [--evp] <input_file1> [<input_file2> ...]\n");
+    printf("  -no             Do not extract filesystem archives after decryption\n");
+    printf("  -j N            Number of decryption threads (default: number of CPU cores)\n");
+    printf("  --parallel N    Number of images processed at the same time (default: 1)\n");
+    printf("  --depth N       Number of chunks in flight between read, decrypt and write (default: %d)\n",
+        DECRYPT_DEFAULT_DEPTH);
+    printf("  --no-image      Extract straight from the container without writing the decrypted image\n");
+    printf("  --cache-mb N    Decrypted page cache for --no-image in MiB, 0 disables it (default: %d)\n",
+        PAGE_CACHE_DEFAULT_MB);
+    printf("  --vhd-cache-mb N\n");
+    printf("                  Cache for blocks of dynamic internal VHDs in MiB, 0 disables it (default: %d)\n",
+        VHD_CACHE_DEFAULT_MB);
+    printf("  --extract-threads N\n");
+    printf("                  Threads reading and writing the files of an NTFS image (default: %d, at most one per core, 1 with --tar)\n",
+        NTFS_EXTRACT_DEFAULT_THREADS);
+    printf("  --sparse        Leave all-zero pages of the decrypted image as holes instead of writing them\n");
+    printf("  --mmap          Decrypt between memory-mapped input and output files\n");
+    printf("  --verify        Check the header checksum and file size before decrypting, print the image CRC32\n");
+    printf("  --resume        Keep a journal next to the image and continue an interrupted decryption\n");
+    printf("  -o -            Write the decrypted image to standard output (one input, messages go to stderr)\n");
+    printf("  --tar FILE      Extract into one tar archive instead of directories, - for standard output\n");
+    printf("  --dedup-store DIR\n");
+    printf("                  Keep each distinct file once in DIR and link the extracted files to it\n");
+    printf("  --incremental   Only write files whose size or modification time changed since the last extraction\n");
+    printf("  --incremental=hash\n");
+    printf("                  Same, but compare file contents by SHA-256 instead of modification times\n");
+    printf("  --keys-dir DIR  Also load <game id>.bin key files from DIR\n");
+    printf("  --stats         Print per-stage timings and counters as one JSON line per image on stderr\n");
+    printf("  --info          Print the container header of each file without decrypting it\n");
+    printf("  --info=json     Same as --info, as one JSON line per file\n");
+    printf("  --evp           Always decrypt through OpenSSL EVP instead of the built-in AES-NI/ARMv8 kernel\n");
 }
 
 int main(int argc, char* argv[]) {
-    bool extract_fs = true;
+    Options opts;
+    opts.extract_fs = true;
+    opts.threads = cpu_count();
+    opts.depth = DECRYPT_DEFAULT_DEPTH;
+    opts.use_aes_kernel = true;
+    opts.use_mmap = false;
+    opts.write_image = true;
+    opts.cache_mb = PAGE_CACHE_DEFAULT_MB;
+    opts.vhd_cache_mb = VHD_CACHE_DEFAULT_MB;
+    opts.extract_threads = min(NTFS_EXTRACT_DEFAULT_THREADS, cpu_count());
+    opts.sparse = false;
+    opts.parallel = 1;
+    opts.stats = false;
+    opts.info = false;
+    opts.info_json = false;
+    opts.keys_dir = NULL;
+    opts.verify = false;
+    opts.resume = false;
+    opts.output_stdout = false;
+    opts.tar = NULL;
+    opts.dedup = NULL;
+    opts.incremental = false;
+    opts.incremental_hash = false;
+    const char* tar_path = NULL;
+    const char* dedup_path = NULL;
+    bool threads_given = false;
     int start_index = 1;
 
     if (argc < 2) {
-        printf("usage: unsegaREBORN [-no] <input_file1> [<input_file2> ...]\n");
-        printf("  -no   Do not extract filesystem archives after decryption\n");
+        print_usage();
         return 0;
     }
 
-    if (strcmp(argv[1], "-no") == 0) {
-        extract_fs = false;
-        start_index = 2;
-
-        if (argc < 3) {
-            printf("No input files specified\n");
+    while (start_index < argc && argv[start_index][0] == '-') {
+        const char* arg = argv[start_index];
+        if (strcmp(arg, "-no") == 0) {
+            opts.extract_fs = false;
+        }
+        else if (strcmp(arg, "--no-image") == 0) {
+            opts.write_image = false;
+        }
+        else if (strcmp(arg, "--stats") == 0) {
+            opts.stats = true;
+        }
+        else if (strcmp(arg, "--info") == 0) {
+            opts.info = true;
+        }
+        else if (strcmp(arg, "--info=json") == 0) {
+            opts.info = true;
+            opts.info_json = true;
+        }
+        else if (strcmp(arg, "--incremental") == 0) {
+            opts.incremental = true;
+        }
+        else if (strcmp(arg, "--incremental=hash") == 0) {
+            opts.incremental = true;
+            opts.incremental_hash = true;
+        }
+        else if (strcmp(arg, "--resume") == 0) {
+            opts.resume = true;
+        }
+        else if (strcmp(arg, "--verify") == 0) {
+            opts.verify = true;
+        }
+        else if (strcmp(arg, "--sparse") == 0) {
+            opts.sparse = true;
+        }
+        else if (strcmp(arg, "--mmap") == 0) {
+            opts.use_mmap = true;
+        }
+        else if (strcmp(arg, "--evp") == 0) {
+            opts.use_aes_kernel = false;
+        }
+        else if (strcmp(arg, "--cache-mb") == 0) {
+            if (start_index + 1 >= argc) {
+                printf("Missing value for --cache-mb\n");
+                return 1;
+            }
+            opts.cache_mb = atoi(argv[++start_index]);
+            if (opts.cache_mb < 0) {
+                printf("Invalid cache size: %s\n", argv[start_index]);
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "--vhd-cache-mb") == 0) {
+            if (start_index + 1 >= argc) {
+                printf("Missing value for --vhd-cache-mb\n");
+                return 1;
+            }
+            opts.vhd_cache_mb = atoi(argv[++start_index]);
+            if (opts.vhd_cache_mb < 0) {
+                printf("Invalid cache size: %s\n", argv[start_index]);
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "--extract-threads") == 0) {
+            if (start_index + 1 >= argc) {
+                printf("Missing value for --extract-threads\n");
+                return 1;
+            }
+            opts.extract_threads = atoi(argv[++start_index]);
+            if (opts.extract_threads < 1) {
+                printf("Invalid thread count: %s\n", argv[start_index]);
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "-o") == 0) {
+            if (start_index + 1 >= argc) {
+                printf("Missing value for -o\n");
+                return 1;
+            }
+            if (strcmp(argv[++start_index], OUTPUT_STDOUT) != 0) {
+                printf("Only -o - (standard output) is supported, images are otherwise named after their header\n");
+                return 1;
+            }
+            opts.output_stdout = true;
+        }
+        else if (strcmp(arg, "--tar") == 0) {
+            if (start_index + 1 >= argc) {
+                printf("Missing value for --tar\n");
+                return 1;
+            }
+            tar_path = argv[++start_index];
+        }
+        else if (strcmp(arg, "--dedup-store") == 0) {
+            if (start_index + 1 >= argc) {
+                printf("Missing value for --dedup-store\n");
+                return 1;
+            }
+            dedup_path = argv[++start_index];
+        }
+        else if (strcmp(arg, "--keys-dir") == 0) {
+            if (start_index + 1 >= argc) {
+                printf("Missing value for --keys-dir\n");
+                return 1;
+            }
+            opts.keys_dir = argv[++start_index];
+        }
+        else if (strcmp(arg, "--parallel") == 0) {
+            if (start_index + 1 >= argc) {
+                printf("Missing value for --parallel\n");
+                return 1;
+            }
+            opts.parallel = atoi(argv[++start_index]);
+            if (opts.parallel < 1) {
+                printf("Invalid job count: %s\n", argv[start_index]);
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "--depth") == 0) {
+            if (start_index + 1 >= argc) {
+                printf("Missing value for --depth\n");
+                return 1;
+            }
+            opts.depth = atoi(argv[++start_index]);
+            if (opts.depth < 1) {
+                printf("Invalid pipeline depth: %s\n", argv[start_index]);
+                return 1;
+            }
+        }
+        else if (strncmp(arg, "-j", 2) == 0) {
+            const char* value = arg + 2;
+            if (*value == '\0') {
+                if (start_index + 1 >= argc) {
+                    printf("Missing value for -j\n");
+                    return 1;
+                }
+                value = argv[++start_index];
+            }
+            opts.threads = atoi(value);
+            threads_given = true;
+            if (opts.threads < 1) {
+                printf("Invalid thread count: %s\n", value);
+                return 1;
+            }
+        }
+        else {
+            printf("Unknown option: %s\n", arg);
+            print_usage();
             return 1;
         }
+        start_index++;
     }
 
-    for (int i = start_index; i < argc; ++i) {
-        const char* file_path = argv[i];
-        printf("Processing file: %s\n", file_path);
+    if (start_index >= argc) {
+        printf("No input files specified\n");
+        return 1;
+    }
 
-        if (process_file(file_path, extract_fs) == 0) {
-            if (extract_fs && g_output_filename) {
-                char output_dir[MAX_PATH_LENGTH];
-                strncpy(output_dir, g_output_filename, sizeof(output_dir) - 1);
-                output_dir[sizeof(output_dir) - 1] = '\0';
+    if (!opts.write_image && !opts.extract_fs) {
+        printf("--no-image cannot be combined with -no\n");
+        return 1;
+    }
 
-                char* ext = strrchr(output_dir, '.');
-                if (ext) *ext = '\0';
+    int job_count = argc - start_index;
+    if (opts.output_stdout) {
+        if (job_count != 1) {
+            printf("-o - takes exactly one input file\n");
+            return 1;
+        }
+        if (!opts.write_image || opts.resume || opts.sparse || opts.info) {
+            printf("-o - cannot be combined with --no-image, --resume, --sparse or --info\n");
+            return 1;
+        }
+        // Nothing lands on disk to extract from, and stdout belongs to the image now.
+        opts.extract_fs = false;
+        opts.use_mmap = false;
+        log_set_output(stderr);
+    }
+    if (tar_path) {
+        if (!opts.extract_fs || opts.info) {
+            printf("--tar cannot be combined with -no, -o - or --info\n");
+            return 1;
+        }
+        if (strcmp(tar_path, TAR_STDOUT) == 0) {
+            log_set_output(stderr);
+        }
+    }
+    if (dedup_path && (!opts.extract_fs || opts.info || tar_path)) {
+        printf("--dedup-store cannot be combined with -no, -o -, --tar or --info\n");
+        return 1;
+    }
+    if (opts.incremental && (!opts.extract_fs || opts.info || tar_path)) {
+        printf("--incremental cannot be combined with -no, -o -, --tar or --info\n");
+        return 1;
+    }
 
-                if (strstr(g_output_filename, ".exfat") != NULL) {
-                    ExfatContext ctx;
-                    if (exfat_init(&ctx, g_output_filename)) {
-                        if (exfat_extract_all(&ctx, output_dir)) {
-                            printf("\nExFAT extraction completed successfully\n");
-                        }
-                        else {
-                            printf("\nFailed to extract ExFAT archive\n");
-                        }
-                        exfat_close(&ctx);
-                    }
-                    else {
-                        printf("\nFailed to initialize ExFAT context\n");
-                    }
-                }
-                else if (strstr(g_output_filename, ".ntfs") != NULL) {
-                    NTFSContext ctx = { 0 };
-                    if (ntfs_init(&ctx, g_output_filename, output_dir)) {
-                        printf("\nExtracting NTFS archive...\n");
-
-                        if (ntfs_extract_all(&ctx)) {
-                            printf("\nNTFS extraction completed successfully\n");
-
-                            char vhd_path[MAX_PATH_LENGTH];
-                            bool found_child = false;
-
-                            for (int vhd_num = 0; vhd_num < 10; vhd_num++) {
-                                snprintf(vhd_path, sizeof(vhd_path), "%s%sinternal_%d.vhd",
-                                    output_dir, PATH_SEPARATOR, vhd_num);
-
-                                FILE* test = fopen(vhd_path, "rb");
-                                if (!test) continue;
-                                fclose(test);
-
-                                if (vhd_num > 0) {
-                                    printf("\nChild internal VHD identified, finalizing process.\n");
-                                    found_child = true;
-                                    break;
-                                }
-
-                                char vhd_output_dir[MAX_PATH_LENGTH];
-                                snprintf(vhd_output_dir, sizeof(vhd_output_dir), "%s%scontents",
-                                    output_dir, PATH_SEPARATOR);
-
-                                NTFSContext vhd_ctx = { 0 };
-                                if (ntfs_init(&vhd_ctx, vhd_path, vhd_output_dir)) {
-                                    printf("\nExtracting from internal VHD...\n");
-                                    if (ntfs_extract_all(&vhd_ctx)) {
-                                        printf("\nInternal VHD extraction completed successfully\n");
-                                    }
-                                    else {
-                                        printf("\nFailed to extract VHD contents\n");
-                                    }
-                                    ntfs_close(&vhd_ctx);
-                                }
-                                else {
-                                    printf("\nFailed to open internal VHD\n");
-                                }
-                                break;
-                            }
-                        }
-                        else {
-                            printf("\nFailed to extract NTFS archive\n");
-                        }
-                        ntfs_close(&ctx);
-                    }
-                    else {
-                        printf("\nFailed to initialize NTFS context\n");
-                    }
-                }
-                else {
-                    printf("\nUnknown filesystem type for file %s\n", g_output_filename);
-                }
+    aes_kernel_init(opts.use_aes_kernel);
+    crc32_init();
+    if (!key_store_init(opts.keys_dir)) {
+        log_printf("Could not read key directory: %s\n", opts.keys_dir);
+        return 1;
+    }
 
-                free(g_output_filename);
-                g_output_filename = NULL;
-            }
+    if (opts.parallel > job_count) {
+        opts.parallel = job_count;
+    }
+    if (!threads_given && opts.parallel > 1) {
+        // Share the cores between the jobs instead of oversubscribing them.
+        opts.threads = cpu_count() / opts.parallel;
+        if (opts.threads < 1) {
+            opts.threads = 1;
         }
-        else {
-            printf("Failed to process %s\n", file_path);
+    }
+
+    TarWriter tar;
+    if (tar_path) {
+        if (!tar_writer_open(&tar, tar_path)) {
+            return 1;
+        }
+        opts.tar = &tar;
+    }
+    DedupStore dedup;
+    if (dedup_path) {
+        if (!dedup_store_open(&dedup, dedup_path)) {
+            return 1;
         }
+        opts.dedup = &dedup;
     }
 
-    if (g_output_filename) {
-        free(g_output_filename);
+    Job* jobs = calloc((size_t)job_count, sizeof(Job));
+    if (!jobs) {
+        log_printf("Memory allocation failed\n");
+        return 1;
+    }
+    for (int i = 0; i < job_count; i++) {
+        jobs[i].path = argv[start_index + i];
+        log_buffer_init(&jobs[i].log);
     }
 
+    run_jobs(jobs, job_count, &opts);
+
+    if (job_count > 1 && !opts.info) {
+        print_job_summary(jobs, job_count);
+    }
+
+    for (int i = 0; i < job_count; i++) {
+        log_buffer_close(&jobs[i].log);
+    }
+    free(jobs);
+    key_store_close();
+
+    if (opts.dedup) {
+        dedup_store_close(opts.dedup);
+    }
+    if (opts.tar && !tar_writer_close(opts.tar)) {
+        log_printf("Could not finish the tar archive %s\n", tar_path);
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
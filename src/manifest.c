@@ -0,0 +1,220 @@
+#include "manifest.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MANIFEST_HEADER "unsega-manifest 1"
+#define MANIFEST_LINE_LENGTH (MAX_PATH_LENGTH * 2 + 128)
+#define MANIFEST_MIN_SLOTS 64
+
+static uint32_t path_hash(const char* path) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (const char* p = path; *p; p++) {
+        h ^= (uint8_t)*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool list_add(ManifestList* list, const char* path, uint64_t size, uint64_t mtime, const uint8_t* hash) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        ManifestEntry* entries = realloc(list->entries, capacity * sizeof(ManifestEntry));
+        if (!entries) {
+            return false;
+        }
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+
+    ManifestEntry* entry = &list->entries[list->count];
+    entry->path = STRDUP(path);
+    if (!entry->path) {
+        return false;
+    }
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->has_hash = hash != NULL;
+    if (hash) {
+        memcpy(entry->hash, hash, MANIFEST_HASH_SIZE);
+    }
+    list->count++;
+    return true;
+}
+
+static void list_free(ManifestList* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].path);
+    }
+    free(list->entries);
+    memset(list, 0, sizeof(ManifestList));
+}
+
+static bool build_index(Manifest* manifest) {
+    size_t slot_count = MANIFEST_MIN_SLOTS;
+    while (slot_count < manifest->previous.count * 2) {
+        slot_count *= 2;
+    }
+    manifest->slots = malloc(slot_count * sizeof(size_t));
+    if (!manifest->slots) {
+        return false;
+    }
+    memset(manifest->slots, 0xFF, slot_count * sizeof(size_t));
+    manifest->slot_mask = slot_count - 1;
+
+    for (size_t i = 0; i < manifest->previous.count; i++) {
+        size_t slot = path_hash(manifest->previous.entries[i].path) & manifest->slot_mask;
+        while (manifest->slots[slot] != SIZE_MAX) {
+            slot = (slot + 1) & manifest->slot_mask;
+        }
+        manifest->slots[slot] = i;
+    }
+    return true;
+}
+
+static bool parse_hash(const char* hex, uint8_t* hash) {
+    if (strlen(hex) != MANIFEST_HASH_SIZE * 2) {
+        return false;
+    }
+    for (int i = 0; i < MANIFEST_HASH_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) {
+            return false;
+        }
+        hash[i] = (uint8_t)byte;
+    }
+    return true;
+}
+
+static bool load_previous(Manifest* manifest, FILE* file) {
+    char line[MANIFEST_LINE_LENGTH];
+    if (!fgets(line, sizeof(line), file) || strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) != 0) {
+        log_printf("Ignoring unreadable manifest %s\n", manifest->path);
+        return true;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        unsigned long long size, mtime;
+        char hex[MANIFEST_HASH_SIZE * 2 + 1];
+        int path_start = 0;
+        if (sscanf(line, "%llu %llu %64s %n", &size, &mtime, hex, &path_start) != 3 || path_start == 0 ||
+            line[path_start] == '\0') {
+            continue;
+        }
+
+        uint8_t hash[MANIFEST_HASH_SIZE];
+        bool has_hash = parse_hash(hex, hash);
+        if (!list_add(&manifest->previous, line + path_start, size, mtime, has_hash ? hash : NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool manifest_open(Manifest* manifest, const char* root, bool use_hash) {
+    memset(manifest, 0, sizeof(Manifest));
+    mutex_init(&manifest->mutex);
+    SNPRINTF(manifest->path, sizeof(manifest->path), "%s%s", root, MANIFEST_SUFFIX);
+    manifest->use_hash = use_hash;
+
+    FILE* file = fopen(manifest->path, "r");
+    if (file) {
+        bool loaded = load_previous(manifest, file);
+        fclose(file);
+        if (!loaded) {
+            manifest_close(manifest);
+            return false;
+        }
+    }
+    if (!build_index(manifest)) {
+        manifest_close(manifest);
+        return false;
+    }
+    return true;
+}
+
+const ManifestEntry* manifest_find(const Manifest* manifest, const char* path) {
+    size_t slot = path_hash(path) & manifest->slot_mask;
+    while (manifest->slots[slot] != SIZE_MAX) {
+        const ManifestEntry* entry = &manifest->previous.entries[manifest->slots[slot]];
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & manifest->slot_mask;
+    }
+    return NULL;
+}
+
+bool manifest_record(Manifest* manifest, const char* path, uint64_t size, uint64_t mtime,
+    const uint8_t* hash, bool unchanged) {
+    mutex_lock(&manifest->mutex);
+    if (unchanged) {
+        manifest->unchanged_files++;
+        manifest->unchanged_bytes += size;
+    }
+    else {
+        manifest->written_files++;
+        manifest->written_bytes += size;
+    }
+    bool added = list_add(&manifest->current, path, size, mtime, hash);
+    mutex_unlock(&manifest->mutex);
+    return added;
+}
+
+bool manifest_save(Manifest* manifest) {
+    char temp_path[sizeof(manifest->path) + 4];
+    SNPRINTF(temp_path, sizeof(temp_path), "%s.tmp", manifest->path);
+
+    FILE* file = fopen(temp_path, "w");
+    if (!file) {
+        log_perror(temp_path);
+        return false;
+    }
+
+    bool written = fprintf(file, "%s\n", MANIFEST_HEADER) > 0;
+    for (size_t i = 0; written && i < manifest->current.count; i++) {
+        const ManifestEntry* entry = &manifest->current.entries[i];
+        char hex[MANIFEST_HASH_SIZE * 2 + 1] = "-";
+        if (entry->has_hash) {
+            for (int j = 0; j < MANIFEST_HASH_SIZE; j++) {
+                SNPRINTF(hex + j * 2, 3, "%02x", entry->hash[j]);
+            }
+        }
+        written = fprintf(file, "%llu %llu %s %s\n", (unsigned long long)entry->size,
+            (unsigned long long)entry->mtime, hex, entry->path) > 0;
+    }
+    if (fclose(file) != 0) {
+        written = false;
+    }
+
+    // Replaced only once complete, so an interrupted run keeps the old one.
+#ifdef _WIN32
+    remove(manifest->path);
+#endif
+    if (!written || rename(temp_path, manifest->path) != 0) {
+        log_perror(manifest->path);
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
+
+void manifest_close(Manifest* manifest) {
+    list_free(&manifest->previous);
+    list_free(&manifest->current);
+    free(manifest->slots);
+    mutex_destroy(&manifest->mutex);
+    memset(manifest, 0, sizeof(Manifest));
+}
+
+void print_manifest_report(const Manifest* manifest) {
+    log_printf("Incremental: %llu files (%.1f MiB) unchanged, %llu files (%.1f MiB) written\n",
+        (unsigned long long)manifest->unchanged_files,
+        manifest->unchanged_bytes / (1024.0 * 1024.0),
+        (unsigned long long)manifest->written_files,
+        manifest->written_bytes / (1024.0 * 1024.0));
+}
@@ -1,4 +1,6 @@
 #include "ntfs.h"
+#include "log.h"
+#include "stats.h"
 #include <time.h>
 #include <locale.h>
 #include <wchar.h>
@@ -42,43 +44,6 @@ static bool is_safe_path(const char* path) {
     return true;
 }
 
-static bool create_directories(const char* path) {
-    if (!is_safe_path(path)) {
-        return false;
-    }
-    char* tmp = STRDUP(path);
-    if (!tmp) return false;
-
-    bool success = true;
-    char* p = tmp;
-
-    if (strlen(p) > 2) {
-        if (p[1] == ':') p += 2;
-        if (*p == '\\' || *p == '/') p++;
-    }
-
-    while ((p = strchr(p, PATH_SEPARATOR[0])) != NULL) {
-        *p = '\0';
-        if (strlen(tmp) > 0) {
-            if (MKDIR(tmp) != 0 && errno != EEXIST) {
-                success = false;
-                break;
-            }
-        }
-        *p = PATH_SEPARATOR[0];
-        p++;
-    }
-
-    if (success && strlen(tmp) > 0) {
-        if (MKDIR(tmp) != 0 && errno != EEXIST) {
-            success = false;
-        }
-    }
-
-    free(tmp);
-    return success;
-}
-
 static void convert_name_to_ascii(const uint16_t* utf16_name, int name_length, char* ascii_name, size_t ascii_buffer_size) {
     if (!ascii_name || ascii_buffer_size == 0) return;
     
@@ -110,16 +75,15 @@ static void convert_name_to_ascii(const uint16_t* utf16_name, int name_length, c
 
 static bool ntfs_read(NTFSContext* ctx, void* buffer, uint64_t offset, size_t size) {
     if (ctx->is_vhd) {
-        return vhd_read(&ctx->vhd, buffer, offset, size);
+        uint64_t start = stats_now();
+        bool ok = vhd_read(&ctx->vhd, buffer, offset, size);
+        stats_time(STAT_TIME_VHD_READ, start);
+        return ok;
     }
-    if (FSEEKO(ctx->raw.fp, offset, SEEK_SET) != 0) {
-        return false;
-    }
-    return fread(buffer, 1, size, ctx->raw.fp) == size;
+    return image_source_read(&ctx->raw.source, buffer, offset, size);
 }
 
-static bool apply_mft_fixups(const NTFSContext* ctx, uint8_t* record_buffer, size_t record_size) {
-    (void)ctx;
+static bool apply_update_sequence(uint8_t* record_buffer, size_t record_size) {
     if (!record_buffer || record_size < sizeof(MFTRecordHeader)) {
         return false;
     }
@@ -163,192 +127,214 @@ static bool apply_mft_fixups(const NTFSContext* ctx, uint8_t* record_buffer, siz
     return true;
 }
 
-static bool read_file_info(NTFSContext* ctx, uint64_t ref_number, FileInfo* info) {
-    memset(info, 0, sizeof(FileInfo));
+static bool apply_mft_fixups(const NTFSContext* ctx, uint8_t* record_buffer, size_t record_size) {
+    (void)ctx;
+    uint64_t start = stats_now();
+    bool ok = apply_update_sequence(record_buffer, record_size);
+    stats_time(STAT_TIME_MFT_FIXUPS, start);
+    return ok;
+}
 
-    uint64_t mft_offset = ctx->mft_offset + (ref_number * ctx->mft_record_size);
-    uint8_t* record_buffer = malloc(ctx->mft_record_size);
-    if (!record_buffer) {
+// Reads size bytes of the $MFT starting at byte position of the MFT itself,
+// following the extent map across fragments.
+static bool read_mft(NTFSContext* ctx, void* buffer, uint64_t position, size_t size) {
+    int low = 0;
+    int high = ctx->mft_extent_count - 1;
+    int index = -1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (ctx->mft_extents[mid].mft_offset <= position) {
+            index = mid;
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    if (index < 0) {
         return false;
     }
 
-    bool success = false;
-    if (ntfs_read(ctx, record_buffer, mft_offset, ctx->mft_record_size)) {
-        if (!apply_mft_fixups(ctx, record_buffer, ctx->mft_record_size)) {
-            free(record_buffer);
+    uint8_t* out = (uint8_t*)buffer;
+    while (size > 0) {
+        if (index >= ctx->mft_extent_count) {
+            return false;
+        }
+        const MftExtent* extent = &ctx->mft_extents[index];
+        uint64_t within = position - extent->mft_offset;
+        if (within >= extent->length) {
             return false;
         }
-        const MFTRecordHeader* record = (const MFTRecordHeader*)record_buffer;
-
-        if (memcmp(record->magic, "FILE", 4) == 0 && (record->flags & MFT_RECORD_IN_USE)) {
-            info->is_directory = (record->flags & MFT_RECORD_IS_DIRECTORY) != 0;
-
-            const uint8_t* attr = (const uint8_t*)record + record->attrs_offset;
-            while (attr < (const uint8_t*)record + record->bytes_used) {
-                const AttributeHeader* header = (const AttributeHeader*)attr;
-
-                if (header->type == 0xFFFFFFFF || header->length == 0) {
-                    break;
-                }
-
-                if (header->type == FILE_NAME_ATTR && !header->non_resident) {
-                    const FileNameAttribute* fname =
-                        (const FileNameAttribute*)(attr + header->data.resident.value_offset);
-
-                    if (fname->namespace != 2) {
-                        convert_name_to_ascii(fname->name, fname->name_length, info->name, sizeof(info->name));
-                        info->parent_ref = fname->parent_directory & 0xFFFFFFFFFFFF;
-                        info->valid = true;
-                        success = true;
-                        break;
-                    }
-                }
 
-                attr += header->length;
-            }
+        size_t chunk = (size < extent->length - within) ? size : (size_t)(extent->length - within);
+        if (!ntfs_read(ctx, out, extent->volume_offset + within, chunk)) {
+            return false;
         }
+        out += chunk;
+        position += chunk;
+        size -= chunk;
+        index++;
     }
-
-    free(record_buffer);
-    return success;
+    return true;
 }
 
-static bool init_directory_cache(DirectoryCache* cache) {
-    cache->capacity = 1024;
-    cache->count = 0;
-    cache->directories = malloc(cache->capacity * sizeof(DirectoryInfo));
-    if (!cache->directories) return false;
-
-    cache->directories[0].ref_number = 5;
-    cache->directories[0].path[0] = '\0';
-    cache->count = 1;
-    return true;
+#define DIRECTORY_CACHE_INITIAL_SLOTS 1024
+#define DIRECTORY_CACHE_INITIAL_ARENA (64 * 1024)
+
+static uint64_t directory_hash(uint64_t ref_number) {
+    uint64_t h = ref_number;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
 }
 
-static void free_directory_cache(DirectoryCache* cache) {
-    free(cache->directories);
-    cache->directories = NULL;
-    cache->capacity = 0;
-    cache->count = 0;
+// Returns the slot holding ref_number, or the free slot where it belongs.
+static DirectoryEntry* directory_slot(DirectoryCache* cache, uint64_t ref_number) {
+    size_t index = (size_t)directory_hash(ref_number) & cache->slot_mask;
+    uint64_t probes = 1;
+    while (cache->slots[index].ref_number != ref_number &&
+        cache->slots[index].ref_number != DIRECTORY_CACHE_FREE) {
+        index = (index + 1) & cache->slot_mask;
+        probes++;
+    }
+    stats_count(STAT_DIR_CACHE_PROBES, probes);
+    return &cache->slots[index];
 }
 
-static bool add_directory_to_cache(DirectoryCache* cache, uint64_t ref_number, const char* path) {
-    for (size_t i = 0; i < cache->count; i++) {
-        if (cache->directories[i].ref_number == ref_number) {
-            strncpy(cache->directories[i].path, path, MAX_PATH_LENGTH - 1);
-            cache->directories[i].path[MAX_PATH_LENGTH - 1] = '\0';
-            return true;
-        }
-    }
+static bool grow_directory_slots(DirectoryCache* cache) {
+    size_t old_count = cache->slot_mask + 1;
+    DirectoryEntry* old_slots = cache->slots;
 
-    if (cache->count >= cache->capacity) {
-        size_t new_capacity = cache->capacity * 2;
-        DirectoryInfo* new_dirs = realloc(cache->directories,
-            new_capacity * sizeof(DirectoryInfo));
-        if (!new_dirs) return false;
-        cache->directories = new_dirs;
-        cache->capacity = new_capacity;
+    size_t new_count = old_count * 2;
+    cache->slots = malloc(new_count * sizeof(DirectoryEntry));
+    if (!cache->slots) {
+        cache->slots = old_slots;
+        return false;
     }
-
-    if (cache->count < cache->capacity) {
-        cache->directories[cache->count].ref_number = ref_number;
-        strncpy(cache->directories[cache->count].path, path, MAX_PATH_LENGTH - 1);
-        cache->directories[cache->count].path[MAX_PATH_LENGTH - 1] = '\0';
-        cache->count++;
-        return true;
+    for (size_t i = 0; i < new_count; i++) {
+        cache->slots[i].ref_number = DIRECTORY_CACHE_FREE;
     }
+    cache->slot_mask = new_count - 1;
 
-    return false;
-}
-
-static const char* get_cached_path(DirectoryCache* cache, uint64_t ref_number) {
-    for (size_t i = 0; i < cache->count; i++) {
-        if (cache->directories[i].ref_number == ref_number) {
-            return cache->directories[i].path;
+    for (size_t i = 0; i < old_count; i++) {
+        if (old_slots[i].ref_number != DIRECTORY_CACHE_FREE) {
+            size_t index = (size_t)directory_hash(old_slots[i].ref_number) & cache->slot_mask;
+            while (cache->slots[index].ref_number != DIRECTORY_CACHE_FREE) {
+                index = (index + 1) & cache->slot_mask;
+            }
+            cache->slots[index] = old_slots[i];
         }
     }
-    return NULL;
+    free(old_slots);
+    return true;
 }
 
-static bool build_path_recursively(NTFSContext* ctx, uint64_t ref_number, char* buffer, size_t buffer_size) {
-    if (ref_number == 5) {
-        buffer[0] = '\0';
-        return true;
+// Copies path into the arena and returns its offset, or SIZE_MAX.
+static size_t intern_path(DirectoryCache* cache, const char* path) {
+    size_t length = strlen(path) + 1;
+    if (cache->arena_size + length > cache->arena_capacity) {
+        size_t new_capacity = cache->arena_capacity * 2;
+        while (cache->arena_size + length > new_capacity) {
+            new_capacity *= 2;
+        }
+        char* new_arena = realloc(cache->arena, new_capacity);
+        if (!new_arena) {
+            return SIZE_MAX;
+        }
+        cache->arena = new_arena;
+        cache->arena_capacity = new_capacity;
     }
 
-    const char* cached_path = get_cached_path(&ctx->dir_cache, ref_number);
-    if (cached_path) {
-        strncpy(buffer, cached_path, buffer_size - 1);
-        buffer[buffer_size - 1] = '\0';
-        return true;
-    }
+    size_t offset = cache->arena_size;
+    memcpy(cache->arena + offset, path, length);
+    cache->arena_size += length;
+    return offset;
+}
 
-    FileInfo info;
-    if (!read_file_info(ctx, ref_number, &info) || !info.valid) {
-        return false;
-    }
+static bool add_directory_to_cache(DirectoryCache* cache, uint64_t ref_number, const char* path);
 
-    if (info.name[0] == '$') {
+static bool init_directory_cache(DirectoryCache* cache) {
+    memset(cache, 0, sizeof(DirectoryCache));
+    cache->slots = malloc(DIRECTORY_CACHE_INITIAL_SLOTS * sizeof(DirectoryEntry));
+    cache->arena = malloc(DIRECTORY_CACHE_INITIAL_ARENA);
+    if (!cache->slots || !cache->arena) {
+        free(cache->slots);
+        free(cache->arena);
+        memset(cache, 0, sizeof(DirectoryCache));
         return false;
     }
+    for (size_t i = 0; i < DIRECTORY_CACHE_INITIAL_SLOTS; i++) {
+        cache->slots[i].ref_number = DIRECTORY_CACHE_FREE;
+    }
+    cache->slot_mask = DIRECTORY_CACHE_INITIAL_SLOTS - 1;
+    cache->arena_capacity = DIRECTORY_CACHE_INITIAL_ARENA;
 
-    char parent_path[MAX_PATH_LENGTH];
-    if (!build_path_recursively(ctx, info.parent_ref, parent_path, sizeof(parent_path))) {
+    // Record 5 is the root directory.
+    return add_directory_to_cache(cache, 5, "");
+}
+
+static void free_directory_cache(DirectoryCache* cache) {
+    free(cache->slots);
+    free(cache->arena);
+    memset(cache, 0, sizeof(DirectoryCache));
+}
+
+static bool add_directory_to_cache(DirectoryCache* cache, uint64_t ref_number, const char* path) {
+    // Keep the table at most 3/4 full so probe sequences stay short.
+    if ((cache->count + 1) * 4 > (cache->slot_mask + 1) * 3 && !grow_directory_slots(cache)) {
         return false;
     }
 
-    if (parent_path[0] == '\0') {
-        strncpy(buffer, info.name, buffer_size - 1);
-    }
-    else {
-        snprintf(buffer, buffer_size, "%s%s%s", parent_path, PATH_SEPARATOR, info.name);
+    size_t offset = intern_path(cache, path);
+    if (offset == SIZE_MAX) {
+        return false;
     }
-    buffer[buffer_size - 1] = '\0';
 
-    if (info.is_directory) {
-        add_directory_to_cache(&ctx->dir_cache, ref_number, buffer);
+    DirectoryEntry* entry = directory_slot(cache, ref_number);
+    if (entry->ref_number == DIRECTORY_CACHE_FREE) {
+        entry->ref_number = ref_number;
+        cache->count++;
     }
-
+    entry->path_offset = offset;
     return true;
 }
 
-static void get_full_path(NTFSContext* ctx, uint64_t parent_ref, const char* name,
-    char* out_path, size_t out_size) {
-    char parent_path[MAX_PATH_LENGTH];
-
-    if (!build_path_recursively(ctx, parent_ref, parent_path, sizeof(parent_path))) {
-        snprintf(out_path, out_size, "%s%s%s",
-            ctx->base_path,
-            PATH_SEPARATOR,
-            name);
-        return;
-    }
-
-    if (parent_path[0] == '\0') {
-        snprintf(out_path, out_size, "%s%s%s",
-            ctx->base_path,
-            PATH_SEPARATOR,
-            name);
-    }
-    else {
-        snprintf(out_path, out_size, "%s%s%s%s%s",
-            ctx->base_path,
-            PATH_SEPARATOR,
-            parent_path,
-            PATH_SEPARATOR,
-            name);
+// The returned path is only valid until the next add_directory_to_cache().
+static const char* get_cached_path(DirectoryCache* cache, uint64_t ref_number) {
+    const DirectoryEntry* entry = directory_slot(cache, ref_number);
+    if (entry->ref_number == DIRECTORY_CACHE_FREE) {
+        return NULL;
     }
+    return cache->arena + entry->path_offset;
 }
 
-static bool extract_data_from_runs(NTFSContext* ctx, const DataRun* runs, int run_count,
-    uint64_t data_size, FILE* out_file) {
-    uint8_t* temp_buffer = malloc(BUFFER_SIZE);
-    if (!temp_buffer) return false;
-
+typedef struct {
+    NTFSContext* ctx;
+    const DataRun* runs;
+    int run_count;
+    uint64_t data_size;
+} RunStream;
+
+typedef struct {
+    const uint8_t* data;
+    uint32_t size;
+} ResidentStream;
+
+// Sparse runs are handed to the sink as holes without reading anything, so
+// a file that is sparse throughout never touches the image.
+static bool extract_data_from_runs(void* context, ExtractSink* sink, SinkFile* out_file) {
+    const RunStream* stream = (const RunStream*)context;
+    NTFSContext* ctx = stream->ctx;
+    const DataRun* runs = stream->runs;
+    int run_count = stream->run_count;
+    uint64_t data_size = stream->data_size;
+
+    uint8_t* temp_buffer = NULL;
     uint64_t total_written = 0;
     bool success = true;
 
-    for (int i = 0; i < run_count && total_written < data_size; i++) {
+    for (int i = 0; i < run_count && total_written < data_size && success; i++) {
         uint64_t cluster_offset = ctx->data_start_offset +
             (runs[i].offset * ctx->bytes_per_cluster);
         uint64_t length = runs[i].length * ctx->bytes_per_cluster;
@@ -357,6 +343,18 @@ static bool extract_data_from_runs(NTFSContext* ctx, const DataRun* runs, int ru
             length = data_size - total_written;
         }
 
+        if (runs[i].sparse) {
+            success = sink_skip_file(sink, out_file, length);
+            total_written += length;
+            continue;
+        }
+        if (!temp_buffer) {
+            temp_buffer = malloc(BUFFER_SIZE);
+            if (!temp_buffer) {
+                return false;
+            }
+        }
+
         uint64_t remaining = length;
         while (remaining > 0 && success) {
             size_t to_read = (remaining > BUFFER_SIZE) ? BUFFER_SIZE : (size_t)remaining;
@@ -366,7 +364,7 @@ static bool extract_data_from_runs(NTFSContext* ctx, const DataRun* runs, int ru
                 break;
             }
 
-            if (fwrite(temp_buffer, 1, to_read, out_file) != to_read) {
+            if (!sink_write_file(sink, out_file, temp_buffer, to_read)) {
                 success = false;
                 break;
             }
@@ -378,26 +376,37 @@ static bool extract_data_from_runs(NTFSContext* ctx, const DataRun* runs, int ru
     }
 
     free(temp_buffer);
-    return success;
+    // Runs that cover less than the data size would leave the file short.
+    return success && total_written == data_size;
 }
 
-static int parse_data_runs(const uint8_t* run_list, DataRun* runs, int max_runs) {
+static bool extract_resident_data(void* context, ExtractSink* sink, SinkFile* out_file) {
+    const ResidentStream* stream = (const ResidentStream*)context;
+    return sink_write_file(sink, out_file, stream->data, stream->size);
+}
+
+// Decodes the mapping pairs between run_list and end. A pair that is larger
+// than 8 bytes or runs past end stops the list there.
+static int parse_data_runs(const uint8_t* run_list, const uint8_t* end, DataRun* runs, int max_runs) {
     int count = 0;
     uint64_t offset_base = 0;
     const uint8_t* p = run_list;
 
-    while (*p != 0 && count < max_runs) {
+    while (p < end && *p != 0 && count < max_runs) {
         uint8_t header = *p++;
         int length_size = header & 0xF;
         int offset_size = header >> 4;
 
-        if (length_size == 0) break;
+        if (length_size == 0 || length_size > 8 || offset_size > 8) break;
+        if (length_size + offset_size > end - p) break;
 
         uint64_t length = 0;
         for (int i = 0; i < length_size; i++) {
             length |= ((uint64_t)*p++) << (i * 8);
         }
 
+        // Without an offset the run is sparse and the next run's offset is
+        // still relative to the last allocated one.
         int64_t offset = 0;
         if (offset_size > 0) {
             for (int i = 0; i < offset_size; i++) {
@@ -409,82 +418,70 @@ static int parse_data_runs(const uint8_t* run_list, DataRun* runs, int max_runs)
         }
 
         offset_base += offset;
-        runs[count].offset = offset_base;
+        runs[count].offset = (offset_size > 0) ? offset_base : 0;
         runs[count].length = length;
+        runs[count].sparse = (offset_size == 0);
         count++;
     }
 
     return count;
 }
 
-static bool extract_file(NTFSContext* ctx, const MFTRecordHeader* record,
-    const char* full_path) {
-    char parent_path[MAX_PATH_LENGTH];
-    strncpy(parent_path, full_path, sizeof(parent_path) - 1);
-    parent_path[sizeof(parent_path) - 1] = '\0';
-
-    char* last_separator = strrchr(parent_path, PATH_SEPARATOR[0]);
-    if (last_separator) {
-        *last_separator = '\0';
-        create_directories(parent_path);
+// Makes room for needed more elements of size bytes in *array.
+static bool reserve(void** array, size_t* capacity, size_t used, size_t needed, size_t size) {
+    if (used + needed <= *capacity) {
+        return true;
     }
-
-    FILE* out_file = fopen(full_path, "wb");
-    if (!out_file) {
-        printf("Failed to create file: %s\n", full_path);
+    size_t new_capacity = *capacity ? *capacity * 2 : 1024;
+    while (used + needed > new_capacity) {
+        new_capacity *= 2;
+    }
+    void* grown = realloc(*array, new_capacity * size);
+    if (!grown) {
         return false;
     }
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
 
-    bool success = false;
-    const uint8_t* attr = (const uint8_t*)record + record->attrs_offset;
-
-    while (attr < (const uint8_t*)record + record->bytes_used) {
-        const AttributeHeader* header = (const AttributeHeader*)attr;
-
-        if (header->type == 0xFFFFFFFF || header->length == 0) {
-            break;
-        }
-
-        if (header->type == DATA_ATTR && header->name_length == 0) {
-            if (header->non_resident) {
-                DataRun runs[256];
-                const uint8_t* run_list = attr + header->data.non_resident.mapping_pairs_offset;
-                int run_count = parse_data_runs(run_list, runs, 256);
-
-                success = extract_data_from_runs(ctx, runs, run_count,
-                    header->data.non_resident.data_size,
-                    out_file);
-            }
-            else {
-                const uint8_t* data = attr + header->data.resident.value_offset;
-                success = (fwrite(data, 1, header->data.resident.value_length, out_file) ==
-                    header->data.resident.value_length);
-            }
-            break;
-        }
-
-        attr += header->length;
+static bool index_bytes(NtfsIndex* index, const void* data, size_t size, size_t* offset) {
+    if (!reserve((void**)&index->bytes, &index->bytes_capacity, index->bytes_size, size, 1)) {
+        return false;
     }
+    *offset = index->bytes_size;
+    memcpy(index->bytes + index->bytes_size, data, size);
+    index->bytes_size += size;
+    return true;
+}
 
-    fclose(out_file);
-    if (!success) {
-        remove(full_path);
-    }
-    return success;
+static void free_index(NtfsIndex* index) {
+    free(index->entries);
+    free(index->runs);
+    free(index->bytes);
+    memset(index, 0, sizeof(NtfsIndex));
 }
 
-static bool process_mft_record(NTFSContext* ctx, const uint8_t* record_data) {
+// Adds a directory or a file with its data runs or resident data to the
+// index. Records that are not extracted (system files, the root, unsafe
+// names, files without a $DATA attribute) are left out. Returns false only
+// when memory runs out. record_num is the record's position in the MFT;
+// NTFS 3.0 records do not carry their own number.
+static bool index_mft_record(NTFSContext* ctx, NtfsIndex* index, const uint8_t* record_data, uint64_t record_num) {
     const MFTRecordHeader* record = (const MFTRecordHeader*)record_data;
 
     if (memcmp(record->magic, "FILE", 4) != 0 || !(record->flags & MFT_RECORD_IN_USE)) {
         return true;
     }
 
+    NtfsIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.record_num = record_num;
+    entry.is_directory = (record->flags & MFT_RECORD_IS_DIRECTORY) != 0;
+
     char filename[MAX_FILENAME_LENGTH];
-    uint64_t parent_ref = 0;
     bool got_filename = false;
-    bool is_directory = (record->flags & MFT_RECORD_IS_DIRECTORY) != 0;
-    uint64_t record_num = record->record_number & 0xFFFFFFFFFFFF;
+    const AttributeHeader* data = NULL;
 
     const uint8_t* attr = (const uint8_t*)record + record->attrs_offset;
     while (attr < (const uint8_t*)record + record->bytes_used) {
@@ -494,57 +491,378 @@ static bool process_mft_record(NTFSContext* ctx, const uint8_t* record_data) {
             break;
         }
 
-        if (header->type == FILE_NAME_ATTR && !header->non_resident) {
+        if (header->type == FILE_NAME_ATTR && !header->non_resident && !got_filename) {
             const FileNameAttribute* fname =
                 (const FileNameAttribute*)(attr + header->data.resident.value_offset);
 
             if (fname->namespace != 2) {
                 convert_name_to_ascii(fname->name, fname->name_length, filename, sizeof(filename));
-                parent_ref = fname->parent_directory & 0xFFFFFFFFFFFF;
+                entry.parent_ref = fname->parent_directory & 0xFFFFFFFFFFFF;
+                entry.mtime = fname->modification_time;
                 got_filename = true;
-                break;
             }
         }
+        else if (header->type == DATA_ATTR && header->name_length == 0 && !data) {
+            data = header;
+        }
 
         attr += header->length;
     }
 
-    if (!got_filename || filename[0] == '$') {
+    // "." is the root directory, which the sink already created.
+    if (!got_filename || filename[0] == '\0' || filename[0] == '$' || strcmp(filename, ".") == 0 ||
+        !is_safe_path(filename)) {
         return true;
     }
-    
-    if (!is_safe_path(filename)) {
+
+    if (!entry.is_directory) {
+        if (!data) {
+            return true;
+        }
+
+        if (data->non_resident && data->data.non_resident.compression_unit != 0) {
+            // Runs without an offset are compression unit padding here, not
+            // holes, and the other runs hold compressed clusters.
+            entry.is_compressed = true;
+            entry.size = data->data.non_resident.data_size;
+        }
+        else if (data->non_resident) {
+            const uint8_t* run_list = (const uint8_t*)data + data->data.non_resident.mapping_pairs_offset;
+            const uint8_t* record_end = record_data + ctx->mft_record_size;
+            const uint8_t* run_end = (data->length > record_end - (const uint8_t*)data) ?
+                record_end : (const uint8_t*)data + data->length;
+            // Every pair takes at least two bytes.
+            size_t max_runs = (run_list < run_end) ? (size_t)(run_end - run_list) / 2 : 0;
+            if (!reserve((void**)&index->runs, &index->run_capacity, index->run_count,
+                max_runs, sizeof(DataRun))) {
+                return false;
+            }
+            DataRun* runs = index->runs + index->run_count;
+            entry.run_count = (uint32_t)parse_data_runs(run_list, run_end, runs, (int)max_runs);
+            entry.data_offset = index->run_count;
+            entry.size = data->data.non_resident.data_size;
+            for (uint32_t i = 0; i < entry.run_count; i++) {
+                if (!runs[i].sparse) {
+                    entry.first_offset = ctx->data_start_offset + runs[i].offset * ctx->bytes_per_cluster;
+                    break;
+                }
+            }
+            index->run_count += entry.run_count;
+        }
+        else {
+            entry.is_resident = true;
+            uint32_t value_offset = data->data.resident.value_offset;
+            uint32_t value_length = data->data.resident.value_length;
+            if ((uint64_t)value_offset + value_length > data->length) {
+                return true;
+            }
+            if (!index_bytes(index, (const uint8_t*)data + value_offset, value_length, &entry.data_offset)) {
+                return false;
+            }
+            entry.size = value_length;
+        }
+    }
+
+    if (!index_bytes(index, filename, strlen(filename) + 1, &entry.name_offset) ||
+        !reserve((void**)&index->entries, &index->capacity, index->count, 1, sizeof(NtfsIndexEntry))) {
+        return false;
+    }
+    index->entries[index->count++] = entry;
+    return true;
+}
+
+// Entries are added in record order, so they can be looked up by binary search.
+static const NtfsIndexEntry* find_index_entry(const NtfsIndex* index, uint64_t record_num) {
+    size_t low = 0;
+    size_t high = index->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (index->entries[mid].record_num < record_num) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    if (low < index->count && index->entries[low].record_num == record_num) {
+        return &index->entries[low];
+    }
+    return NULL;
+}
+
+// Path of the directory ref_number below the volume root, from the index.
+// Each directory is resolved once and then served from ctx->dir_cache.
+// Fails for a directory that is not in the index; like get_full_path(), a
+// directory whose own parent cannot be resolved goes in the root.
+static bool resolve_directory(NTFSContext* ctx, const NtfsIndex* index, uint64_t ref_number,
+    char* buffer, size_t buffer_size, int depth) {
+    const char* cached_path = get_cached_path(&ctx->dir_cache, ref_number);
+    stats_count(cached_path ? STAT_DIR_CACHE_HITS : STAT_DIR_CACHE_MISSES, 1);
+    if (cached_path) {
+        strncpy(buffer, cached_path, buffer_size - 1);
+        buffer[buffer_size - 1] = '\0';
         return true;
     }
 
-    char full_path[MAX_PATH_LENGTH];
-    get_full_path(ctx, parent_ref, filename, full_path, sizeof(full_path));
+    const NtfsIndexEntry* entry = find_index_entry(index, ref_number);
+    if (!entry || depth >= MAX_PATH_LENGTH / 2) {
+        return false;
+    }
 
-    if (is_directory) {
-        if (!create_directories(full_path)) {
-            printf("Failed to create directory: %s\n", full_path);
-            return false;
+    char parent_path[MAX_PATH_LENGTH];
+    if (!resolve_directory(ctx, index, entry->parent_ref, parent_path, sizeof(parent_path), depth + 1)) {
+        parent_path[0] = '\0';
+    }
+
+    const char* name = (const char*)index->bytes + entry->name_offset;
+    if (parent_path[0] == '\0') {
+        strncpy(buffer, name, buffer_size - 1);
+    }
+    else {
+        snprintf(buffer, buffer_size, "%s%s%s", parent_path, PATH_SEPARATOR, name);
+    }
+    buffer[buffer_size - 1] = '\0';
+
+    return add_directory_to_cache(&ctx->dir_cache, ref_number, buffer);
+}
+
+// Path of entry below the volume root, or just its name when its parent
+// cannot be resolved.
+static void get_full_path(NTFSContext* ctx, const NtfsIndex* index, const NtfsIndexEntry* entry,
+    char* out_path, size_t out_size) {
+    const char* name = (const char*)index->bytes + entry->name_offset;
+    char parent_path[MAX_PATH_LENGTH];
+
+    if (!resolve_directory(ctx, index, entry->parent_ref, parent_path, sizeof(parent_path), 0) ||
+        parent_path[0] == '\0') {
+        snprintf(out_path, out_size, "%s", name);
+        return;
+    }
+
+    snprintf(out_path, out_size, "%s%s%s", parent_path, PATH_SEPARATOR, name);
+}
+
+static bool extract_file(NTFSContext* ctx, const NtfsIndex* index, const NtfsIndexEntry* entry,
+    const char* full_path) {
+    if (entry->is_compressed) {
+        log_printf("Compressed files are not supported: %s\n", full_path);
+        return false;
+    }
+    if (!entry->is_resident) {
+        RunStream stream;
+        stream.ctx = ctx;
+        stream.runs = index->runs + entry->data_offset;
+        stream.run_count = (int)entry->run_count;
+        stream.data_size = entry->size;
+        return sink_extract_file(ctx->sink, full_path, entry->size, entry->mtime,
+            extract_data_from_runs, &stream);
+    }
+
+    ResidentStream stream;
+    stream.data = index->bytes + entry->data_offset;
+    stream.size = (uint32_t)entry->size;
+    return sink_extract_file(ctx->sink, full_path, entry->size, entry->mtime,
+        extract_resident_data, &stream);
+}
+
+typedef struct {
+    uint64_t first_offset;
+    size_t entry;           // position in the index, which is record order
+} ExtractOrder;
+
+static int compare_extract_order(const void* a, const void* b) {
+    const ExtractOrder* left = (const ExtractOrder*)a;
+    const ExtractOrder* right = (const ExtractOrder*)b;
+    if (left->first_offset != right->first_offset) {
+        return (left->first_offset < right->first_offset) ? -1 : 1;
+    }
+    return (left->entry < right->entry) ? -1 : (left->entry > right->entry);
+}
+
+static bool vhd_read_at(VHDContext* ctx, void* buffer, uint64_t offset, size_t size) {
+    if (!file_read_at(ctx->fp, buffer, offset, size)) {
+        return false;
+    }
+    stats_count(STAT_BYTES_READ, size);
+    return true;
+}
+
+static bool vhd_cache_init(VHDBlockCache* cache, size_t capacity_bytes, uint32_t block_size) {
+    memset(cache, 0, sizeof(VHDBlockCache));
+
+    size_t capacity = capacity_bytes / block_size;
+    if (capacity_bytes > 0 && capacity == 0) {
+        capacity = 1;
+    }
+    if (capacity == 0) {
+        mutex_init(&cache->mutex);
+        return true;
+    }
+
+    size_t bitmap_bytes = block_size / VHD_SECTOR_SIZE / 8;
+    cache->blocks = calloc(capacity, sizeof(VHDCacheBlock));
+    cache->data = malloc(capacity * block_size);
+    cache->loaded = malloc(capacity * bitmap_bytes);
+    if (!cache->blocks || !cache->data || !cache->loaded) {
+        free(cache->blocks);
+        free(cache->data);
+        free(cache->loaded);
+        memset(cache, 0, sizeof(VHDBlockCache));
+        return false;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        cache->blocks[i].data = cache->data + i * block_size;
+        cache->blocks[i].loaded = cache->loaded + i * bitmap_bytes;
+    }
+    cache->capacity = capacity;
+    mutex_init(&cache->mutex);
+    return true;
+}
+
+static void vhd_cache_close(VHDBlockCache* cache) {
+    mutex_destroy(&cache->mutex);
+    free(cache->blocks);
+    free(cache->data);
+    free(cache->loaded);
+    memset(cache, 0, sizeof(VHDBlockCache));
+}
+
+static void vhd_cache_unlink(VHDBlockCache* cache, VHDCacheBlock* block) {
+    if (block->lru_prev) block->lru_prev->lru_next = block->lru_next;
+    else cache->lru_head = block->lru_next;
+    if (block->lru_next) block->lru_next->lru_prev = block->lru_prev;
+    else cache->lru_tail = block->lru_prev;
+    block->lru_prev = NULL;
+    block->lru_next = NULL;
+}
+
+static void vhd_cache_push_front(VHDBlockCache* cache, VHDCacheBlock* block) {
+    block->lru_prev = NULL;
+    block->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = block;
+    cache->lru_head = block;
+    if (!cache->lru_tail) cache->lru_tail = block;
+}
+
+// Returns the cache slot of block_idx, taking over the least recently used
+// slot (with nothing loaded) when the block is not cached. The cache holds
+// few blocks and reads mostly hit the head, so a list walk is enough. The
+// caller holds cache->mutex.
+static VHDCacheBlock* vhd_cache_get(VHDBlockCache* cache, uint32_t block_idx, uint32_t block_size) {
+    VHDCacheBlock* block = cache->lru_head;
+    while (block && block->block_idx != block_idx) {
+        block = block->lru_next;
+    }
+
+    if (block) {
+        if (cache->lru_head != block) {
+            vhd_cache_unlink(cache, block);
+            vhd_cache_push_front(cache, block);
         }
+        return block;
+    }
+
+    if (cache->used < cache->capacity) {
+        block = &cache->blocks[cache->used++];
+    }
+    else {
+        block = cache->lru_tail;
+        vhd_cache_unlink(cache, block);
+        cache->evictions++;
+    }
+
+    block->block_idx = block_idx;
+    memset(block->loaded, 0, block_size / VHD_SECTOR_SIZE / 8);
+    vhd_cache_push_front(cache, block);
+    return block;
+}
 
-        const char* relative_path = full_path + strlen(ctx->base_path);
-        while (*relative_path == PATH_SEPARATOR[0]) relative_path++;
+static bool sector_loaded(const VHDCacheBlock* block, uint32_t sector) {
+    return (block->loaded[sector / 8] >> (sector % 8)) & 1;
+}
 
-        if (!add_directory_to_cache(&ctx->dir_cache, record_num, relative_path)) {
-            printf("Failed to cache directory: %s\n", filename);
+// Copies size bytes at block_offset of an allocated block into buffer.
+// data_offset is where the block's data starts in the file. On a miss the
+// sectors from the first to the last one never read before are read in one
+// go. The file is read without holding the cache lock, so other threads go on
+// meanwhile and the block may even be evicted; what the request needs is
+// kept in a buffer of its own until the sectors are put back in the cache.
+static bool vhd_read_block(VHDContext* ctx, uint32_t block_idx, uint64_t data_offset,
+    uint32_t block_offset, void* buffer, size_t size) {
+    VHDBlockCache* cache = &ctx->cache;
+    if (cache->capacity == 0) {
+        if (!vhd_read_at(ctx, buffer, data_offset + block_offset, size)) {
             return false;
         }
+        mutex_lock(&cache->mutex);
+        cache->bytes_read += size;
+        mutex_unlock(&cache->mutex);
         return true;
     }
 
-    return extract_file(ctx, record, full_path);
+    uint32_t block_size = ctx->dyn_header.block_size;
+    uint32_t first = block_offset / VHD_SECTOR_SIZE;
+    uint32_t last = (uint32_t)((block_offset + size - 1) / VHD_SECTOR_SIZE);
+    uint64_t span_offset = (uint64_t)first * VHD_SECTOR_SIZE;
+    size_t span_size = (size_t)(last - first + 1) * VHD_SECTOR_SIZE;
+
+    mutex_lock(&cache->mutex);
+    VHDCacheBlock* block = vhd_cache_get(cache, block_idx, block_size);
+    uint32_t first_missing = last + 1;
+    uint32_t last_missing = first;
+    for (uint32_t sector = first; sector <= last; sector++) {
+        if (!sector_loaded(block, sector)) {
+            first_missing = (sector < first_missing) ? sector : first_missing;
+            last_missing = sector;
+        }
+    }
+
+    if (first_missing > last) {
+        memcpy(buffer, block->data + block_offset, size);
+        cache->hits++;
+        mutex_unlock(&cache->mutex);
+        stats_count(STAT_VHD_CACHE_HITS, 1);
+        return true;
+    }
+
+    uint8_t* span = malloc(span_size);
+    if (!span) {
+        mutex_unlock(&cache->mutex);
+        return false;
+    }
+    memcpy(span, block->data + span_offset, span_size);
+    mutex_unlock(&cache->mutex);
+
+    uint64_t read_offset = (uint64_t)first_missing * VHD_SECTOR_SIZE;
+    size_t read_size = (size_t)(last_missing - first_missing + 1) * VHD_SECTOR_SIZE;
+    if (!vhd_read_at(ctx, span + (read_offset - span_offset), data_offset + read_offset, read_size)) {
+        free(span);
+        return false;
+    }
+
+    mutex_lock(&cache->mutex);
+    block = vhd_cache_get(cache, block_idx, block_size);
+    for (uint32_t sector = first; sector <= last; sector++) {
+        if (!sector_loaded(block, sector)) {
+            memcpy(block->data + (uint64_t)sector * VHD_SECTOR_SIZE,
+                span + (size_t)(sector - first) * VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+            block->loaded[sector / 8] |= (uint8_t)(1 << (sector % 8));
+        }
+    }
+    cache->misses++;
+    cache->bytes_read += read_size;
+    mutex_unlock(&cache->mutex);
+    stats_count(STAT_VHD_CACHE_MISSES, 1);
+
+    memcpy(buffer, span + (block_offset - span_offset), size);
+    free(span);
+    return true;
 }
 
 static bool vhd_read(VHDContext* ctx, void* buffer, uint64_t offset, size_t size) {
     if (ctx->footer.disk_type == VHD_TYPE_FIXED) {
-        if (FSEEKO(ctx->fp, offset, SEEK_SET) != 0) {
-            return false;
-        }
-        return fread(buffer, 1, size, ctx->fp) == size;
+        return vhd_read_at(ctx, buffer, offset, size);
     }
     else if (ctx->footer.disk_type == VHD_TYPE_DYNAMIC) {
         uint8_t* buf = (uint8_t*)buffer;
@@ -558,67 +876,57 @@ static bool vhd_read(VHDContext* ctx, void* buffer, uint64_t offset, size_t size
                 return false;
             }
 
+            size_t chunk = (size < (block_size - block_offset)) ?
+                size : (size_t)(block_size - block_offset);
+
             uint32_t bat_entry = ctx->bat[block_idx];
             if (bat_entry == VHD_BAT_ENTRY_RESERVED) {
-                size_t chunk = (size < (block_size - block_offset)) ?
-                    size : (size_t)(block_size - block_offset);
                 memset(buf, 0, chunk);
-                buf += chunk;
-                offset += chunk;
-                size -= chunk;
             }
             else {
-                uint64_t sector_offset = ((uint64_t)bat_entry) * VHD_SECTOR_SIZE;
-
-                if (FSEEKO(ctx->fp, sector_offset, SEEK_SET) != 0) {
+                // The block's data follows its sector bitmap.
+                uint64_t data_offset = ((uint64_t)bat_entry) * VHD_SECTOR_SIZE + ctx->sector_bitmap_size;
+                if (!vhd_read_block(ctx, block_idx, data_offset, block_offset, buf, chunk)) {
                     return false;
                 }
-
-                if (fread(ctx->sector_bitmap, 1, ctx->sector_bitmap_size, ctx->fp)
-                    != ctx->sector_bitmap_size) {
-                    return false;
-                }
-
-                if (fread(ctx->block_buffer, 1, block_size, ctx->fp) != block_size) {
-                    return false;
-                }
-
-                size_t chunk = (size < (block_size - block_offset)) ?
-                    size : (size_t)(block_size - block_offset);
-                memcpy(buf, ctx->block_buffer + block_offset, chunk);
-                buf += chunk;
-                offset += chunk;
-                size -= chunk;
             }
+            buf += chunk;
+            offset += chunk;
+            size -= chunk;
         }
         return true;
     }
     return false;
 }
 
-static bool vhd_init(VHDContext* ctx, const char* filename) {
+static bool vhd_init(VHDContext* ctx, const char* filename, size_t cache_bytes) {
     memset(ctx, 0, sizeof(VHDContext));
 
     ctx->fp = fopen(filename, "rb");
     if (!ctx->fp) {
-        printf("Failed to open file: %s\n", filename);
+        log_printf("Failed to open file: %s\n", filename);
         return false;
     }
 
-    if (FSEEKO(ctx->fp, -((int64_t)VHD_FOOTER_SIZE), SEEK_END) != 0) {
-        printf("Failed to seek to VHD footer\n");
+    int64_t file_size = -1;
+    if (FSEEKO(ctx->fp, 0, SEEK_END) == 0) {
+        file_size = (int64_t)FTELLO(ctx->fp);
+    }
+    if (file_size < VHD_FOOTER_SIZE) {
+        log_printf("Failed to seek to VHD footer\n");
         fclose(ctx->fp);
         return false;
     }
 
-    if (fread(&ctx->footer, 1, sizeof(VHDFooter), ctx->fp) != sizeof(VHDFooter)) {
-        printf("Failed to read VHD footer\n");
+    // From here on the file is only read positionally, see file_read_at().
+    if (!file_read_at(ctx->fp, &ctx->footer, (uint64_t)file_size - VHD_FOOTER_SIZE, sizeof(VHDFooter))) {
+        log_printf("Failed to read VHD footer\n");
         fclose(ctx->fp);
         return false;
     }
 
     if (memcmp(ctx->footer.cookie, VHD_COOKIE, strlen(VHD_COOKIE)) != 0) {
-        printf("Invalid VHD signature\n");
+        log_printf("Invalid VHD signature\n");
         fclose(ctx->fp);
         return false;
     }
@@ -637,20 +945,14 @@ static bool vhd_init(VHDContext* ctx, const char* filename) {
     ctx->footer.checksum = swap32(ctx->footer.checksum);
 
     if (ctx->footer.disk_type == VHD_TYPE_DYNAMIC) {
-        if (FSEEKO(ctx->fp, ctx->footer.data_offset, SEEK_SET) != 0) {
-            printf("Failed to seek to dynamic header\n");
-            fclose(ctx->fp);
-            return false;
-        }
-
-        if (fread(&ctx->dyn_header, 1, sizeof(VHDDynamicHeader), ctx->fp) != sizeof(VHDDynamicHeader)) {
-            printf("Failed to read dynamic header\n");
+        if (!file_read_at(ctx->fp, &ctx->dyn_header, ctx->footer.data_offset, sizeof(VHDDynamicHeader))) {
+            log_printf("Failed to read dynamic header\n");
             fclose(ctx->fp);
             return false;
         }
 
         if (memcmp(ctx->dyn_header.cookie, VHD_DYNAMIC_COOKIE, strlen(VHD_DYNAMIC_COOKIE)) != 0) {
-            printf("Invalid dynamic disk header signature\n");
+            log_printf("Invalid dynamic disk header signature\n");
             fclose(ctx->fp);
             return false;
         }
@@ -664,45 +966,44 @@ static bool vhd_init(VHDContext* ctx, const char* filename) {
         size_t bat_size = (size_t)ctx->dyn_header.max_bat_entries * sizeof(uint32_t);
 
         if (bat_size == 0 || bat_size > (1ULL << 30)) {
-            printf("Invalid BAT size\n");
+            log_printf("Invalid BAT size\n");
             fclose(ctx->fp);
             return false;
         }
 
         ctx->bat = malloc(bat_size);
         if (!ctx->bat) {
-            printf("Failed to allocate BAT memory\n");
+            log_printf("Failed to allocate BAT memory\n");
             fclose(ctx->fp);
             return false;
         }
 
-        if (FSEEKO(ctx->fp, ctx->dyn_header.bat_offset, SEEK_SET) != 0) {
-            printf("Failed to seek to BAT\n");
+        if (!file_read_at(ctx->fp, ctx->bat, ctx->dyn_header.bat_offset, bat_size)) {
+            log_printf("Failed to read BAT\n");
             free(ctx->bat);
             fclose(ctx->fp);
             return false;
         }
 
-        if (fread(ctx->bat, 1, bat_size, ctx->fp) != bat_size) {
-            printf("Failed to read BAT\n");
+        for (uint32_t i = 0; i < ctx->dyn_header.max_bat_entries; i++) {
+            ctx->bat[i] = swap32(ctx->bat[i]);
+        }
+
+        uint32_t block_size = ctx->dyn_header.block_size;
+        if (block_size < VHD_SECTOR_SIZE * 8 || block_size % (VHD_SECTOR_SIZE * 8) != 0) {
+            log_printf("Invalid VHD block size: %u\n", block_size);
             free(ctx->bat);
             fclose(ctx->fp);
             return false;
         }
 
-        for (uint32_t i = 0; i < ctx->dyn_header.max_bat_entries; i++) {
-            ctx->bat[i] = swap32(ctx->bat[i]);
-        }
-
-        ctx->sector_bitmap_size = (ctx->dyn_header.block_size / VHD_SECTOR_SIZE + 7) / 8;
-        ctx->sector_bitmap = malloc(ctx->sector_bitmap_size);
-        ctx->block_buffer = malloc(ctx->dyn_header.block_size);
+        // The sector bitmap in front of each block is padded to whole sectors.
+        ctx->sector_bitmap_size = (block_size / VHD_SECTOR_SIZE / 8 + VHD_SECTOR_SIZE - 1) /
+            VHD_SECTOR_SIZE * VHD_SECTOR_SIZE;
 
-        if (!ctx->sector_bitmap || !ctx->block_buffer) {
-            printf("Failed to allocate dynamic disk buffers\n");
+        if (!vhd_cache_init(&ctx->cache, cache_bytes, block_size)) {
+            log_printf("Failed to allocate dynamic disk buffers\n");
             free(ctx->bat);
-            free(ctx->sector_bitmap);
-            free(ctx->block_buffer);
             fclose(ctx->fp);
             return false;
         }
@@ -711,39 +1012,98 @@ static bool vhd_init(VHDContext* ctx, const char* filename) {
     return true;
 }
 
-bool ntfs_init(NTFSContext* ctx, const char* path, const char* extract_path) {
+static bool ntfs_open_volume(NTFSContext* ctx);
+
+// Turns the mapping pairs of the $MFT's $DATA into ctx->mft_extents. Only
+// records the runs actually cover are scanned, in case the run list is
+// shorter than the data size claims.
+static bool build_mft_extents(NTFSContext* ctx, const uint8_t* run_list, const uint8_t* end) {
+    if (run_list >= end) {
+        return false;
+    }
+
+    // Every pair takes at least two bytes, which bounds the extent count by
+    // the size of record 0.
+    int capacity = (int)((end - run_list) / 2) + 1;
+    DataRun* runs = malloc((size_t)capacity * sizeof(DataRun));
+    if (!runs) {
+        return false;
+    }
+    int run_count = parse_data_runs(run_list, end, runs, capacity);
+
+    ctx->mft_extents = malloc((size_t)(run_count > 0 ? run_count : 1) * sizeof(MftExtent));
+    if (!ctx->mft_extents) {
+        free(runs);
+        return false;
+    }
+
+    uint64_t mapped = 0;
+    // The $MFT is never sparse; records past a sparse run would be garbage.
+    for (int i = 0; i < run_count && mapped < ctx->mft_data_size && !runs[i].sparse; i++) {
+        MftExtent* extent = &ctx->mft_extents[ctx->mft_extent_count++];
+        extent->mft_offset = mapped;
+        extent->volume_offset = ctx->data_start_offset + runs[i].offset * ctx->bytes_per_cluster;
+        extent->length = runs[i].length * ctx->bytes_per_cluster;
+        if (extent->length > ctx->mft_data_size - mapped) {
+            extent->length = ctx->mft_data_size - mapped;
+        }
+        mapped += extent->length;
+    }
+    free(runs);
+
+    ctx->total_mft_records = mapped / ctx->mft_record_size;
+    return true;
+}
+
+bool ntfs_init(NTFSContext* ctx, const char* path, size_t vhd_cache_bytes) {
     memset(ctx, 0, sizeof(NTFSContext));
-    strncpy(ctx->base_path, extract_path, sizeof(ctx->base_path) - 1);
 
     if (!init_directory_cache(&ctx->dir_cache)) {
         return false;
     }
 
-    FILE* fp = fopen(path, "rb");
-    if (!fp) {
+    ImageSource source;
+    if (!image_source_open_file(&source, path)) {
         free_directory_cache(&ctx->dir_cache);
         return false;
     }
 
-    if (FSEEKO(fp, -512, SEEK_END) == 0) {
-        char signature[9] = { 0 };
-        if (fread(signature, 1, 8, fp) == 8 && memcmp(signature, VHD_COOKIE, 8) == 0) {
-            fclose(fp);
-            ctx->is_vhd = true;
-            if (!vhd_init(&ctx->vhd, path)) {
-                free_directory_cache(&ctx->dir_cache);
-                return false;
-            }
-        }
-        else {
-            rewind(fp);
-            ctx->is_vhd = false;
-            ctx->raw.fp = fp;
+    char signature[8];
+    if (source.size >= VHD_FOOTER_SIZE &&
+        image_source_read(&source, signature, source.size - VHD_FOOTER_SIZE, sizeof(signature)) &&
+        memcmp(signature, VHD_COOKIE, 8) == 0) {
+        image_source_close(&source);
+        ctx->is_vhd = true;
+        if (!vhd_init(&ctx->vhd, path, vhd_cache_bytes)) {
+            free_directory_cache(&ctx->dir_cache);
+            return false;
         }
     }
+    else {
+        ctx->is_vhd = false;
+        ctx->raw.source = source;
+    }
+
+    return ntfs_open_volume(ctx);
+}
+
+bool ntfs_init_source(NTFSContext* ctx, const ImageSource* source) {
+    memset(ctx, 0, sizeof(NTFSContext));
 
+    if (!init_directory_cache(&ctx->dir_cache)) {
+        return false;
+    }
+
+    ctx->is_vhd = false;
+    ctx->raw.source = *source;
+    return ntfs_open_volume(ctx);
+}
+
+static bool ntfs_open_volume(NTFSContext* ctx) {
     uint64_t ntfs_offset = 0;
     bool found_ntfs = false;
+    ctx->mft_batch_size = NTFS_MFT_BATCH_SIZE;
+    ctx->extract_threads = 1;
 
     if (ctx->is_vhd) {
         uint8_t sector[VHD_SECTOR_SIZE];
@@ -791,7 +1151,7 @@ bool ntfs_init(NTFSContext* ctx, const char* path, const char* extract_path) {
     }
 
     if (!found_ntfs) {
-        printf("No NTFS filesystem found\n");
+        log_printf("No NTFS filesystem found\n");
         ntfs_close(ctx);
         return false;
     }
@@ -799,7 +1159,7 @@ bool ntfs_init(NTFSContext* ctx, const char* path, const char* extract_path) {
     ctx->data_start_offset = ntfs_offset;
 
     if (!ntfs_read(ctx, &ctx->boot, ntfs_offset, sizeof(NTFSBootSector))) {
-        printf("Failed to read NTFS boot sector\n");
+        log_printf("Failed to read NTFS boot sector\n");
         ntfs_close(ctx);
         return false;
     }
@@ -816,20 +1176,20 @@ bool ntfs_init(NTFSContext* ctx, const char* path, const char* extract_path) {
 
     uint8_t* mft_record = malloc(ctx->mft_record_size);
     if (!mft_record) {
-        printf("Failed to allocate memory for MFT record\n");
+        log_printf("Failed to allocate memory for MFT record\n");
         ntfs_close(ctx);
         return false;
     }
 
     if (!ntfs_read(ctx, mft_record, ctx->mft_offset, ctx->mft_record_size)) {
-        printf("Failed to read MFT record 0\n");
+        log_printf("Failed to read MFT record 0\n");
         free(mft_record);
         ntfs_close(ctx);
         return false;
     }
 
     if (!apply_mft_fixups(ctx, mft_record, ctx->mft_record_size)) {
-        printf("Failed to apply MFT fixups on record 0\n");
+        log_printf("Failed to apply MFT fixups on record 0\n");
         free(mft_record);
         ntfs_close(ctx);
         return false;
@@ -837,7 +1197,7 @@ bool ntfs_init(NTFSContext* ctx, const char* path, const char* extract_path) {
 
     const MFTRecordHeader* record = (const MFTRecordHeader*)mft_record;
     if (memcmp(record->magic, "FILE", 4) != 0) {
-        printf("Invalid MFT record signature\n");
+        log_printf("Invalid MFT record signature\n");
         free(mft_record);
         ntfs_close(ctx);
         return false;
@@ -850,9 +1210,15 @@ bool ntfs_init(NTFSContext* ctx, const char* path, const char* extract_path) {
 
         if (header->type == DATA_ATTR && header->name_length == 0) {
             if (header->non_resident) {
-                uint64_t mft_data_size = header->data.non_resident.data_size;
-                ctx->mft_data_size = mft_data_size;
-                ctx->total_mft_records = mft_data_size / ctx->mft_record_size;
+                const uint8_t* record_end = mft_record + ctx->mft_record_size;
+                const uint8_t* attr_end = (header->length > record_end - attr) ? record_end : attr + header->length;
+                ctx->mft_data_size = header->data.non_resident.data_size;
+                if (!build_mft_extents(ctx, attr + header->data.non_resident.mapping_pairs_offset, attr_end)) {
+                    log_printf("Failed to map the $MFT data runs\n");
+                    free(mft_record);
+                    ntfs_close(ctx);
+                    return false;
+                }
             }
             break;
         }
@@ -863,68 +1229,275 @@ bool ntfs_init(NTFSContext* ctx, const char* path, const char* extract_path) {
     return true;
 }
 
-bool ntfs_extract_all(NTFSContext* ctx) {
-    if (!create_directories(ctx->base_path)) {
-        printf("Failed to create output directory\n");
-        return false;
+static void report_progress(uint64_t done, uint64_t total, time_t* last_update_time, int* last_percentage) {
+    time_t current_time = time(NULL);
+    if (current_time != *last_update_time && total > 0) {
+        int percentage = (int)(done * 100 / total);
+        if (percentage != *last_percentage) {
+            log_progress(percentage);
+            *last_percentage = percentage;
+        }
+        *last_update_time = current_time;
+    }
+}
+
+// First pass: reads the whole MFT in batches into index.
+static bool index_mft(NTFSContext* ctx, NtfsIndex* index) {
+    uint64_t total_records = ctx->total_mft_records;
+
+    // The MFT is read in batches of whole records rather than one record at a time.
+    uint64_t batch_records = ctx->mft_batch_size / ctx->mft_record_size;
+    if (batch_records == 0) {
+        batch_records = 1;
+    }
+    if (batch_records > total_records && total_records > 0) {
+        batch_records = total_records;
     }
 
-    uint8_t* record_buffer = malloc(ctx->mft_record_size);
-    if (!record_buffer) {
-        printf("Failed to allocate MFT record buffer\n");
+    uint8_t* batch_buffer = malloc((size_t)batch_records * ctx->mft_record_size);
+    if (!batch_buffer) {
+        log_printf("Failed to allocate MFT record buffer\n");
         return false;
     }
 
-    printf("Extraction in progress...\n");
-    uint64_t current_offset = ctx->mft_offset;
-    uint64_t total_records = ctx->total_mft_records;
-    uint64_t processed_records = 0;
-    uint64_t extracted_records = 0;
+    uint64_t current_offset = 0;    // position in the $MFT, not in the volume
+    uint64_t single_until = 0;      // records before this are read one at a time
+    bool stopped = false;
+    bool success = true;
 
     time_t last_update_time = time(NULL);
     int last_percentage = -1;
 
-    for (uint64_t i = 0; i < total_records; i++) {
-        if (!ntfs_read(ctx, record_buffer, current_offset, ctx->mft_record_size)) {
-            printf("Failed to read MFT record at offset 0x%llX\n",
-                (unsigned long long)current_offset);
-            break;
+    for (uint64_t i = 0; i < total_records && !stopped; ) {
+        uint64_t count = total_records - i;
+        if (count > batch_records) {
+            count = batch_records;
+        }
+        if (i < single_until) {
+            count = 1;
         }
 
-        if (!apply_mft_fixups(ctx, record_buffer, ctx->mft_record_size)) {
-            printf("Failed to apply MFT fixups at offset 0x%llX\n",
-                (unsigned long long)current_offset);
-            break;
+        if (!read_mft(ctx, batch_buffer, current_offset, (size_t)count * ctx->mft_record_size)) {
+            if (count > 1) {
+                // Part of the batch is unreadable: read it record by record so
+                // only the bad records are lost, then go back to batches.
+                single_until = i + count;
+                continue;
+            }
+            log_printf("Skipping unreadable MFT record %llu\n", (unsigned long long)i);
+            i++;
+            current_offset += ctx->mft_record_size;
+            continue;
         }
 
-        const MFTRecordHeader* record = (const MFTRecordHeader*)record_buffer;
-        if (memcmp(record->magic, "FILE", 4) == 0) {
-            processed_records++;
-            if (process_mft_record(ctx, record_buffer)) {
-                extracted_records++;
+        for (uint64_t j = 0; j < count; j++, i++) {
+            uint8_t* record_buffer = batch_buffer + (size_t)j * ctx->mft_record_size;
+            stats_count(STAT_MFT_RECORDS, 1);
+
+            if (!apply_mft_fixups(ctx, record_buffer, ctx->mft_record_size)) {
+                log_printf("Failed to apply MFT fixups on record %llu\n", (unsigned long long)i);
+                stopped = true;
+                break;
+            }
+
+            if (!index_mft_record(ctx, index, record_buffer, i)) {
+                log_printf("Failed to allocate memory for the MFT index\n");
+                stopped = true;
+                success = false;
+                break;
             }
+
+            current_offset += ctx->mft_record_size;
         }
 
-        current_offset += ctx->mft_record_size;
+        report_progress(i, total_records, &last_update_time, &last_percentage);
+    }
+
+    log_progress_done();
+
+    free(batch_buffer);
+    return success;
+}
+
+// The files of ntfs_extract_all() in the order they are taken. mutex guards
+// next_file, failed_count, the progress and ctx->dir_cache, which resolving
+// a path may add to; the index itself is only read.
+typedef struct {
+    NTFSContext* ctx;
+    const NtfsIndex* index;
+    const ExtractOrder* order;
+    size_t file_count;
+    Mutex mutex;
+    size_t next_file;
+    size_t failed_count;
+    time_t last_update_time;
+    int last_percentage;
+    LogBuffer* log;         // the calling thread's, shared by the helpers
+    bool collect_stats;
+} ExtractQueue;
+
+typedef struct {
+    Thread thread;
+    ExtractQueue* queue;
+    ImageStats stats;       // merged into the caller's once joined
+} ExtractWorker;
+
+static void extract_queued_files(ExtractQueue* queue) {
+    char full_path[MAX_PATH_LENGTH];
+    for (;;) {
+        mutex_lock(&queue->mutex);
+        if (queue->next_file >= queue->file_count) {
+            mutex_unlock(&queue->mutex);
+            return;
+        }
+        size_t i = queue->next_file++;
+        const NtfsIndexEntry* entry = &queue->index->entries[queue->order[i].entry];
+
+        uint64_t resolve_start = stats_now();
+        get_full_path(queue->ctx, queue->index, entry, full_path, sizeof(full_path));
+        stats_time(STAT_TIME_PATH_RESOLVE, resolve_start);
+        report_progress(i + 1, queue->file_count, &queue->last_update_time, &queue->last_percentage);
+        mutex_unlock(&queue->mutex);
+
+        // Reading and writing the data is what runs side by side.
+        if (!extract_file(queue->ctx, queue->index, entry, full_path)) {
+            mutex_lock(&queue->mutex);
+            queue->failed_count++;
+            log_printf("Failed to extract %s\n", full_path);
+            mutex_unlock(&queue->mutex);
+        }
+    }
+}
+
+static void extract_worker_main(void* arg) {
+    ExtractWorker* worker = (ExtractWorker*)arg;
+    log_capture(worker->queue->log);
+    stats_attach(worker->queue->collect_stats ? &worker->stats : NULL);
+    extract_queued_files(worker->queue);
+}
+
+bool ntfs_extract_all(NTFSContext* ctx, ExtractSink* sink) {
+    ctx->sink = sink;
+    if (!sink_add_directory(sink, "")) {
+        log_printf("Failed to create output directory\n");
+        return false;
+    }
+
+    log_printf("Reading the MFT...\n");
+    NtfsIndex index;
+    memset(&index, 0, sizeof(index));
+    if (!index_mft(ctx, &index)) {
+        free_index(&index);
+        return false;
+    }
+
+    // Second pass: resolve every path once, create the directories in record
+    // order and queue the files.
+    ExtractOrder* order = malloc((index.count ? index.count : 1) * sizeof(ExtractOrder));
+    if (!order) {
+        log_printf("Failed to allocate memory for the MFT index\n");
+        free_index(&index);
+        return false;
+    }
 
-        time_t current_time = time(NULL);
-        if (current_time != last_update_time) {
-            int percentage = (int)((i + 1) * 100 / total_records);
-            if (percentage != last_percentage) {
-                printf("\rProgress: %d%%    ", percentage);
-                fflush(stdout);
-                last_percentage = percentage;
+    size_t file_count = 0;
+    size_t failed_directories = 0;
+    char full_path[MAX_PATH_LENGTH];
+    for (size_t i = 0; i < index.count; i++) {
+        const NtfsIndexEntry* entry = &index.entries[i];
+        if (entry->is_directory) {
+            uint64_t resolve_start = stats_now();
+            get_full_path(ctx, &index, entry, full_path, sizeof(full_path));
+            stats_time(STAT_TIME_PATH_RESOLVE, resolve_start);
+            if (!sink_add_directory(sink, full_path)) {
+                log_printf("Failed to create directory %s\n", full_path);
+                failed_directories++;
+            }
+        }
+        else {
+            order[file_count].first_offset = entry->first_offset;
+            order[file_count].entry = i;
+            file_count++;
+        }
+    }
+
+    // Resident files have no data offset and come first, then the others in
+    // the order their data is stored in.
+    if (!ctx->extract_in_mft_order) {
+        qsort(order, file_count, sizeof(ExtractOrder), compare_extract_order);
+    }
+
+    log_printf("Extraction in progress...\n");
+    ExtractQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.ctx = ctx;
+    queue.index = &index;
+    queue.order = order;
+    queue.file_count = file_count;
+    queue.failed_count = failed_directories;
+    queue.last_update_time = time(NULL);
+    queue.last_percentage = -1;
+    queue.log = log_current();
+    queue.collect_stats = stats_current() != NULL;
+    mutex_init(&queue.mutex);
+
+    // Helpers would only queue on a sink that takes one file at a time.
+    size_t helpers = (ctx->extract_threads > 1 && sink->parallel) ? (size_t)ctx->extract_threads - 1 : 0;
+    if (helpers >= file_count) {
+        helpers = (file_count > 0) ? file_count - 1 : 0;
+    }
+    ExtractWorker* workers = helpers ? calloc(helpers, sizeof(ExtractWorker)) : NULL;
+    size_t started = 0;
+    if (workers) {
+        for (; started < helpers; started++) {
+            workers[started].queue = &queue;
+            if (!thread_create(&workers[started].thread, extract_worker_main, &workers[started])) {
+                break;
             }
-            last_update_time = current_time;
         }
     }
 
-    printf("\rProgress: 100%%    \n");
+    // The calling thread extracts as well, which also covers thread creation failing.
+    extract_queued_files(&queue);
+
+    for (size_t i = 0; i < started; i++) {
+        thread_join(workers[i].thread);
+        if (queue.collect_stats) {
+            stats_merge(stats_current(), &workers[i].stats);
+        }
+    }
+    free(workers);
+    mutex_destroy(&queue.mutex);
 
-    printf("Extraction completed.\n");
+    log_progress_done();
 
-    free(record_buffer);
-    return true;
+    bool success = queue.failed_count == 0;
+    if (success) {
+        log_printf("Extraction completed.\n");
+    }
+    else {
+        log_printf("Extraction completed. Files and directories that could not be extracted: %llu\n",
+            (unsigned long long)queue.failed_count);
+    }
+
+    free(order);
+    free_index(&index);
+    return success;
+}
+
+void ntfs_print_vhd_cache_stats(const NTFSContext* ctx) {
+    if (!ctx->is_vhd || ctx->vhd.footer.disk_type != VHD_TYPE_DYNAMIC) {
+        return;
+    }
+
+    const VHDBlockCache* cache = &ctx->vhd.cache;
+    uint64_t lookups = cache->hits + cache->misses;
+    log_printf("VHD block cache: %llu hits, %llu misses (%.1f%% hit rate), %llu evictions, %.1f MiB read\n",
+        (unsigned long long)cache->hits,
+        (unsigned long long)cache->misses,
+        lookups ? 100.0 * (double)cache->hits / (double)lookups : 0.0,
+        (unsigned long long)cache->evictions,
+        (double)cache->bytes_read / (1024.0 * 1024.0));
 }
 
 void ntfs_close(NTFSContext* ctx) {
@@ -932,15 +1505,15 @@ void ntfs_close(NTFSContext* ctx) {
         if (ctx->vhd.fp) {
             fclose(ctx->vhd.fp);
             free(ctx->vhd.bat);
-            free(ctx->vhd.sector_bitmap);
-            free(ctx->vhd.block_buffer);
+            if (ctx->vhd.footer.disk_type == VHD_TYPE_DYNAMIC) {
+                vhd_cache_close(&ctx->vhd.cache);
+            }
         }
     }
     else {
-        if (ctx->raw.fp) {
-            fclose(ctx->raw.fp);
-        }
+        image_source_close(&ctx->raw.source);
     }
+    free(ctx->mft_extents);
     free_directory_cache(&ctx->dir_cache);
     memset(ctx, 0, sizeof(NTFSContext));
 }
@@ -0,0 +1,212 @@
+#include "page_cache.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t page_hash(uint64_t offset) {
+    uint64_t h = offset / PAGE_CACHE_PAGE_SIZE;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static PageCacheShard* shard_for(PageCache* cache, uint64_t hash) {
+    return &cache->shards[hash % (uint64_t)cache->shard_count];
+}
+
+static void lru_unlink(PageCacheShard* shard, PageCacheEntry* entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else shard->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else shard->lru_tail = entry->lru_prev;
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(PageCacheShard* shard, PageCacheEntry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+    if (!shard->lru_tail) shard->lru_tail = entry;
+}
+
+static PageCacheEntry** bucket_for(PageCacheShard* shard, uint64_t hash) {
+    // The low bits picked the shard, the high bits pick the bucket.
+    return &shard->buckets[(hash >> 32) & shard->bucket_mask];
+}
+
+static PageCacheEntry* shard_find(PageCacheShard* shard, uint64_t hash, uint64_t offset) {
+    for (PageCacheEntry* entry = *bucket_for(shard, hash); entry; entry = entry->hash_next) {
+        if (entry->offset == offset) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void shard_remove(PageCacheShard* shard, PageCacheEntry* entry) {
+    PageCacheEntry** link = bucket_for(shard, page_hash(entry->offset));
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    entry->hash_next = NULL;
+    lru_unlink(shard, entry);
+}
+
+static bool shard_init(PageCacheShard* shard, size_t capacity) {
+    memset(shard, 0, sizeof(PageCacheShard));
+
+    size_t buckets = 1;
+    while (buckets < capacity) {
+        buckets <<= 1;
+    }
+
+    shard->entries = calloc(capacity, sizeof(PageCacheEntry));
+    shard->data = malloc(capacity * PAGE_CACHE_PAGE_SIZE);
+    shard->buckets = calloc(buckets, sizeof(PageCacheEntry*));
+    if (!shard->entries || !shard->data || !shard->buckets) {
+        free(shard->entries);
+        free(shard->data);
+        free(shard->buckets);
+        return false;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        shard->entries[i].data = shard->data + i * PAGE_CACHE_PAGE_SIZE;
+    }
+    shard->bucket_mask = buckets - 1;
+    shard->capacity = capacity;
+    mutex_init(&shard->mutex);
+    return true;
+}
+
+static void shard_close(PageCacheShard* shard) {
+    mutex_destroy(&shard->mutex);
+    free(shard->entries);
+    free(shard->data);
+    free(shard->buckets);
+}
+
+bool page_cache_init(PageCache* cache, size_t capacity_bytes, int shard_count) {
+    memset(cache, 0, sizeof(PageCache));
+
+    size_t pages = capacity_bytes / PAGE_CACHE_PAGE_SIZE;
+    if (pages == 0) {
+        pages = 1;
+    }
+    if (shard_count < 1) {
+        shard_count = 1;
+    }
+    if (pages < (size_t)shard_count) {
+        // Every shard needs room for at least one page.
+        shard_count = (int)pages;
+    }
+
+    cache->shards = calloc((size_t)shard_count, sizeof(PageCacheShard));
+    if (!cache->shards) {
+        return false;
+    }
+
+    for (int i = 0; i < shard_count; i++) {
+        size_t share = pages / shard_count + ((size_t)i < pages % shard_count ? 1 : 0);
+        if (!shard_init(&cache->shards[i], share)) {
+            for (int j = 0; j < i; j++) {
+                shard_close(&cache->shards[j]);
+            }
+            free(cache->shards);
+            cache->shards = NULL;
+            return false;
+        }
+    }
+    cache->shard_count = shard_count;
+    return true;
+}
+
+bool page_cache_lookup(PageCache* cache, uint64_t offset, void* out) {
+    uint64_t hash = page_hash(offset);
+    PageCacheShard* shard = shard_for(cache, hash);
+
+    mutex_lock(&shard->mutex);
+    PageCacheEntry* entry = shard_find(shard, hash, offset);
+    if (entry) {
+        if (shard->lru_head != entry) {
+            lru_unlink(shard, entry);
+            lru_push_front(shard, entry);
+        }
+        memcpy(out, entry->data, PAGE_CACHE_PAGE_SIZE);
+        shard->hits++;
+    }
+    else {
+        shard->misses++;
+    }
+    mutex_unlock(&shard->mutex);
+    return entry != NULL;
+}
+
+void page_cache_insert(PageCache* cache, uint64_t offset, const void* page) {
+    uint64_t hash = page_hash(offset);
+    PageCacheShard* shard = shard_for(cache, hash);
+
+    mutex_lock(&shard->mutex);
+    PageCacheEntry* entry = shard_find(shard, hash, offset);
+    if (entry) {
+        // Another reader decrypted the same page first; the contents are identical.
+        mutex_unlock(&shard->mutex);
+        return;
+    }
+
+    if (shard->used < shard->capacity) {
+        entry = &shard->entries[shard->used++];
+    }
+    else {
+        entry = shard->lru_tail;
+        shard_remove(shard, entry);
+        shard->evictions++;
+    }
+
+    entry->offset = offset;
+    memcpy(entry->data, page, PAGE_CACHE_PAGE_SIZE);
+
+    PageCacheEntry** bucket = bucket_for(shard, hash);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    mutex_unlock(&shard->mutex);
+}
+
+void page_cache_get_stats(PageCache* cache, PageCacheStats* stats) {
+    memset(stats, 0, sizeof(PageCacheStats));
+    for (int i = 0; i < cache->shard_count; i++) {
+        PageCacheShard* shard = &cache->shards[i];
+        mutex_lock(&shard->mutex);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->resident_pages += shard->used;
+        stats->capacity_pages += shard->capacity;
+        mutex_unlock(&shard->mutex);
+    }
+}
+
+void print_page_cache_stats(const PageCacheStats* stats) {
+    uint64_t lookups = stats->hits + stats->misses;
+    log_printf("Page cache: %llu hits, %llu misses (%.1f%% hit rate), %llu evictions, %llu/%llu pages resident\n",
+        (unsigned long long)stats->hits,
+        (unsigned long long)stats->misses,
+        lookups ? 100.0 * (double)stats->hits / (double)lookups : 0.0,
+        (unsigned long long)stats->evictions,
+        (unsigned long long)stats->resident_pages,
+        (unsigned long long)stats->capacity_pages);
+}
+
+void page_cache_close(PageCache* cache) {
+    for (int i = 0; i < cache->shard_count; i++) {
+        shard_close(&cache->shards[i]);
+    }
+    free(cache->shards);
+    memset(cache, 0, sizeof(PageCache));
+}
@@ -0,0 +1,419 @@
+#include "sink.h"
+#include "log.h"
+#include "stats.h"
+#include "image.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <openssl/evp.h>
+
+#define SINK_PATH_LENGTH (MAX_PATH_LENGTH * 2)
+#define SINK_ZERO_SIZE (64 * 1024)
+
+// What sink_skip_file() writes or hashes where a hole cannot be left.
+static const uint8_t g_zeros[SINK_ZERO_SIZE];
+
+struct SinkFile {
+    void* handle;           // the sink's own, NULL while only hashing
+    EVP_MD_CTX* md;         // hash for the manifest
+};
+
+typedef struct {
+    FILE* fp;
+    bool has_holes;
+    bool ends_in_hole;      // skipped up to the current position, the file is not that long yet
+    char path[SINK_PATH_LENGTH];
+} DirectoryFile;
+
+typedef struct {
+    DedupFile* dedup;
+    char path[SINK_PATH_LENGTH];
+} DedupOutput;
+
+bool create_directories(const char* path) {
+    char* tmp = STRDUP(path);
+    if (!tmp) return false;
+
+    bool success = true;
+    char* p = tmp;
+
+    if (strlen(p) > 2) {
+        if (p[1] == ':') p += 2;
+        if (*p == '\\' || *p == '/') p++;
+    }
+
+    while ((p = strchr(p, PATH_SEPARATOR[0])) != NULL) {
+        *p = '\0';
+        if (strlen(tmp) > 0) {
+            if (MKDIR(tmp) != 0 && errno != EEXIST) {
+                success = false;
+                break;
+            }
+        }
+        *p = PATH_SEPARATOR[0];
+        p++;
+    }
+
+    if (success && strlen(tmp) > 0) {
+        if (MKDIR(tmp) != 0 && errno != EEXIST) {
+            success = false;
+        }
+    }
+
+    free(tmp);
+    return success;
+}
+
+static void create_parent_directories(const char* path) {
+    char parent_path[SINK_PATH_LENGTH];
+    STRCPY_S(parent_path, sizeof(parent_path), path);
+    char* last_separator = strrchr(parent_path, PATH_SEPARATOR[0]);
+    if (last_separator) {
+        *last_separator = '\0';
+        create_directories(parent_path);
+    }
+}
+
+// root + separator + path, with PATH_SEPARATOR in path swapped for the
+// sink's own separator.
+static bool sink_path(const ExtractSink* sink, const char* path, char* out, size_t size) {
+    int length = path[0] ?
+        snprintf(out, size, "%s%c%s", sink->root, sink->separator, path) :
+        snprintf(out, size, "%s", sink->root);
+    if (length < 0 || (size_t)length >= size) {
+        log_printf("Warning: Path too long, skipping: %s%s%s\n", sink->root, PATH_SEPARATOR, path);
+        return false;
+    }
+    if (sink->separator != PATH_SEPARATOR[0]) {
+        for (char* p = out + strlen(sink->root); *p; p++) {
+            if (*p == PATH_SEPARATOR[0]) *p = sink->separator;
+        }
+    }
+    return true;
+}
+
+static bool directory_add_directory(void* opaque, const char* path) {
+    (void)opaque;
+    return create_directories(path);
+}
+
+static void* directory_open_file(void* opaque, const char* path, uint64_t size) {
+    (void)opaque;
+    (void)size;
+    DirectoryFile* file = malloc(sizeof(DirectoryFile));
+    if (!file) {
+        return NULL;
+    }
+    STRCPY_S(file->path, sizeof(file->path), path);
+    file->has_holes = false;
+    file->ends_in_hole = false;
+
+    // Replace the file rather than truncate it: it may be a link into a
+    // --dedup-store blob from an earlier run, which other trees share.
+    remove(path);
+    file->fp = fopen(path, "wb");
+    if (!file->fp) {
+        // The parents are normally there already; only create them on demand.
+        create_parent_directories(path);
+        file->fp = fopen(path, "wb");
+    }
+    if (!file->fp) {
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+static bool directory_write_file(void* opaque, void* file, const void* data, size_t size) {
+    (void)opaque;
+    DirectoryFile* out = (DirectoryFile*)file;
+    out->ends_in_hole = false;
+    return fwrite(data, 1, size, out->fp) == size;
+}
+
+static bool directory_skip_file(void* opaque, void* file, uint64_t size) {
+    (void)opaque;
+    DirectoryFile* out = (DirectoryFile*)file;
+    if (!out->has_holes) {
+        file_mark_sparse(out->fp);
+        out->has_holes = true;
+    }
+    out->ends_in_hole = true;
+    return FSEEKO(out->fp, (int64_t)size, SEEK_CUR) == 0;
+}
+
+static bool directory_close_file(void* opaque, void* file, bool complete) {
+    (void)opaque;
+    DirectoryFile* out = (DirectoryFile*)file;
+    if (complete && out->ends_in_hole) {
+        // Seeking past the end does not make the file longer by itself.
+        complete = file_truncate(out->fp, (uint64_t)FTELLO(out->fp));
+    }
+    bool success = fclose(out->fp) == 0 && complete;
+    if (!success) {
+        remove(out->path);
+    }
+    free(out);
+    return success;
+}
+
+static void* dedup_open_file(void* opaque, const char* path, uint64_t size) {
+    (void)size;
+    DedupImage* image = (DedupImage*)opaque;
+    DedupOutput* file = malloc(sizeof(DedupOutput));
+    if (!file) {
+        return NULL;
+    }
+    file->dedup = dedup_file_create(image->store);
+    if (!file->dedup) {
+        free(file);
+        return NULL;
+    }
+    STRCPY_S(file->path, sizeof(file->path), path);
+    return file;
+}
+
+static bool dedup_write_file(void* opaque, void* file, const void* data, size_t size) {
+    (void)opaque;
+    return dedup_file_write(((DedupOutput*)file)->dedup, data, size);
+}
+
+static bool dedup_close_file(void* opaque, void* file, bool complete) {
+    DedupImage* image = (DedupImage*)opaque;
+    DedupOutput* out = (DedupOutput*)file;
+    if (!complete) {
+        dedup_file_discard(out->dedup);
+        free(out);
+        return false;
+    }
+
+    char blob_path[DEDUP_PATH_LENGTH];
+    bool duplicate = false;
+    uint64_t size = 0;
+    bool linked = dedup_file_finish(out->dedup, blob_path, sizeof(blob_path), &duplicate, &size);
+    if (linked && !dedup_link(image->store, blob_path, out->path)) {
+        create_parent_directories(out->path);
+        linked = dedup_link(image->store, blob_path, out->path);
+    }
+    if (linked) {
+        mutex_lock(&image->store->mutex);
+        image->files++;
+        image->bytes += size;
+        if (duplicate) {
+            image->duplicate_files++;
+            image->duplicate_bytes += size;
+        }
+        mutex_unlock(&image->store->mutex);
+        if (duplicate) {
+            stats_count(STAT_BYTES_DEDUPLICATED, size);
+        }
+    }
+    free(out);
+    return linked;
+}
+
+static bool tar_add_directory(void* opaque, const char* path) {
+    return tar_writer_add_directory((TarWriter*)opaque, path);
+}
+
+static void* tar_open_file(void* opaque, const char* path, uint64_t size) {
+    TarWriter* tar = (TarWriter*)opaque;
+    return tar_writer_begin_file(tar, path, size) ? tar : NULL;
+}
+
+static bool tar_write_file(void* opaque, void* file, const void* data, size_t size) {
+    (void)opaque;
+    return tar_writer_write((TarWriter*)file, data, size);
+}
+
+static bool tar_close_file(void* opaque, void* file, bool complete) {
+    (void)opaque;
+    return tar_writer_end_file((TarWriter*)file) && complete;
+}
+
+void sink_init_directory(ExtractSink* sink, const char* root) {
+    memset(sink, 0, sizeof(ExtractSink));
+    sink->add_directory = directory_add_directory;
+    sink->open_file = directory_open_file;
+    sink->write_file = directory_write_file;
+    sink->skip_file = directory_skip_file;
+    sink->close_file = directory_close_file;
+    sink->parallel = true;
+    sink->separator = PATH_SEPARATOR[0];
+    STRCPY_S(sink->root, sizeof(sink->root), root);
+}
+
+void sink_init_tar(ExtractSink* sink, TarWriter* tar, const char* root) {
+    memset(sink, 0, sizeof(ExtractSink));
+    sink->add_directory = tar_add_directory;
+    sink->open_file = tar_open_file;
+    sink->write_file = tar_write_file;
+    sink->close_file = tar_close_file;
+    sink->opaque = tar;
+    sink->separator = '/';
+    STRCPY_S(sink->root, sizeof(sink->root), root);
+}
+
+void sink_init_dedup(ExtractSink* sink, DedupImage* image, const char* root) {
+    memset(sink, 0, sizeof(ExtractSink));
+    sink->add_directory = directory_add_directory;
+    sink->open_file = dedup_open_file;
+    sink->write_file = dedup_write_file;
+    sink->close_file = dedup_close_file;
+    sink->opaque = image;
+    sink->parallel = true;
+    sink->separator = PATH_SEPARATOR[0];
+    STRCPY_S(sink->root, sizeof(sink->root), root);
+}
+
+bool sink_add_directory(ExtractSink* sink, const char* path) {
+    char full_path[SINK_PATH_LENGTH];
+    if (!sink_path(sink, path, full_path, sizeof(full_path))) {
+        return false;
+    }
+    if (!sink->add_directory(sink->opaque, full_path)) {
+        log_printf("Failed to create directory: %s\n", full_path);
+        return false;
+    }
+    if (path[0]) {
+        stats_count(STAT_DIRS_EXTRACTED, 1);
+    }
+    return true;
+}
+
+static bool file_has_size(const char* path, uint64_t size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    bool same = FSEEKO(file, 0, SEEK_END) == 0 && (uint64_t)FTELLO(file) == size;
+    fclose(file);
+    return same;
+}
+
+static bool start_hash(SinkFile* file) {
+    file->md = EVP_MD_CTX_new();
+    return file->md && EVP_DigestInit_ex(file->md, EVP_sha256(), NULL);
+}
+
+static bool finish_hash(SinkFile* file, uint8_t* hash) {
+    unsigned int length = 0;
+    bool hashed = EVP_DigestFinal_ex(file->md, hash, &length) && length == MANIFEST_HASH_SIZE;
+    EVP_MD_CTX_free(file->md);
+    file->md = NULL;
+    return hashed;
+}
+
+static bool file_unchanged(ExtractSink* sink, const char* path, const char* full_path, uint64_t size,
+    uint64_t mtime, SinkStreamFunc stream, void* context) {
+    Manifest* manifest = sink->manifest;
+    const ManifestEntry* entry = manifest_find(manifest, path);
+    if (!entry || entry->size != size) {
+        return false;
+    }
+
+    if (!manifest->use_hash) {
+        if (mtime == 0 || entry->mtime != mtime || !file_has_size(full_path, size)) {
+            return false;
+        }
+        return manifest_record(manifest, path, size, mtime, entry->has_hash ? entry->hash : NULL, true);
+    }
+
+    if (!entry->has_hash || !file_has_size(full_path, size)) {
+        return false;
+    }
+    SinkFile probe = { NULL, NULL };
+    uint8_t hash[MANIFEST_HASH_SIZE];
+    bool hashed = start_hash(&probe) && stream(context, sink, &probe);
+    hashed = finish_hash(&probe, hash) && hashed;
+    if (!hashed || memcmp(hash, entry->hash, MANIFEST_HASH_SIZE) != 0) {
+        return false;
+    }
+    return manifest_record(manifest, path, size, mtime, hash, true);
+}
+
+bool sink_extract_file(ExtractSink* sink, const char* path, uint64_t size, uint64_t mtime,
+    SinkStreamFunc stream, void* context) {
+    char full_path[SINK_PATH_LENGTH];
+    if (!sink_path(sink, path, full_path, sizeof(full_path))) {
+        return false;
+    }
+
+    if (sink->manifest && file_unchanged(sink, path, full_path, size, mtime, stream, context)) {
+        stats_count(STAT_FILES_UNCHANGED, 1);
+        return true;
+    }
+
+    SinkFile file = { NULL, NULL };
+    if (sink->manifest && sink->manifest->use_hash && !start_hash(&file)) {
+        EVP_MD_CTX_free(file.md);
+        return false;
+    }
+    file.handle = sink->open_file(sink->opaque, full_path, size);
+    if (!file.handle) {
+        log_printf("Failed to create file: %s\n", full_path);
+        EVP_MD_CTX_free(file.md);
+        return false;
+    }
+
+    bool complete = stream(context, sink, &file);
+    bool success = sink->close_file(sink->opaque, file.handle, complete);
+
+    uint8_t hash[MANIFEST_HASH_SIZE];
+    bool hashed = file.md && finish_hash(&file, hash);
+    if (success) {
+        stats_count(STAT_FILES_EXTRACTED, 1);
+        if (sink->manifest) {
+            manifest_record(sink->manifest, path, size, mtime, hashed ? hash : NULL, false);
+        }
+    }
+    return success;
+}
+
+bool sink_write_file(ExtractSink* sink, SinkFile* file, const void* data, size_t size) {
+    if (file->md && !EVP_DigestUpdate(file->md, data, size)) {
+        return false;
+    }
+    if (!file->handle) {
+        return true;
+    }
+
+    uint64_t write_start = stats_now();
+    bool written = sink->write_file(sink->opaque, file->handle, data, size);
+    stats_time(STAT_TIME_WRITE, write_start);
+    stats_count(STAT_BYTES_WRITTEN, written ? size : 0);
+    return written;
+}
+
+bool sink_skip_file(ExtractSink* sink, SinkFile* file, uint64_t size) {
+    for (uint64_t left = size; file->md && left > 0; ) {
+        size_t chunk = (left > SINK_ZERO_SIZE) ? SINK_ZERO_SIZE : (size_t)left;
+        if (!EVP_DigestUpdate(file->md, g_zeros, chunk)) {
+            return false;
+        }
+        left -= chunk;
+    }
+    if (!file->handle) {
+        return true;
+    }
+
+    if (sink->skip_file) {
+        if (!sink->skip_file(sink->opaque, file->handle, size)) {
+            return false;
+        }
+        stats_count(STAT_BYTES_SPARSE, size);
+        return true;
+    }
+
+    // Tar members and dedup blobs hold the zeros themselves.
+    uint64_t write_start = stats_now();
+    bool written = true;
+    for (uint64_t left = size; written && left > 0; ) {
+        size_t chunk = (left > SINK_ZERO_SIZE) ? SINK_ZERO_SIZE : (size_t)left;
+        written = sink->write_file(sink->opaque, file->handle, g_zeros, chunk);
+        stats_count(STAT_BYTES_WRITTEN, written ? chunk : 0);
+        left -= chunk;
+    }
+    stats_time(STAT_TIME_WRITE, write_start);
+    return written;
+}
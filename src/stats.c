@@ -0,0 +1,97 @@
+#include "stats.h"
+#include "thread.h"
+#include "json.h"
+#include <string.h>
+
+static THREAD_LOCAL ImageStats* t_stats = NULL;
+
+static const char* const TIMER_NAMES[STAT_TIME_COUNT] = {
+    "decrypt",
+    "fread",
+    "fwrite",
+    "vhd_read",
+    "apply_mft_fixups",
+    "path_resolve"
+};
+
+static const char* const COUNTER_NAMES[STAT_COUNTER_COUNT] = {
+    "bytes_read",
+    "bytes_written",
+    "bytes_decrypted",
+    "mft_records_scanned",
+    "files_extracted",
+    "directories_extracted",
+    "dir_cache_hits",
+    "dir_cache_misses",
+    "dir_cache_probes",
+    "vhd_cache_hits",
+    "vhd_cache_misses",
+    "bytes_deduplicated",
+    "files_unchanged",
+    "bytes_sparse"
+};
+
+ImageStats* stats_attach(ImageStats* stats) {
+    ImageStats* previous = t_stats;
+    t_stats = stats;
+    return previous;
+}
+
+ImageStats* stats_current(void) {
+    return t_stats;
+}
+
+void stats_merge(ImageStats* into, const ImageStats* from) {
+    for (int i = 0; i < STAT_TIME_COUNT; i++) {
+        into->time_ns[i] += from->time_ns[i];
+        into->calls[i] += from->calls[i];
+    }
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+        into->counters[i] += from->counters[i];
+    }
+}
+
+uint64_t stats_now(void) {
+    return t_stats ? monotonic_ns() : 0;
+}
+
+void stats_time(StatTimer timer, uint64_t start) {
+    if (!t_stats || start == 0) {
+        return;
+    }
+    t_stats->time_ns[timer] += monotonic_ns() - start;
+    t_stats->calls[timer]++;
+}
+
+void stats_count(StatCounter counter, uint64_t amount) {
+    if (t_stats) {
+        t_stats->counters[counter] += amount;
+    }
+}
+
+void stats_print_json(FILE* out, const ImageStats* stats, const char* input, const char* image,
+    const char* result, uint64_t elapsed_ns) {
+    JsonBuffer json;
+    json_init(&json);
+
+    json_append(&json, "{\"input\":");
+    json_append_string(&json, input);
+    json_append(&json, ",\"image\":");
+    json_append_string(&json, image);
+    json_append(&json, ",\"result\":");
+    json_append_string(&json, result);
+    json_appendf(&json, ",\"elapsed_s\":%.6f,\"counters\":{", elapsed_ns / 1e9);
+
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+        json_appendf(&json, "%s\"%s\":%llu", i ? "," : "", COUNTER_NAMES[i],
+            (unsigned long long)stats->counters[i]);
+    }
+    json_append(&json, "},\"timers\":{");
+
+    for (int i = 0; i < STAT_TIME_COUNT; i++) {
+        json_appendf(&json, "%s\"%s\":{\"seconds\":%.6f,\"calls\":%llu}", i ? "," : "",
+            TIMER_NAMES[i], stats->time_ns[i] / 1e9, (unsigned long long)stats->calls[i]);
+    }
+    json_append(&json, "}}");
+    json_write_line(&json, out);
+}
@@ -0,0 +1,239 @@
+#include "tar.h"
+#include "common.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#define TAR_MAX_OCTAL_SIZE 077777777777ULL
+#define TAR_STREAM_BUFFER (1024 * 1024)
+
+static const uint8_t g_zero_block[TAR_BLOCK_SIZE];
+
+static bool tar_write(TarWriter* tar, const void* data, size_t size) {
+    if (tar->failed) {
+        return false;
+    }
+    if (fwrite(data, 1, size, tar->fp) != size) {
+        log_perror(tar->to_stdout ? "stdout" : "tar");
+        tar->failed = true;
+        return false;
+    }
+    return true;
+}
+
+static bool tar_write_zeros(TarWriter* tar, uint64_t size) {
+    while (size > 0) {
+        size_t chunk = size > TAR_BLOCK_SIZE ? TAR_BLOCK_SIZE : (size_t)size;
+        if (!tar_write(tar, g_zero_block, chunk)) {
+            return false;
+        }
+        size -= chunk;
+    }
+    return true;
+}
+
+static bool tar_pad(TarWriter* tar, uint64_t size) {
+    uint64_t tail = size % TAR_BLOCK_SIZE;
+    return tail == 0 || tar_write_zeros(tar, TAR_BLOCK_SIZE - tail);
+}
+
+static void set_octal(char* field, size_t width, uint64_t value) {
+    // width - 1 digits and a terminating NUL.
+    snprintf(field, width, "%0*llo", (int)(width - 1), (unsigned long long)value);
+}
+
+// Splits name into the ustar prefix and name fields at a '/'.
+static bool split_name(TarHeader* header, const char* name) {
+    size_t length = strlen(name);
+    if (length <= sizeof(header->name)) {
+        memcpy(header->name, name, length);
+        return true;
+    }
+
+    for (size_t i = length - 1; i > 0; i--) {
+        if (name[i] != '/') {
+            continue;
+        }
+        if (i > sizeof(header->prefix)) {
+            continue;
+        }
+        if (length - i - 1 > sizeof(header->name)) {
+            return false;
+        }
+        memcpy(header->prefix, name, i);
+        memcpy(header->name, name + i + 1, length - i - 1);
+        return true;
+    }
+    return false;
+}
+
+// Appends "<length> key=value\n", where length counts the whole record.
+static bool append_pax_record(char* records, size_t capacity, size_t* used, const char* key, const char* value) {
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t length = body + 1;
+    while (length != body + (size_t)snprintf(NULL, 0, "%zu", length)) {
+        length = body + (size_t)snprintf(NULL, 0, "%zu", length);
+    }
+    if (*used + length + 1 > capacity) {
+        return false;
+    }
+    snprintf(records + *used, capacity - *used, "%zu %s=%s\n", length, key, value);
+    *used += length;
+    return true;
+}
+
+static void finish_header(TarWriter* tar, TarHeader* header, char typeflag, uint64_t size) {
+    set_octal(header->mode, sizeof(header->mode), typeflag == '5' ? 0755 : 0644);
+    set_octal(header->uid, sizeof(header->uid), 0);
+    set_octal(header->gid, sizeof(header->gid), 0);
+    set_octal(header->size, sizeof(header->size), size > TAR_MAX_OCTAL_SIZE ? 0 : size);
+    set_octal(header->mtime, sizeof(header->mtime), tar->mtime);
+    header->typeflag = typeflag;
+    memcpy(header->magic, "ustar", 6);
+    memcpy(header->version, "00", 2);
+
+    memset(header->checksum, ' ', sizeof(header->checksum));
+    const uint8_t* bytes = (const uint8_t*)header;
+    unsigned checksum = 0;
+    for (size_t i = 0; i < sizeof(TarHeader); i++) {
+        checksum += bytes[i];
+    }
+    snprintf(header->checksum, sizeof(header->checksum), "%06o", checksum);
+    header->checksum[7] = ' ';
+}
+
+static bool write_header(TarWriter* tar, const char* name, char typeflag, uint64_t size) {
+    TarHeader header;
+    memset(&header, 0, sizeof(header));
+
+    bool long_name = !split_name(&header, name);
+    if (long_name || size > TAR_MAX_OCTAL_SIZE) {
+        char records[MAX_PATH_LENGTH * 4];
+        size_t used = 0;
+        if (long_name && !append_pax_record(records, sizeof(records), &used, "path", name)) {
+            log_printf("Name too long for the tar archive, skipping: %s\n", name);
+            return false;
+        }
+        if (size > TAR_MAX_OCTAL_SIZE) {
+            char value[32];
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)size);
+            append_pax_record(records, sizeof(records), &used, "size", value);
+        }
+
+        TarHeader pax;
+        memset(&pax, 0, sizeof(pax));
+        const char* base = strrchr(name, '/');
+        snprintf(pax.name, sizeof(pax.name), "PaxHeaders/%.88s", base ? base + 1 : name);
+        finish_header(tar, &pax, 'x', used);
+        if (!tar_write(tar, &pax, sizeof(pax)) || !tar_write(tar, records, used) || !tar_pad(tar, used)) {
+            return false;
+        }
+
+        if (long_name) {
+            // Readers without pax support still get a recognisable, if cut off,
+            // name. The field needs no NUL when it is full.
+            const char* short_name = base ? base + 1 : name;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.name, short_name, min(strlen(short_name), sizeof(header.name)));
+        }
+    }
+
+    finish_header(tar, &header, typeflag, size);
+    return tar_write(tar, &header, sizeof(header));
+}
+
+bool tar_writer_open(TarWriter* tar, const char* path) {
+    memset(tar, 0, sizeof(TarWriter));
+
+    tar->to_stdout = strcmp(path, TAR_STDOUT) == 0;
+    tar->fp = tar->to_stdout ? stdout : fopen(path, "wb");
+    if (!tar->fp) {
+        log_perror(path);
+        return false;
+    }
+#ifdef _WIN32
+    if (tar->to_stdout) {
+        _setmode(_fileno(stdout), _O_BINARY);
+    }
+#endif
+    // Members are mostly small files; batch them into large writes.
+    setvbuf(tar->fp, NULL, _IOFBF, TAR_STREAM_BUFFER);
+
+    tar->mtime = (uint64_t)time(NULL);
+    mutex_init(&tar->mutex);
+    return true;
+}
+
+bool tar_writer_add_directory(TarWriter* tar, const char* name) {
+    char dir_name[MAX_PATH_LENGTH * 2];
+    if ((size_t)snprintf(dir_name, sizeof(dir_name), "%s/", name) >= sizeof(dir_name)) {
+        log_printf("Name too long for the tar archive, skipping: %s\n", name);
+        return false;
+    }
+
+    mutex_lock(&tar->mutex);
+    bool written = write_header(tar, dir_name, '5', 0);
+    mutex_unlock(&tar->mutex);
+    return written;
+}
+
+bool tar_writer_begin_file(TarWriter* tar, const char* name, uint64_t size) {
+    mutex_lock(&tar->mutex);
+    tar->member_size = size;
+    tar->member_written = 0;
+    if (!write_header(tar, name, '0', size)) {
+        tar->member_size = 0;
+        mutex_unlock(&tar->mutex);
+        return false;
+    }
+    return true;
+}
+
+bool tar_writer_write(TarWriter* tar, const void* data, size_t size) {
+    if (size > tar->member_size - tar->member_written) {
+        log_printf("Tar member is longer than announced\n");
+        return false;
+    }
+    if (!tar_write(tar, data, size)) {
+        return false;
+    }
+    tar->member_written += size;
+    return true;
+}
+
+bool tar_writer_end_file(TarWriter* tar) {
+    bool complete = tar->member_written == tar->member_size;
+    if (!tar_write_zeros(tar, tar->member_size - tar->member_written) || !tar_pad(tar, tar->member_size)) {
+        complete = false;
+    }
+    tar->member_size = 0;
+    tar->member_written = 0;
+    mutex_unlock(&tar->mutex);
+    return complete;
+}
+
+bool tar_writer_close(TarWriter* tar) {
+    tar_write_zeros(tar, 2 * TAR_BLOCK_SIZE);
+
+    if (tar->to_stdout) {
+        if (fflush(stdout) != 0 && !tar->failed) {
+            log_perror("stdout");
+            tar->failed = true;
+        }
+    }
+    else if (fclose(tar->fp) != 0 && !tar->failed) {
+        log_perror("tar");
+        tar->failed = true;
+    }
+    mutex_destroy(&tar->mutex);
+
+    bool ok = !tar->failed;
+    memset(tar, 0, sizeof(TarWriter));
+    return ok;
+}
@@ -0,0 +1,113 @@
+#include "thread.h"
+#include <stdlib.h>
+
+typedef struct {
+    ThreadFunc func;
+    void* arg;
+} ThreadStart;
+
+#ifdef _WIN32
+#include <process.h>
+
+static unsigned __stdcall thread_entry(void* param) {
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.func(start.arg);
+    return 0;
+}
+
+bool thread_create(Thread* thread, ThreadFunc func, void* arg) {
+    ThreadStart* start = malloc(sizeof(ThreadStart));
+    if (!start) return false;
+    start->func = func;
+    start->arg = arg;
+
+    uintptr_t handle = _beginthreadex(NULL, 0, thread_entry, start, 0, NULL);
+    if (handle == 0) {
+        free(start);
+        return false;
+    }
+    *thread = (HANDLE)handle;
+    return true;
+}
+
+void thread_join(Thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+void mutex_init(Mutex* mutex) { InitializeSRWLock(mutex); }
+void mutex_lock(Mutex* mutex) { AcquireSRWLockExclusive(mutex); }
+void mutex_unlock(Mutex* mutex) { ReleaseSRWLockExclusive(mutex); }
+void mutex_destroy(Mutex* mutex) { (void)mutex; }
+
+void cond_init(CondVar* cond) { InitializeConditionVariable(cond); }
+void cond_wait(CondVar* cond, Mutex* mutex) { SleepConditionVariableSRW(cond, mutex, INFINITE, 0); }
+void cond_signal(CondVar* cond) { WakeConditionVariable(cond); }
+void cond_broadcast(CondVar* cond) { WakeAllConditionVariable(cond); }
+void cond_destroy(CondVar* cond) { (void)cond; }
+
+int cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+uint64_t monotonic_ns(void) {
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+}
+
+#else
+#include <unistd.h>
+#include <time.h>
+
+static void* thread_entry(void* param) {
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.func(start.arg);
+    return NULL;
+}
+
+bool thread_create(Thread* thread, ThreadFunc func, void* arg) {
+    ThreadStart* start = malloc(sizeof(ThreadStart));
+    if (!start) return false;
+    start->func = func;
+    start->arg = arg;
+
+    if (pthread_create(thread, NULL, thread_entry, start) != 0) {
+        free(start);
+        return false;
+    }
+    return true;
+}
+
+void thread_join(Thread thread) {
+    pthread_join(thread, NULL);
+}
+
+void mutex_init(Mutex* mutex) { pthread_mutex_init(mutex, NULL); }
+void mutex_lock(Mutex* mutex) { pthread_mutex_lock(mutex); }
+void mutex_unlock(Mutex* mutex) { pthread_mutex_unlock(mutex); }
+void mutex_destroy(Mutex* mutex) { pthread_mutex_destroy(mutex); }
+
+void cond_init(CondVar* cond) { pthread_cond_init(cond, NULL); }
+void cond_wait(CondVar* cond, Mutex* mutex) { pthread_cond_wait(cond, mutex); }
+void cond_signal(CondVar* cond) { pthread_cond_signal(cond); }
+void cond_broadcast(CondVar* cond) { pthread_cond_broadcast(cond); }
+void cond_destroy(CondVar* cond) { pthread_cond_destroy(cond); }
+
+int cpu_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#endif
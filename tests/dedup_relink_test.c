@@ -0,0 +1,127 @@
+// Extracting over a tree built with --dedup-store must replace the links
+// into the store, never write through them: the blob is shared by every
+// tree linked to it. Running as root makes the blob's read-only mode no
+// protection, so the test relies on the sink alone.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "sink.h"
+#include "dedup.h"
+
+#ifdef _WIN32
+  #include <direct.h>
+  #include <process.h>
+  #define GETPID _getpid
+  #define RMDIR _rmdir
+#else
+  #include <unistd.h>
+  #define GETPID getpid
+  #define RMDIR rmdir
+#endif
+
+static const char g_stored[] = "contents kept in the store";
+static const char g_replaced[] = "contents of a later plain run";
+
+static bool write_text(void* context, ExtractSink* sink, SinkFile* file) {
+    const char* text = (const char*)context;
+    return sink_write_file(sink, file, text, strlen(text));
+}
+
+static bool file_holds(const char* path, const char* text) {
+    char buffer[64];
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        return false;
+    }
+    size_t read = fread(buffer, 1, sizeof(buffer), fp);
+    fclose(fp);
+    return read == strlen(text) && memcmp(buffer, text, read) == 0;
+}
+
+int main(void) {
+    const char* temp = getenv("TMPDIR");
+    if (!temp || !*temp) {
+#ifdef _WIN32
+        temp = getenv("TEMP");
+        if (!temp || !*temp) {
+            temp = ".";
+        }
+#else
+        temp = "/tmp";
+#endif
+    }
+
+    char root[MAX_PATH_LENGTH];
+    char store_dir[MAX_PATH_LENGTH];
+    char tree[MAX_PATH_LENGTH];
+    char linked[MAX_PATH_LENGTH];
+    int root_length = snprintf(root, sizeof(root), "%s%sdedup_relink_%lu", temp, PATH_SEPARATOR,
+        (unsigned long)GETPID());
+    if (root_length < 0 || (size_t)root_length + 16 >= sizeof(root)) {
+        fprintf(stderr, "Temporary directory path too long: %s\n", temp);
+        return 1;
+    }
+    if (snprintf(store_dir, sizeof(store_dir), "%s%sstore", root, PATH_SEPARATOR) < 0 ||
+        snprintf(tree, sizeof(tree), "%s%stree", root, PATH_SEPARATOR) < 0 ||
+        snprintf(linked, sizeof(linked), "%s%sfile.bin", tree, PATH_SEPARATOR) < 0) {
+        return 1;
+    }
+
+    DedupStore store;
+    if (!create_directories(tree) || !dedup_store_open(&store, store_dir)) {
+        fprintf(stderr, "Could not create %s\n", root);
+        return 1;
+    }
+
+    // What a --dedup-store run leaves behind: the file is a link to its blob.
+    char blob_path[DEDUP_PATH_LENGTH];
+    bool duplicate = false;
+    uint64_t size = 0;
+    DedupFile* blob = dedup_file_create(&store);
+    bool ok = blob && dedup_file_write(blob, g_stored, strlen(g_stored)) &&
+        dedup_file_finish(blob, blob_path, sizeof(blob_path), &duplicate, &size) &&
+        dedup_link(&store, blob_path, linked);
+    if (!ok) {
+        fprintf(stderr, "Could not link %s into the store\n", linked);
+    }
+
+    if (ok) {
+        ExtractSink sink;
+        sink_init_directory(&sink, tree);
+        ok = sink_extract_file(&sink, "file.bin", strlen(g_replaced), 0, write_text, (void*)g_replaced);
+        if (!ok) {
+            fprintf(stderr, "Could not extract over %s\n", linked);
+        }
+    }
+    if (ok && !file_holds(linked, g_replaced)) {
+        fprintf(stderr, "%s does not hold the new contents\n", linked);
+        ok = false;
+    }
+    if (ok && !file_holds(blob_path, g_stored)) {
+        fprintf(stderr, "Extracting over %s changed the blob %s\n", linked, blob_path);
+        ok = false;
+    }
+
+    remove(linked);
+    RMDIR(tree);
+    if (blob_path[0] != '\0') {
+        remove(blob_path);
+        char* name = strrchr(blob_path, PATH_SEPARATOR[0]);
+        if (name) {
+            *name = '\0';
+            RMDIR(blob_path);
+        }
+    }
+    char temp_dir[DEDUP_PATH_LENGTH];
+    snprintf(temp_dir, sizeof(temp_dir), "%s%stmp", store_dir, PATH_SEPARATOR);
+    RMDIR(temp_dir);
+    RMDIR(store_dir);
+    RMDIR(root);
+    dedup_store_close(&store);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}